@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <dirent.h>
 
 #define DBUS_API_SUBJECT_TO_CHANGE
 #include <dbus/dbus.h>
@@ -16,6 +17,7 @@
 #define MAX_PATH_LEN 4096
 
 #include "interface.h"
+#include "zero-status.h"
 
 /* This is changed only when debugging */
 static const char *mnt_dir = "/uri/0install";
@@ -78,12 +80,20 @@ static void usage(const char *prog, int status)
 		"%s site\t\t\t(refresh given site)\n"
 		"%s site/path date\t(refresh 'site' if 'path' is\n"
 		"\t\t\t\t missing, or older than 'date')\n"
+		"%s --prefetch site/path\t(fetch everything under\n"
+		"\t\t\t\t 'path' now)\n"
+		"%s site site...\t\t(refresh all the given sites)\n"
+		"%s --all\t\t\t(refresh every site in the cache)\n"
+		"%s -l site...|--all\t(just rebuild, don't fetch)\n"
+		"%s --status path...\t(say whether each path is cached,\n"
+		"\t\t\t\t without fetching anything; '-' reads\n"
+		"\t\t\t\t paths from stdin. Fails unless all are)\n"
 		"\n"
 		"Example: %s python.org/python2.2 2003-01-01\n\n"
 		"This checks that %s/python.org/python2.2 \n"
 		"exists and has a modification time after Jan 1st,\n"
 		"2003, and forces a refresh if not.\n",
-		prog, prog, prog, prog, mnt_dir);
+		prog, prog, prog, prog, prog, prog, prog, prog, prog, mnt_dir);
 
 	exit(status);
 }
@@ -91,10 +101,10 @@ static void usage(const char *prog, int status)
 #define DBUS_SERVER_SOCKET_PRE "unix:path="
 #define DBUS_SERVER_SOCKET_POST "/.lazyfs-cache/.control2"
 
-static void refresh(const char *site, int force)
+/* Connect to the helper's control socket. Exits on error. */
+static DBusConnection *connect_to_helper(void)
 {
 	DBusConnection *connection;
-	DBusMessage *message, *reply;
 	DBusError error;
 	char *server_socket;
 	int server_socket_len;
@@ -125,6 +135,45 @@ static void refresh(const char *site, int force)
 		exit(EXIT_FAILURE);
 	}
 
+	return connection;
+}
+
+/* Send 'message' to the helper and wait up to 'timeout' ms for the reply,
+ * which is returned (unref it). Exits if it fails.
+ */
+static DBusMessage *call_helper(DBusMessage *message, int timeout)
+{
+	DBusConnection *connection;
+	DBusMessage *reply;
+	DBusError error;
+
+	connection = connect_to_helper();
+
+	dbus_error_init(&error);
+	reply = dbus_connection_send_with_reply_and_block(connection, message,
+				timeout, &error);
+	dbus_message_unref(message);
+	if (reply && dbus_set_error_from_message(&error, reply)) {
+		dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	if (!reply) {
+		fprintf(stderr, "%s: %s\n", error.name, error.message);
+		dbus_error_free(&error);
+		exit(EXIT_FAILURE);
+	}
+
+	dbus_connection_disconnect(connection);
+	dbus_connection_unref(connection);
+
+	return reply;
+}
+
+static void refresh(const char *site, int force)
+{
+	DBusMessage *message;
+
 	message = dbus_message_new_method_call(NULL, "/Main",
 			DBUS_Z_NS, force ? "Refresh" : "Rebuild");
 	if (!message) {
@@ -137,23 +186,238 @@ static void refresh(const char *site, int force)
 		exit(EXIT_FAILURE);
 	}
 
-	reply = dbus_connection_send_with_reply_and_block(connection, message,
-				5 * 60 * 1000, &error);
-	dbus_message_unref(message);
-	if (reply && dbus_set_error_from_message(&error, reply)) {
-		dbus_message_unref(reply);
-		reply = NULL;
+	dbus_message_unref(call_helper(message, 5 * 60 * 1000));
+}
+
+/* Refresh (or just rebuild, if 'force' is 0) all 'n' sites with a single
+ * request, and report how each one went. Returns the exit status.
+ */
+static int refresh_many(const char **sites, int n, int force)
+{
+	DBusMessage *message, *reply;
+	DBusError error;
+	char **names, **results;
+	int n_names, n_results;
+	int i, failed = 0;
+
+	message = dbus_message_new_method_call(NULL, "/Main",
+			DBUS_Z_NS, force ? "RefreshMany" : "RebuildMany");
+	if (!message) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!dbus_message_append_args(message,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, sites, n,
+				DBUS_TYPE_INVALID)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
 	}
 
-	if (!reply) {
+	reply = call_helper(message, 60 * 60 * 1000);
+
+	dbus_error_init(&error);
+	if (!dbus_message_get_args(reply, &error,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&names, &n_names,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&results, &n_results,
+				DBUS_TYPE_INVALID)) {
 		fprintf(stderr, "%s: %s\n", error.name, error.message);
 		dbus_error_free(&error);
 		exit(EXIT_FAILURE);
 	}
-
 	dbus_message_unref(reply);
-	dbus_connection_disconnect(connection);
-	dbus_connection_unref(connection);
+
+	for (i = 0; i < n_names && i < n_results; i++) {
+		if (results[i][0]) {
+			printf("%s: %s\n", names[i], results[i]);
+			failed = 1;
+		} else
+			printf("%s: OK\n", names[i]);
+	}
+
+	dbus_free_string_array(names);
+	dbus_free_string_array(results);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Refresh (or rebuild) every site in the cache. Returns the exit status. */
+static int refresh_all(int force)
+{
+	char cache[MAX_PATH_LEN];
+	const char **sites = NULL;
+	struct dirent *ent;
+	int n = 0, status;
+	DIR *dir;
+
+	if (snprintf(cache, sizeof(cache), "%s/.lazyfs-cache", mnt_dir)
+			>= sizeof(cache)) {
+		fprintf(stderr, "Path too long\n");
+		return EXIT_FAILURE;
+	}
+
+	dir = opendir(cache);
+	if (!dir) {
+		perror(cache);
+		return EXIT_FAILURE;
+	}
+
+	while ((ent = readdir(dir))) {
+		char path[MAX_PATH_LEN];
+		struct stat info;
+
+		if (ent->d_name[0] == '.')
+			continue;	/* Ours, not a site */
+		if (snprintf(path, sizeof(path), "%s/%s", cache, ent->d_name)
+				>= sizeof(path) ||
+		    stat(path, &info) || !S_ISDIR(info.st_mode))
+			continue;
+
+		sites = realloc(sites, (n + 1) * sizeof(char *));
+		if (sites)
+			sites[n] = strdup(ent->d_name);
+		if (!sites || !sites[n]) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		n++;
+	}
+	closedir(dir);
+
+	if (!n) {
+		printf("No sites in the cache\n");
+		return EXIT_SUCCESS;
+	}
+
+	status = refresh_many(sites, n, force);
+
+	while (n)
+		free((char *) sites[--n]);
+	free(sites);
+
+	return status;
+}
+
+/* Add the lines of stdin to 'paths' (of length 'n'). Exits on OOM. */
+static void read_paths(const char ***paths, int *n)
+{
+	char line[MAX_PATH_LEN];
+
+	while (fgets(line, sizeof(line), stdin)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!line[0])
+			continue;
+		*paths = realloc(*paths, (*n + 1) * sizeof(char *));
+		if (!*paths || !((*paths)[*n] = strdup(line))) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		(*n)++;
+	}
+}
+
+/* Report whether each of 'args' is cached ("-" to read paths from stdin).
+ * Returns the exit status: success only if they all are.
+ */
+static int cache_status(const char **args, int n_args)
+{
+	const char **paths = NULL;
+	ZeroCacheStatus *answers;
+	char err[256];
+	int i, n = 0, all_cached = 1;
+
+	for (i = 0; i < n_args; i++) {
+		if (strcmp(args[i], "-") == 0) {
+			read_paths(&paths, &n);
+			continue;
+		}
+		paths = realloc(paths, (n + 1) * sizeof(char *));
+		if (!paths || !(paths[n] = strdup(args[i]))) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		n++;
+	}
+
+	answers = malloc((n + 1) * sizeof(ZeroCacheStatus));
+	if (!answers) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (zero_status_query(paths, n, answers, err, sizeof(err))) {
+		fprintf(stderr, "%s\n", err);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		ZeroCacheStatus *answer = &answers[i];
+
+		if (answer->state == ZERO_CACHED) {
+			printf("%s: cached\n", paths[i]);
+			continue;
+		}
+
+		all_cached = 0;
+		if (answer->state == ZERO_MISSING)
+			printf("%s: missing (group %s, %lld bytes)\n", paths[i],
+				answer->group, (long long) answer->size);
+		else if (answer->state == ZERO_NOT_FOUND)
+			printf("%s: not found\n", paths[i]);
+		else
+			printf("%s: unknown site\n", paths[i]);
+	}
+
+	for (i = 0; i < n; i++)
+		free((char *) paths[i]);
+	if (paths)
+		free(paths);
+	free(answers);
+
+	return all_cached ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* 1 if 'str' is a date parse_date() would accept */
+static int is_date(const char *str)
+{
+	struct tm tm_date;
+	const char *end;
+
+	memset(&tm_date, 0, sizeof(tm_date));
+	end = strptime(str, "%Y-%m-%d,%R", &tm_date);
+	if (!end)
+		end = strptime(str, "%Y-%m-%d", &tm_date);
+
+	return end && !*end;
+}
+
+/* Fetch everything under 'path' (site/path) into the cache now */
+static void prefetch(const char *path)
+{
+	DBusMessage *message;
+	char full[MAX_PATH_LEN];
+
+	if (snprintf(full, sizeof(full), "/%s", path) >= sizeof(full)) {
+		fprintf(stderr, "Path too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	message = dbus_message_new_method_call(NULL, "/Main",
+			DBUS_Z_NS, "Prefetch");
+	if (!message) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!dbus_message_append_args(message,
+				 DBUS_TYPE_STRING, full,
+				 DBUS_TYPE_BOOLEAN, 1,
+				 DBUS_TYPE_INVALID)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	dbus_message_unref(call_helper(message, 60 * 60 * 1000));
 }
 
 static int uptodate(const char *path, time_t mtime)
@@ -203,12 +467,32 @@ int main(int argc, char **argv)
 		if (slash)
 			*slash = '\0';
 		refresh(site, 1);
+	} else if (argc > 2 && strcmp(argv[1], "--status") == 0) {
+		/* 0refresh --status path... */
+		return cache_status((const char **) argv + 2, argc - 2);
+	} else if (argc == 2 && strcmp(argv[1], "--all") == 0) {
+		/* 0refresh --all */
+		return refresh_all(1);
 	} else if (argc == 2) {
 		/* 0refresh site */
 		refresh(argv[1], 1);
+	} else if (argc == 3 && strcmp(argv[1], "--prefetch") == 0) {
+		/* 0refresh --prefetch site/path */
+		prefetch(argv[2]);
+	} else if (argc == 3 && strcmp(argv[1], "-l") == 0 &&
+		   strcmp(argv[2], "--all") == 0) {
+		/* 0refresh -l --all */
+		return refresh_all(0);
 	} else if (argc == 3 && strcmp(argv[1], "-l") == 0) {
 		/* 0refresh -l site */
 		refresh(argv[2], 0);
+	} else if (argc > 3 && strcmp(argv[1], "-l") == 0) {
+		/* 0refresh -l site site... */
+		return refresh_many((const char **) argv + 2, argc - 2, 0);
+	} else if (argc > 3 || (argc == 3 && !strchr(argv[1], '/') &&
+				!is_date(argv[2]))) {
+		/* 0refresh site site... */
+		return refresh_many((const char **) argv + 1, argc - 1, 1);
 	} else if (argc == 3) {
 		/* 0refresh site/path date */
 		time_t mtime = 0;
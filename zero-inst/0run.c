@@ -89,6 +89,33 @@ static void force_fetch(char *path)
 	}
 }
 
+/* Ask the helper to fetch everything under 'path' (site/path) now, so the
+ * program doesn't have to wait for each file as it needs it. Failure
+ * isn't fatal; the files will just be fetched as they're used.
+ */
+static void prefetch(char *path)
+{
+	pid_t child;
+	int status;
+
+	child = fork();
+	if (child == -1) {
+		perror("fork");
+		return;
+	}
+
+	if (child == 0) {
+		execlp("0refresh", "0refresh", "--prefetch", path, NULL);
+		perror("execlp(0refresh)");
+		_exit(1);
+	}
+
+	if (waitpid(child, &status, 0) != child)
+		perror("waitpid");
+	else if (!WIFEXITED(status) || WEXITSTATUS(status))
+		fprintf(stderr, "Prefetching '%s' failed; continuing\n", path);
+}
+
 int main(int argc, char **argv)
 {
 	struct stat info;
@@ -96,15 +123,25 @@ int main(int argc, char **argv)
 	char *path;
 	char *date;
 	int len;
+	int want_prefetch = 0;
+
+	if (argc > 1 && strcmp(argv[1], "--prefetch") == 0) {
+		want_prefetch = 1;
+		argv++;
+		argc--;
+	}
 
 	if (argc < 2) {
-		fprintf(stderr, "Usage: /bin/0run \"program time\" [args]\n\n"
+		fprintf(stderr, "Usage: /bin/0run [--prefetch] "
+			"\"program time\" [args]\n\n"
 			"Run 'program' (a pathname under " ZERO_MNT ").\n"
 			"If the mtime is earlier than 'time' (GMT), force a\n"
 			"refresh (and abort on failure). 'args' are passed\n"
 			"to the program unmodifed.\n"
 			"If 'program' is a directory, then program/AppRun is\n"
-			"assumed.\n\n"
+			"assumed.\n"
+			"With --prefetch, everything in the program's\n"
+			"directory is fetched before it is run.\n\n"
 			"Example:\n"
 			"#!/bin/0run python.org/python 2003-01-01\n"
 			);
@@ -145,6 +182,20 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (want_prefetch) {
+		char *dir = path + sizeof(ZERO_MNT);
+		char *slash = NULL;
+
+		/* For a program file, prefetch the directory containing it */
+		if (!S_ISDIR(info.st_mode))
+			slash = strrchr(dir, '/');
+		if (slash)
+			*slash = '\0';
+		prefetch(dir);
+		if (slash)
+			*slash = '/';
+	}
+
 	if (S_ISDIR(info.st_mode))
 	{
 		char *old = path;
@@ -0,0 +1,172 @@
+/*
+ * Zero Install -- status display
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Shows what the helper is doing, from its status table (see
+ * zero-status.h). This doesn't talk to the helper at all, so it's cheap to
+ * leave running with -w.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "zero-status.h"
+
+static void usage(const char *prog, int status)
+{
+	printf("Usage:\n"
+		"%s\t\t\t(show what zero-install is doing)\n"
+		"%s -w\t\t\t(keep showing it, every second)\n"
+		"%s --file=PATH\t\t(read another status table)\n",
+		prog, prog, prog);
+
+	exit(status);
+}
+
+/* Print 'bytes' in a short form */
+static void print_size(long long bytes)
+{
+	if (bytes < 0)
+		printf("%8s", "?");
+	else if (bytes < 10 * 1024)
+		printf("%7lldB", bytes);
+	else if (bytes < 10 * 1024 * 1024)
+		printf("%7lldK", bytes / 1024);
+	else
+		printf("%7lldM", bytes / (1024 * 1024));
+}
+
+/* The entry for task 'n', or NULL */
+static ZeroStatusEntry *find_task(ZeroStatusEntry *entries, int n_entries,
+				  int n)
+{
+	int i;
+
+	for (i = 0; i < n_entries; i++) {
+		if (entries[i].task == n)
+			return &entries[i];
+	}
+
+	return NULL;
+}
+
+static void show(ZeroStatusEntry *entries, int n)
+{
+	int i;
+
+	if (!n) {
+		printf("Nothing happening\n");
+		return;
+	}
+
+	printf("%5s %5s %-11s %8s %8s %8s  %s\n",
+		"TASK", "UID", "STATE", "GOT", "SIZE", "RATE/s", "PATH");
+
+	for (i = 0; i < n; i++) {
+		ZeroStatusEntry *entry = &entries[i];
+		ZeroStatusEntry *download = entry;
+
+		/* Show a request's progress as that of its download */
+		if (entry->state == ZERO_STATUS_WAITING) {
+			ZeroStatusEntry *child;
+
+			child = find_task(entries, n, entry->waiting_for);
+			if (child && child->state == ZERO_STATUS_DOWNLOADING)
+				download = child;
+		}
+
+		printf("%5d ", entry->task);
+		if (entry->uid == -1)
+			printf("%5s ", "-");
+		else
+			printf("%5d ", entry->uid);
+		printf("%-11s ", zero_status_state_name(entry->state));
+
+		if (download->state == ZERO_STATUS_DOWNLOADING) {
+			print_size(download->received);
+			printf(" ");
+			print_size(download->size);
+			printf(" ");
+			print_size(download->rate);
+		} else
+			printf("%8s %8s %8s", "", "", "");
+
+		if (entry->state == ZERO_STATUS_WAITING)
+			printf("  %s (for task %d)\n", entry->path,
+				entry->waiting_for);
+		else
+			printf("  %s\n", entry->path);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static ZeroStatusEntry entries[ZERO_STATUS_SLOTS];
+	const char *file = NULL;
+	ZeroStatus *status = NULL;
+	int watch = 0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-w") == 0)
+			watch = 1;
+		else if (strncmp(argv[i], "--file=", 7) == 0)
+			file = argv[i] + 7;
+		else if (strcmp(argv[i], "--help") == 0)
+			usage(argv[0], EXIT_SUCCESS);
+		else
+			usage(argv[0], EXIT_FAILURE);
+	}
+
+	while (1) {
+		int n;
+
+		/* A restarted helper writes a new table */
+		if (status && !zero_status_running(status)) {
+			zero_status_close(status);
+			status = NULL;
+		}
+
+		if (!status) {
+			status = zero_status_open(file);
+			if (!status && !watch) {
+				fprintf(stderr, "Can't read status table: %s\n"
+					"(is zero-install running?)\n",
+					strerror(errno));
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (watch)
+			printf("\n");
+
+		if (!status || !zero_status_running(status))
+			printf("zero-install is not running\n");
+		else {
+			n = zero_status_read(status, entries,
+					     ZERO_STATUS_SLOTS);
+			show(entries, n);
+		}
+
+		if (!watch)
+			break;
+
+		fflush(stdout);
+		sleep(1);
+	}
+
+	zero_status_close(status);
+
+	return EXIT_SUCCESS;
+}
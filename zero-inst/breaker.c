@@ -0,0 +1,276 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Circuit breakers. When a site or mirror is unreachable, every request
+ * would otherwise wait for wget to give up on it, one after another.
+ * Instead, after BREAKER_FAILURES downloads from a site (or mirror) fail
+ * in a row, new downloads from it fail at once for BREAKER_COOLDOWN
+ * seconds. After that, one download is let through as a probe; if it
+ * works, things return to normal, otherwise we wait again.
+ *
+ * Sites are keyed by name, and mirrors by their base URI. We watch the
+ * wget processes to see what worked. Downloads which were killed (eg,
+ * cancelled by the user) don't count either way.
+ *
+ * In offline mode, nothing is downloaded at all; only cached files can
+ * be used.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "global.h"
+#include "support.h"
+#include "zero-install.h"
+#include "breaker.h"
+
+#define BREAKER_FAILURES 3	/* Failures in a row to trip a breaker */
+#define BREAKER_COOLDOWN 30	/* Seconds before trying again */
+#define BREAKERS_MAX 64
+
+typedef struct _Breaker Breaker;
+typedef struct _Download Download;
+
+struct _Breaker {
+	char *key;		/* Site or mirror; NULL if unused */
+	int failures;		/* In a row */
+	time_t retry;		/* When tripped, time to send a probe */
+	pid_t probe;		/* Probe in progress, or 0 */
+};
+
+/* A wget process we're watching */
+struct _Download {
+	pid_t pid;
+	char *site;
+	char *mirror;		/* Base URI, or NULL */
+
+	Download *next;
+};
+
+static Breaker breakers[BREAKERS_MAX];
+static Download *downloads = NULL;
+static int cooldown = BREAKER_COOLDOWN;
+
+static Breaker *find_breaker(const char *key)
+{
+	int i;
+
+	for (i = 0; i < BREAKERS_MAX; i++) {
+		if (breakers[i].key && strcmp(breakers[i].key, key) == 0)
+			return &breakers[i];
+	}
+
+	return NULL;
+}
+
+/* Find the breaker for 'key', creating it if needed. When the table is
+ * full, a closed breaker makes way. NULL if there's no room.
+ */
+static Breaker *get_breaker(const char *key)
+{
+	Breaker *b, *slot = NULL;
+	int i;
+
+	b = find_breaker(key);
+	if (b)
+		return b;
+
+	for (i = 0; i < BREAKERS_MAX; i++) {
+		b = &breakers[i];
+		if (!b->key) {
+			slot = b;
+			break;
+		}
+		if (b->failures < BREAKER_FAILURES && !b->probe &&
+		    (!slot || b->failures < slot->failures))
+			slot = b;
+	}
+
+	if (!slot)
+		return NULL;
+
+	if (slot->key)
+		free(slot->key);
+	slot->key = my_strdup(key);
+	if (!slot->key)
+		return NULL;
+	slot->failures = 0;
+	slot->retry = 0;
+	slot->probe = 0;
+
+	return slot;
+}
+
+/* 1 if we may start a download from site or mirror 'key' now */
+int breaker_allow(const char *key)
+{
+	Breaker *b;
+
+	if (offline)
+		return 0;
+
+	b = find_breaker(key);
+	if (!b || b->failures < BREAKER_FAILURES)
+		return 1;
+
+	/* Tripped. Wait for the cool-down, then let one probe through. */
+	return !b->probe && time(NULL) >= b->retry;
+}
+
+/* A download from 'site' (and 'mirror', if not NULL) has started as
+ * process 'pid'.
+ */
+void breaker_started(pid_t pid, const char *site, const char *mirror)
+{
+	Download *d;
+	Breaker *b;
+
+	d = my_malloc(sizeof(Download));
+	if (!d)
+		return;
+	d->pid = pid;
+	d->site = my_strdup(site);
+	d->mirror = mirror ? my_strdup(mirror) : NULL;
+	if (!d->site || (mirror && !d->mirror)) {
+		if (d->site)
+			free(d->site);
+		if (d->mirror)
+			free(d->mirror);
+		free(d);
+		return;
+	}
+	d->next = downloads;
+	downloads = d;
+
+	b = find_breaker(site);
+	if (b && b->failures >= BREAKER_FAILURES && !b->probe)
+		b->probe = pid;
+	if (mirror) {
+		b = find_breaker(mirror);
+		if (b && b->failures >= BREAKER_FAILURES && !b->probe)
+			b->probe = pid;
+	}
+}
+
+static void record(const char *key, pid_t pid, int ok)
+{
+	Breaker *b;
+
+	b = ok ? find_breaker(key) : get_breaker(key);
+	if (!b)
+		return;
+
+	if (b->probe == pid)
+		b->probe = 0;
+
+	if (ok) {
+		if (b->failures >= BREAKER_FAILURES)
+			syslog(LOG_INFO, "'%s' is working again", key);
+		b->failures = 0;
+		return;
+	}
+
+	b->failures++;
+	if (b->failures >= BREAKER_FAILURES) {
+		if (b->failures == BREAKER_FAILURES)
+			error("Too many failures from '%s'; not trying it "
+			      "again for a while", key);
+		b->retry = time(NULL) + cooldown;
+	}
+}
+
+/* Child process 'pid' has exited with 'status'. If it was a download,
+ * update the breakers.
+ */
+void breaker_child_done(pid_t pid, int status)
+{
+	Download **prev, *d;
+
+	for (prev = &downloads; *prev; prev = &(*prev)->next) {
+		if ((*prev)->pid == pid)
+			break;
+	}
+	d = *prev;
+	if (!d)
+		return;
+	*prev = d->next;
+
+	if (WIFEXITED(status)) {
+		int ok = WEXITSTATUS(status) == 0;
+
+		record(d->site, pid, ok);
+		if (d->mirror)
+			record(d->mirror, pid, ok);
+	} else {
+		/* Killed; just forget about any probe */
+		Breaker *b;
+
+		b = find_breaker(d->site);
+		if (b && b->probe == pid)
+			b->probe = 0;
+		b = d->mirror ? find_breaker(d->mirror) : NULL;
+		if (b && b->probe == pid)
+			b->probe = 0;
+	}
+
+	free(d->site);
+	if (d->mirror)
+		free(d->mirror);
+	free(d);
+}
+
+/* Get the tripped breakers. Sets 'keys' to a new array of 'n' keys
+ * (free the array, but not the strings), and 'failures' and 'retry'
+ * (seconds until the next probe, or 0) to new arrays to go with them.
+ * 0 on OOM.
+ */
+int breaker_list(const char ***keys, int **failures, int **retry, int *n)
+{
+	time_t now = time(NULL);
+	int i;
+
+	*n = 0;
+	*keys = my_malloc(BREAKERS_MAX * sizeof(char *));
+	*failures = my_malloc(BREAKERS_MAX * sizeof(int));
+	*retry = my_malloc(BREAKERS_MAX * sizeof(int));
+	if (!*keys || !*failures || !*retry) {
+		if (*keys)
+			free(*keys);
+		if (*failures)
+			free(*failures);
+		if (*retry)
+			free(*retry);
+		return 0;
+	}
+
+	for (i = 0; i < BREAKERS_MAX; i++) {
+		Breaker *b = &breakers[i];
+
+		if (!b->key || b->failures < BREAKER_FAILURES)
+			continue;
+		(*keys)[*n] = b->key;
+		(*failures)[*n] = b->failures;
+		(*retry)[*n] = b->retry > now ? b->retry - now : 0;
+		(*n)++;
+	}
+
+	return 1;
+}
+
+/* Wait 'seconds' before probing a tripped breaker instead (for testing) */
+void breaker_set_cooldown(int seconds)
+{
+	cooldown = seconds;
+}
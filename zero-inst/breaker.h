@@ -0,0 +1,5 @@
+int breaker_allow(const char *key);
+void breaker_started(pid_t pid, const char *site, const char *mirror);
+void breaker_child_done(pid_t pid, int status);
+int breaker_list(const char ***keys, int **failures, int **retry, int *n);
+void breaker_set_cooldown(int seconds);
@@ -0,0 +1,523 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* The catalog records which groups are in the cache, so that we don't
+ * have to look at the files themselves to find out. It is a fixed-size
+ * table, mapped from the .0inst-catalog file in the cache root: a header,
+ * CATALOG_SITES site records and a hash table of CATALOG_GROUPS group
+ * records (open addressing, keyed on the group's MD5sum and directory).
+ *
+ * Each site has a generation (the mtime of its index.xml). When a new
+ * index is unpacked, the site's groups must be checked against the disk
+ * again (gc.c does this), and until then the catalog can't answer
+ * questions about the site.
+ *
+ * The header is marked dirty while the helper is running. If it's still
+ * dirty when we start (we crashed), or it's the wrong version, the whole
+ * catalog is thrown away and rebuilt from the disk as for a new index.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "global.h"
+#include "support.h"
+#include "index.h"
+#include "zero-install.h"
+#include "xml.h"
+#include "catalog.h"
+
+#define CATALOG_MAGIC "0inst-catalog-1"
+#define CATALOG_SITES 256
+
+/* Group states */
+#define CAT_FREE 0
+#define CAT_PRESENT 1		/* All files are cached */
+#define CAT_PARTIAL 2		/* Some files are cached */
+#define CAT_DELETED 3		/* Was used (keep probing past it) */
+
+typedef struct _CatalogHeader CatalogHeader;
+typedef struct _CatalogSite CatalogSite;
+
+struct _CatalogHeader {
+	char magic[16];
+	int dirty;
+	int n_groups;
+	long long bytes;	/* Total of all groups */
+};
+
+struct _CatalogSite {
+	char name[256];		/* "" if unused */
+	long long generation;	/* Of the current index */
+	long long scanned;	/* Generation last checked against the disk */
+	long long bytes;
+	int n_groups;
+	int pad;
+};
+
+static CatalogHeader *header = NULL;
+static CatalogSite *sites = NULL;
+static CatalogGroup *groups = NULL;
+static size_t map_size = 0;
+
+unsigned int catalog_hash(const char *str)
+{
+	unsigned int hash = 2166136261u;	/* FNV-1a */
+
+	while (*str)
+		hash = (hash ^ (unsigned char) *str++) * 16777619u;
+
+	return hash;
+}
+
+/* Open (creating or resetting if needed) the catalog. If 'reset' is set,
+ * throw away what's there and rebuild from the disk. 0 on error (the
+ * helper will then work without it).
+ */
+int catalog_open(int reset)
+{
+	CatalogHeader old;
+	char *path;
+	void *map;
+	int fd;
+
+	map_size = sizeof(CatalogHeader) + CATALOG_SITES * sizeof(CatalogSite) +
+		   CATALOG_GROUPS * sizeof(CatalogGroup);
+
+	path = build_string("%s/.0inst-catalog", cache_dir);
+	if (!path)
+		return 0;
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		error("open(%s): %m", path);
+		free(path);
+		return 0;
+	}
+	free(path);
+
+	if (read(fd, &old, sizeof(old)) != sizeof(old) ||
+	    memcmp(old.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0 ||
+	    old.dirty)
+		reset = 1;
+
+	/* Truncating first fills it with zeros */
+	if ((reset && ftruncate(fd, 0)) || ftruncate(fd, map_size)) {
+		error("ftruncate catalog: %m");
+		my_close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	my_close(fd);
+	if (map == MAP_FAILED) {
+		error("mmap catalog: %m");
+		return 0;
+	}
+
+	header = map;
+	sites = (CatalogSite *) (header + 1);
+	groups = (CatalogGroup *) (sites + CATALOG_SITES);
+
+	if (reset) {
+		syslog(LOG_INFO, "Rebuilding cache catalog");
+		strcpy(header->magic, CATALOG_MAGIC);
+	}
+	header->dirty = 1;
+
+	return 1;
+}
+
+/* Called on a clean shutdown */
+void catalog_close(void)
+{
+	if (!header)
+		return;
+	header->dirty = 0;
+	munmap(header, map_size);
+	header = NULL;
+}
+
+/* The record for 'site', created if 'create' is set. NULL if not found
+ * (or the table is full).
+ */
+static CatalogSite *find_site(const char *site, int create)
+{
+	CatalogSite *free_slot = NULL;
+	int i;
+
+	if (!header || strlen(site) >= sizeof(sites[0].name))
+		return NULL;
+
+	for (i = 0; i < CATALOG_SITES; i++) {
+		if (strcmp(sites[i].name, site) == 0)
+			return &sites[i];
+		if (!free_slot && !sites[i].name[0])
+			free_slot = &sites[i];
+	}
+
+	if (!create || !free_slot)
+		return NULL;
+
+	memset(free_slot, 0, sizeof(*free_slot));
+	strcpy(free_slot->name, site);
+	return free_slot;
+}
+
+/* Find the record for 'group' in cache-relative directory 'dir'
+ * ("/site/dir"). If 'create' is set and it isn't there, a new one is
+ * returned (with state CAT_FREE or CAT_DELETED).
+ */
+static CatalogGroup *find_group(const char *dir, Element *group, int create)
+{
+	CatalogGroup *g, *reuse = NULL;
+	const char *md5;
+	CatalogSite *site;
+	char site_name[256];
+	unsigned int hash, start, i;
+	const char *slash;
+	unsigned char state;
+
+	if (!header)
+		return NULL;
+
+	md5 = xml_get_attr(group, "MD5sum");
+	slash = strchr(dir + 1, '/');
+	i = slash ? slash - dir - 1 : strlen(dir + 1);
+	if (!md5 || strlen(md5) >= sizeof(g->md5) || i >= sizeof(site_name))
+		return NULL;
+	memcpy(site_name, dir + 1, i);
+	site_name[i] = '\0';
+
+	site = find_site(site_name, create);
+	if (!site)
+		return NULL;
+
+	hash = catalog_hash(dir);
+	start = hash ^ catalog_hash(md5);
+
+	for (i = 0; i < CATALOG_GROUPS; i++) {
+		g = &groups[(start + i) & (CATALOG_GROUPS - 1)];
+
+		if (g->state == CAT_FREE)
+			break;
+		if (g->state == CAT_DELETED) {
+			if (!reuse)
+				reuse = g;
+			continue;
+		}
+		if (g->dir_hash == hash && g->site == site - sites &&
+		    strcmp(g->md5, md5) == 0)
+			return g;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (!reuse) {
+		if (i == CATALOG_GROUPS || header->n_groups >=
+					   CATALOG_GROUPS * 3 / 4) {
+			error("Cache catalog is full");
+			return NULL;
+		}
+		reuse = g;
+	}
+
+	/* Keep the state, so that probing still works if it isn't used */
+	state = reuse->state;
+	memset(reuse, 0, sizeof(*reuse));
+	reuse->state = state;
+	strcpy(reuse->md5, md5);
+	reuse->site = site - sites;
+	reuse->dir_hash = hash;
+	return reuse;
+}
+
+static void remove_group(CatalogGroup *g)
+{
+	CatalogSite *site = &sites[g->site];
+
+	header->bytes -= g->bytes;
+	header->n_groups--;
+	site->bytes -= g->bytes;
+	site->n_groups--;
+	g->state = CAT_DELETED;
+}
+
+static void set_group(CatalogGroup *g, long bytes, int complete, time_t used)
+{
+	CatalogSite *site = &sites[g->site];
+
+	if (g->state == CAT_FREE || g->state == CAT_DELETED) {
+		header->n_groups++;
+		site->n_groups++;
+	} else {
+		header->bytes -= g->bytes;
+		site->bytes -= g->bytes;
+	}
+
+	g->bytes = bytes;
+	g->used = used;
+	g->generation = site->generation;
+	header->bytes += bytes;
+	site->bytes += bytes;
+
+	/* Last, so a reader never sees a half-written record as present */
+	g->state = complete ? CAT_PRESENT : CAT_PARTIAL;
+}
+
+/* Record that 'bytes' of 'group' (in "/site/dir") are now cached, and
+ * whether that's the whole group. 'used' is the last access time.
+ */
+void catalog_group_cached(const char *dir, Element *group, long bytes,
+			  int complete, time_t used)
+{
+	CatalogGroup *g;
+
+	g = find_group(dir, group, 1);
+	if (g)
+		set_group(g, bytes, complete, used);
+}
+
+/* File 'item' (in "/site/dir") has been cached on its own */
+void catalog_file_cached(const char *dir, Element *item)
+{
+	CatalogGroup *g;
+	long size;
+
+	g = find_group(dir, item->parentNode, 1);
+	if (!g || g->state == CAT_PRESENT)
+		return;
+
+	size = atol(xml_get_attr(item, "size"));
+	set_group(g, g->state == CAT_PARTIAL ? g->bytes + size : size,
+		  0, time(NULL));
+}
+
+/* The files of 'group' in "/site/dir" have been deleted */
+void catalog_group_removed(const char *dir, Element *group)
+{
+	CatalogGroup *g;
+
+	g = find_group(dir, group, 0);
+	if (g)
+		remove_group(g);
+}
+
+/* 1 if all of 'group' (in "/site/dir") is cached, 0 if not, or -1 if we
+ * don't know (the site hasn't been checked since its index changed).
+ */
+int catalog_group_present(const char *dir, Element *group)
+{
+	CatalogGroup *g;
+	CatalogSite *site;
+	char site_name[256];
+	const char *slash;
+	int len;
+
+	if (!header)
+		return -1;
+
+	slash = strchr(dir + 1, '/');
+	len = slash ? slash - dir - 1 : strlen(dir + 1);
+	if (len >= sizeof(site_name))
+		return -1;
+	memcpy(site_name, dir + 1, len);
+	site_name[len] = '\0';
+
+	site = find_site(site_name, 0);
+	if (!site || !site->generation || site->scanned != site->generation)
+		return -1;
+
+	g = find_group(dir, group, 0);
+	return g && g->state == CAT_PRESENT;
+}
+
+/* A new index (with generation 'generation') has been unpacked for
+ * 'site'.
+ */
+void catalog_site_indexed(const char *site, long generation)
+{
+	CatalogSite *s;
+
+	s = find_site(site, 1);
+	if (s)
+		s->generation = generation;
+}
+
+/* 1 if 'site' needs checking against the disk. 'generation' is that of
+ * its current index.
+ */
+int catalog_site_needs_scan(const char *site, long generation)
+{
+	CatalogSite *s;
+
+	s = find_site(site, 0);
+	return !s || s->scanned != generation || s->generation != generation;
+}
+
+/* We're about to check every group of 'site' against the disk */
+void catalog_begin_scan(const char *site, long generation)
+{
+	catalog_site_indexed(site, generation);
+}
+
+/* We've finished checking 'site'. Anything not seen is no longer cached. */
+void catalog_end_scan(const char *site)
+{
+	CatalogSite *s;
+	int i;
+
+	s = find_site(site, 0);
+	if (!s)
+		return;
+
+	for (i = 0; i < CATALOG_GROUPS; i++) {
+		CatalogGroup *g = &groups[i];
+
+		if ((g->state == CAT_PRESENT || g->state == CAT_PARTIAL) &&
+		    g->site == s - sites && g->generation != s->generation)
+			remove_group(g);
+	}
+
+	s->scanned = s->generation;
+}
+
+/* 'group' was accessed at 'used' */
+void catalog_touch(CatalogGroup *group, time_t used)
+{
+	group->used = used;
+}
+
+/* The generation of site's current index (the mtime of index.xml), or 0
+ * if there isn't one.
+ */
+long catalog_generation(const char *site)
+{
+	struct stat info;
+	char *path;
+	int ok;
+
+	path = build_string("%s/%h/" META "/index.xml", cache_dir, site);
+	if (!path)
+		return 0;
+	ok = stat(path, &info) == 0;
+	free(path);
+
+	return ok ? info.st_mtime : 0;
+}
+
+/* Total bytes of cached groups */
+long catalog_total_bytes(void)
+{
+	return header ? header->bytes : 0;
+}
+
+const char *catalog_site_name(CatalogGroup *group)
+{
+	return sites[group->site].name;
+}
+
+/* Find the group with catalog record 'g' under 'dir_node' (whose
+ * cache-relative path is in 'path', MAX_PATH_LEN). Leaves the group's
+ * directory in 'path'.
+ */
+Element *catalog_find_group(CatalogGroup *g, Element *dir_node, char *path)
+{
+	Element *node;
+	int len = strlen(path);
+
+	for (node = dir_node->lastChild;
+	     node && g->dir_hash == catalog_hash(path);
+	     node = node->previousSibling) {
+		if (node->name[0] == 'g' &&
+		    strcmp(xml_get_attr(node, "MD5sum"), g->md5) == 0)
+			return node;
+	}
+
+	for (node = dir_node->lastChild; node; node = node->previousSibling) {
+		Element *found;
+
+		if (node->name[0] != 'd')
+			continue;
+		if (snprintf(path + len, MAX_PATH_LEN - len, "/%s",
+			     xml_get_attr(node, "name")) >= MAX_PATH_LEN - len)
+			continue;
+		found = catalog_find_group(g, node, path);
+		if (found)
+			return found;
+		path[len] = '\0';
+	}
+
+	return NULL;
+}
+
+/* Returns the next cached group at or after slot '*cursor' (starting from
+ * 0), and moves the cursor past it. NULL at the end. The groups don't
+ * move, so this can be spread over many steps; the percentage done is
+ * '*cursor' * 100 / CATALOG_GROUPS.
+ */
+CatalogGroup *catalog_next(int *cursor)
+{
+	if (!header)
+		return NULL;
+
+	while (*cursor < CATALOG_GROUPS) {
+		CatalogGroup *g = &groups[(*cursor)++];
+
+		if (g->state == CAT_PRESENT || g->state == CAT_PARTIAL)
+			return g;
+	}
+
+	return NULL;
+}
+
+static int compare_used(const void *a, const void *b)
+{
+	time_t ua = (*(CatalogGroup **) a)->used;
+	time_t ub = (*(CatalogGroup **) b)->used;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* Returns a new array of up to 'max' cached groups, least recently used
+ * first, setting 'n' to the number. NULL on error.
+ */
+CatalogGroup **catalog_lru(int max, int *n)
+{
+	CatalogGroup **all;
+	int i, n_all = 0;
+
+	*n = 0;
+	if (!header)
+		return NULL;
+
+	all = my_malloc((header->n_groups + 1) * sizeof(CatalogGroup *));
+	if (!all)
+		return NULL;
+
+	for (i = 0; i < CATALOG_GROUPS && n_all < header->n_groups; i++) {
+		if (groups[i].state == CAT_PRESENT ||
+		    groups[i].state == CAT_PARTIAL)
+			all[n_all++] = &groups[i];
+	}
+
+	qsort(all, n_all, sizeof(CatalogGroup *), compare_used);
+
+	*n = n_all < max ? n_all : max;
+	return all;
+}
@@ -0,0 +1,35 @@
+typedef struct _CatalogGroup CatalogGroup;
+
+#define CATALOG_GROUPS 65536	/* Slots; must be a power of two */
+
+/* A group's record in the catalog (see catalog.c) */
+struct _CatalogGroup {
+	char md5[40];		/* The group's MD5sum */
+	unsigned int dir_hash;	/* catalog_hash() of "/site/dir" */
+	unsigned short site;	/* Site record number */
+	unsigned char state;
+	unsigned char pad;
+	long long bytes;	/* Cached */
+	long long used;		/* Last access time */
+	long long generation;	/* Site generation when last seen */
+};
+
+unsigned int catalog_hash(const char *str);
+int catalog_open(int reset);
+void catalog_close(void);
+void catalog_group_cached(const char *dir, Element *group, long bytes,
+			  int complete, time_t used);
+void catalog_file_cached(const char *dir, Element *item);
+void catalog_group_removed(const char *dir, Element *group);
+int catalog_group_present(const char *dir, Element *group);
+void catalog_site_indexed(const char *site, long generation);
+int catalog_site_needs_scan(const char *site, long generation);
+void catalog_begin_scan(const char *site, long generation);
+void catalog_end_scan(const char *site);
+void catalog_touch(CatalogGroup *group, time_t used);
+long catalog_generation(const char *site);
+long catalog_total_bytes(void);
+const char *catalog_site_name(CatalogGroup *group);
+CatalogGroup **catalog_lru(int max, int *n);
+CatalogGroup *catalog_next(int *cursor);
+Element *catalog_find_group(CatalogGroup *g, Element *dir_node, char *path);
@@ -18,6 +18,18 @@
 #include "task.h"
 #include "fetch.h"
 #include "list.h"
+#include "prefetch.h"
+#include "trace.h"
+#include "mirrors.h"
+#include "negative.h"
+#include "breaker.h"
+#include "store.h"
+#include "scrub.h"
+#include "metrics.h"
+#include "spans.h"
+#include "log.h"
+#include "timer.h"
+#include "xml.h"
 
 #define ZERO_INSTALL_ERROR "net.sourceforge.zero_install.Error"
 
@@ -27,6 +39,7 @@ static DBusServer *server = NULL;
 static DBusWatch *current_watch = NULL;	/* tmp */
 
 static const char *current_error = NULL;
+static DBusMessage *current_progress = NULL;	/* For send_progress() */
 
 static DBusObjectPathVTable vtable;
 
@@ -36,10 +49,48 @@ static int dbus_version = -1;
 
 static void dbus_refresh(DBusConnection *connection, DBusMessage *message,
 			 DBusError *error, int force);
+static void dbus_refresh_many(DBusConnection *connection,
+			DBusMessage *message, DBusError *error, int force);
 static DBusMessage *handle_dbus_version(DBusConnection *connection,
 			DBusMessage *message, DBusError *error);
 static void dbus_cancel_download(DBusConnection *connection,
 			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_export_trace(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_import_trace(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static void dbus_prefetch(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_plan(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_negative_stats(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_set_offline(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_breakers(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_store_stats(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_scrub_status(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_stats(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_set_spans(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_dump_spans(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_set_log_level(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static DBusMessage *dbus_cache_status(DBusConnection *connection,
+			DBusMessage *message, DBusError *error);
+static void start_progress_timer(void);
+static int privileged(DBusConnection *connection, DBusError *error);
+
+/* Monitors are told about new downloads and progress at most this often */
+#define PROGRESS_MS 250
+
+/* Index fetches at once for a RefreshMany request */
+#define BATCH_ACTIVE_MAX 4
 
 #define OLD_SOCKET "/uri/0install/.lazyfs-cache/control"
 #define OLD_SOCKET2 "/uri/0install/.lazyfs-cache/.control"
@@ -47,6 +98,8 @@ static void dbus_cancel_download(DBusConnection *connection,
 static ListHead dispatches = LIST_INIT;
 static ListHead monitors = LIST_INIT;
 
+static Timer *progress_timer = NULL;
+
 static void remove_watch(DBusWatch *watch, void *data)
 {
 	DBusWatch *w;
@@ -180,9 +233,12 @@ static void dbus_monitor(DBusConnection *connection, DBusError *error)
 	for (task = all_tasks; task; task = task->next) {
 		if ((task->type == TASK_CLIENT || task->type == TASK_KERNEL) &&
 		    task->child_task && task->uid == uid) {
+			task->flags &= ~TASK_UPDATE_PENDING;
 			send_task_update(connection, task);
 		}
 	}
+
+	start_progress_timer();
 }
 
 static DBusHandlerResult message_handler(DBusConnection *connection,
@@ -201,6 +257,16 @@ static DBusHandlerResult message_handler(DBusConnection *connection,
 		dbus_refresh(connection, message, &error, 0);
 		if (dbus_error_is_set(&error))
 			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "RefreshMany")) {
+		dbus_refresh_many(connection, message, &error, 1);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "RebuildMany")) {
+		dbus_refresh_many(connection, message, &error, 0);
+		if (dbus_error_is_set(&error))
+			goto err;
 	} else if (dbus_message_is_method_call(message, DBUS_Z_NS, "Monitor")) {
 		dbus_monitor(connection, &error);
 		if (dbus_error_is_set(&error))
@@ -209,6 +275,74 @@ static DBusHandlerResult message_handler(DBusConnection *connection,
 		dbus_cancel_download(connection, message, &error);
 		if (dbus_error_is_set(&error))
 			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "Prefetch")) {
+		dbus_prefetch(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "SetOffline")) {
+		reply = dbus_set_offline(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "Breakers")) {
+		reply = dbus_breakers(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "StoreStats")) {
+		reply = dbus_store_stats(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "ScrubStatus")) {
+		reply = dbus_scrub_status(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS, "Stats")) {
+		reply = dbus_stats(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "SetSpans")) {
+		reply = dbus_set_spans(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "DumpSpans")) {
+		reply = dbus_dump_spans(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "SetLogLevel")) {
+		reply = dbus_set_log_level(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "NegativeStats")) {
+		reply = dbus_negative_stats(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "CacheStatus")) {
+		reply = dbus_cache_status(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS, "Plan")) {
+		reply = dbus_plan(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "ExportTrace")) {
+		reply = dbus_export_trace(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
+	} else if (dbus_message_is_method_call(message, DBUS_Z_NS,
+					       "ImportTrace")) {
+		reply = dbus_import_trace(connection, message, &error);
+		if (dbus_error_is_set(&error))
+			goto err;
 	} else if (dbus_message_is_method_call(message, DBUS_Z_NS, "Version")) {
 		reply = handle_dbus_version(connection, message, &error);
 		if (dbus_error_is_set(&error))
@@ -528,6 +662,7 @@ static int cancel_download(const char *request, uid_t uid)
 				kernel_cancel_task(task);
 
 			fetch_set_auto_reject(request, uid);
+			prefetch_backoff();
 
 			return 1;
 		}
@@ -555,6 +690,96 @@ static void dbus_cancel_download(DBusConnection *connection,
 	}
 }
 
+/* 1 if 'site' is safe to use as a directory name in the cache */
+static int valid_site(const char *site)
+{
+	return !strchr(site, '/') && site[0] != '.' && *site;
+}
+
+/* Reply with the access traces recorded for a site (see trace.c) */
+static DBusMessage *dbus_export_trace(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	char *site = NULL;
+	char *data = NULL;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_STRING, &site, DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (!valid_site(site)) {
+		dbus_set_error_const(error, "Error", "Bad hostname");
+		goto out;
+	}
+
+	data = trace_export(site);
+	if (!data) {
+		dbus_set_error_const(error, "Error", "Can't read traces");
+		goto out;
+	}
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_STRING, data,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
+	}
+out:
+	if (data)
+		free(data);
+	free(site);
+	return reply;
+}
+
+/* Add traces (as from ExportTrace) to a site's traces. Root only, since
+ * the files named get prefetched for everyone.
+ */
+static DBusMessage *dbus_import_trace(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	char *site = NULL;
+	char *data = NULL;
+	const char *err;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_STRING, &site,
+				DBUS_TYPE_STRING, &data,
+				DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (!privileged(connection, error))
+		goto out;
+
+	if (!valid_site(site))
+		err = "Bad hostname";
+	else
+		err = trace_import(site, data);
+
+	if (err) {
+		dbus_set_error_const(error, "Error", err);
+		goto out;
+	}
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_BOOLEAN, 1,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
+	}
+out:
+	free(site);
+	free(data);
+	return reply;
+}
+
 static DBusMessage *handle_dbus_version(DBusConnection *connection,
 			DBusMessage *message, DBusError *error)
 {
@@ -575,104 +800,1135 @@ static DBusMessage *handle_dbus_version(DBusConnection *connection,
 	return reply;
 }
 
-/* Message requests the cache for 'host' be refetched.
- * (force is 0 if we're rebuilding due to a changed override.xml)
- * Returns error, or NULL on success.
- */
-static void dbus_refresh(DBusConnection *connection, DBusMessage *message,
-			 DBusError *error, int force)
+/* Reply with the negative cache's hits, misses and size */
+static DBusMessage *dbus_negative_stats(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
 {
-	char *site;
-	Task *task = NULL;
-	unsigned long uid;
-	Index *index;
+	DBusMessage *reply = NULL;
+	long hits, misses;
+	int entries;
 
-	if (!dbus_message_get_args(message, error,
-				DBUS_TYPE_STRING, &site, DBUS_TYPE_INVALID))
-		return;
+	if (!dbus_message_get_args(message, error, DBUS_TYPE_INVALID))
+		return NULL;
 
-	if (strchr(site, '/') || site[0] == '.' || !*site) {
-		dbus_set_error_const(error, "Error", "Bad hostname");
-		goto done;
+	negative_stats(&hits, &misses, &entries);
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_INT64, (dbus_int64_t) hits,
+				DBUS_TYPE_INT64, (dbus_int64_t) misses,
+				DBUS_TYPE_INT32, (dbus_int32_t) entries,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
 	}
 
-	task = task_new(TASK_CLIENT);
-	if (!task)
-		goto oom;
-	task->step = send_result;
-	if (!dbus_connection_get_unix_user(connection, &uid))
-		assert(0);
-	task->uid = uid;
-	task_set_message(task, connection, message);
+	return reply;
+}
 
-	task->str = build_string("/%s", site);
-	if (!task->str)
-		goto oom;
+/* Anyone may connect, so methods which affect every user check this
+ * first. 1 if the caller is root (or the user we run as); otherwise sets
+ * 'error' and returns 0.
+ */
+static int privileged(DBusConnection *connection, DBusError *error)
+{
+	unsigned long uid;
 
-	index = get_index(task->str, &task->child_task, force);
-	if (index) {
-		/* Already cached, and we didn't force a refresh.
-		 * Rebuild site, as override.xml may have changed.
-		 */
-		if (build_ddds_for_site(index, site)) {
-			send_ok(task);
-		} else {
-			dbus_set_error_const(error, "Error",
-				"Failed to rebuild '...' index files");
-		}
-		index_free(index);
-		goto done;
+	if (!dbus_connection_get_unix_user(connection, &uid)) {
+		error("Can't get UID");
+		dbus_set_error_const(error, "Error", "Can't get UID");
+		return 0;
 	}
 
-	if (task->child_task) {
-		control_notify_update(task);
-	} else {
-		dbus_set_error_const(error, "Error",
-				"Failed to start fetching index");
-		goto done;
+	if (uid != 0 && uid != getuid()) {
+		dbus_set_error_const(error, "Error", "Permission denied");
+		return 0;
 	}
 
-	free(site);
-	return;
-oom:
-	dbus_set_error_const(error, "Error", "Out of memory");
-done:
-	if (task)
-		task_destroy(task, error ? error->message : NULL);
-	if (site)
-		free(site);
+	return 1;
 }
 
-void control_check_select(fd_set *rfds, fd_set *wfds)
+/* Message turns offline mode on or off. Replies with the old setting.
+ * Only for root, since it stops everyone's downloads.
+ */
+static DBusMessage *dbus_set_offline(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
 {
-	current_watch = dbus_watches;
-	while (current_watch) {
-		DBusWatch *this = current_watch;
+	DBusMessage *reply = NULL;
+	dbus_bool_t new;
+	int old = offline;
 
-		/* current_watch may get moved forward by remove_watch */
-		current_watch = dbus_watch_get_data(this);
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_BOOLEAN, &new,
+				DBUS_TYPE_INVALID))
+		return NULL;
 
-		if (dbus_watch_get_enabled(this)) {
-			int fd = dbus_watch_get_fd(this);
-			unsigned int flags = 0;
+	if (!privileged(connection, error))
+		return NULL;
 
-			if (FD_ISSET(fd, rfds))
-				flags |= DBUS_WATCH_READABLE;
-			if (FD_ISSET(fd, wfds))
-				flags |= DBUS_WATCH_WRITABLE;
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_BOOLEAN, old,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		return NULL;
+	}
 
-			if (flags && !dbus_watch_handle(this, flags)) {
-				/* XXX: OOM */
-				printf("[ OOM ]\n");
-			}
-		}
+	offline = new != 0;
+	if (offline != old)
+		syslog(LOG_INFO, "Offline mode %s", offline ? "on" : "off");
+
+	return reply;
+}
+
+/* Reply with whether we're offline, and the sites and mirrors whose
+ * circuit breakers have tripped, with their failure counts and the
+ * seconds until they will be tried again.
+ */
+static DBusMessage *dbus_breakers(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	const char **keys;
+	int *failures, *retry;
+	int n;
+
+	if (!dbus_message_get_args(message, error, DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (!breaker_list(&keys, &failures, &retry, &n)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		return NULL;
 	}
-	current_watch = NULL;
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_BOOLEAN, offline,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, keys, n,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_INT32,
+					(dbus_int32_t *) failures, n,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_INT32,
+					(dbus_int32_t *) retry, n,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	free(keys);
+	free(failures);
+	free(retry);
+	return reply;
 }
 
+/* Reply with the number of files in the store (see store.c), the bytes
+ * they use, and the bytes saved by sharing them.
+ */
+static DBusMessage *dbus_store_stats(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	long entries, bytes, saved;
+
+	if (!dbus_message_get_args(message, error, DBUS_TYPE_INVALID))
+		return NULL;
+
+	store_scan(0, &entries, &bytes, &saved);
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_INT32, (dbus_int32_t) entries,
+				DBUS_TYPE_INT64, (dbus_int64_t) bytes,
+				DBUS_TYPE_INT64, (dbus_int64_t) saved,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	return reply;
+}
+
+/* Reply with whether the scrubber is on, how far through its pass it is
+ * (percent), the groups and bytes checked in this pass, the number of
+ * damaged groups found, and the most recent problems.
+ */
+static DBusMessage *dbus_scrub_status(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	long groups, bytes, damaged;
+	char **recent;
+	int percent, n_recent;
+
+	if (!dbus_message_get_args(message, error, DBUS_TYPE_INVALID))
+		return NULL;
+
+	scrub_status(&percent, &groups, &bytes, &damaged, &recent, &n_recent);
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_BOOLEAN, scrub_rate != 0,
+				DBUS_TYPE_INT32, (dbus_int32_t) percent,
+				DBUS_TYPE_INT64, (dbus_int64_t) groups,
+				DBUS_TYPE_INT64, (dbus_int64_t) bytes,
+				DBUS_TYPE_INT32, (dbus_int32_t) damaged,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					recent, n_recent,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	return reply;
+}
+
+/* Reply with the name and current value of every metric (see metrics.c) */
+static DBusMessage *dbus_stats(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	char **names;
+	double *values;
+	int i, n;
+
+	if (!dbus_message_get_args(message, error, DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (!metrics_list(&names, &values, &n)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		return NULL;
+	}
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, names, n,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_DOUBLE, values, n,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+	free(values);
+	return reply;
+}
+
+/* Set how many recent spans to keep (see spans.c), discarding any already
+ * recorded; 0 stops recording. Reply with the old setting.
+ */
+static DBusMessage *dbus_set_spans(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	dbus_int32_t capacity;
+	int old = span_capacity;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_INT32, &capacity,
+				DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (!privileged(connection, error))
+		return NULL;
+
+	if (!spans_set_capacity(capacity)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		return NULL;
+	}
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_INT32, (dbus_int32_t) old,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		return NULL;
+	}
+
+	syslog(LOG_INFO, "Keeping %d spans", span_capacity);
+
+	return reply;
+}
+
+/* Reply with the recorded spans, as Chrome trace event JSON */
+static DBusMessage *dbus_dump_spans(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	char *json;
+
+	if (!dbus_message_get_args(message, error, DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (!privileged(connection, error))
+		return NULL;
+
+	json = spans_export();
+	if (!json) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		return NULL;
+	}
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_STRING, json,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	free(json);
+	return reply;
+}
+
+/* Set the syslog level (eg, 7 for LOG_DEBUG) of a subsystem (see log.c),
+ * or of "all" of them. Reply with the old level.
+ */
+static DBusMessage *dbus_set_log_level(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	char *subsystem = NULL;
+	dbus_int32_t level;
+	int old;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_STRING, &subsystem,
+				DBUS_TYPE_INT32, &level,
+				DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (!privileged(connection, error))
+		goto out;
+
+	if (level < LOG_EMERG || level > LOG_DEBUG) {
+		dbus_set_error_const(error, "Error", "Bad log level");
+		goto out;
+	}
+
+	old = log_set_level(subsystem, level);
+	if (old == -1) {
+		dbus_set_error_const(error, "Error", "No such subsystem");
+		goto out;
+	}
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_INT32, (dbus_int32_t) old,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply)
+			dbus_message_unref(reply);
+		reply = NULL;
+	}
+out:
+	free(subsystem);
+	return reply;
+}
+
+/* Message requests the cache for 'host' be refetched.
+ * (force is 0 if we're rebuilding due to a changed override.xml)
+ * Returns error, or NULL on success.
+ */
+static void dbus_refresh(DBusConnection *connection, DBusMessage *message,
+			 DBusError *error, int force)
+{
+	char *site;
+	Task *task = NULL;
+	unsigned long uid;
+	Index *index;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_STRING, &site, DBUS_TYPE_INVALID))
+		return;
+
+	if (!valid_site(site)) {
+		dbus_set_error_const(error, "Error", "Bad hostname");
+		goto done;
+	}
+
+	task = task_new(TASK_CLIENT);
+	if (!task)
+		goto oom;
+	task->step = send_result;
+	if (!dbus_connection_get_unix_user(connection, &uid))
+		assert(0);
+	task->uid = uid;
+	task_set_message(task, connection, message);
+
+	task->str = build_string("/%s", site);
+	if (!task->str)
+		goto oom;
+
+	if (force)
+		negative_clear(site);
+
+	index = get_index(task->str, &task->child_task, force);
+	if (index) {
+		/* Already cached, and we didn't force a refresh.
+		 * Rebuild site, as override.xml may have changed.
+		 */
+		if (build_ddds_for_site(index, site)) {
+			send_ok(task);
+		} else {
+			dbus_set_error_const(error, "Error",
+				"Failed to rebuild '...' index files");
+		}
+		index_free(index);
+		goto done;
+	}
+
+	if (task->child_task) {
+		control_notify_update(task);
+	} else {
+		dbus_set_error_const(error, "Error",
+				"Failed to start fetching index");
+		goto done;
+	}
+
+	free(site);
+	return;
+oom:
+	dbus_set_error_const(error, "Error", "Out of memory");
+done:
+	if (task)
+		task_destroy(task, error ? error->message : NULL);
+	if (site)
+		free(site);
+}
+
+/* RefreshMany and RebuildMany: Refresh or Rebuild for each of an array
+ * of sites, BATCH_ACTIVE_MAX index fetches at a time, with a single reply
+ * when they've all finished: the sites and, for each one, "" if it
+ * worked or else the error.
+ */
+
+typedef struct _Batch Batch;
+
+struct _Batch {
+	Task *client;		/* Has the message to reply to */
+	char **sites;		/* From the message */
+	char **results;		/* NULL until the site is done */
+	int n_sites;
+	int next;		/* Next site to start */
+	int active;		/* Index fetches running */
+	int force;
+};
+
+static const char *batch_oom = "Out of memory";
+
+static void batch_run(Batch *batch);
+
+/* Site 'i' is done. 'err' is NULL on success. */
+static void batch_set_result(Batch *batch, int i, const char *err)
+{
+	batch->results[i] = my_strdup(err ? err : "");
+	if (!batch->results[i])
+		batch->results[i] = (char *) batch_oom;
+}
+
+/* The index fetch for a site has finished (or failed) */
+static void batch_part_done(Task *part, const char *err)
+{
+	Batch *batch = part->data;
+	int i;
+
+	/* The same site may be in the batch twice, sharing a fetch */
+	for (i = 0; i < batch->next; i++) {
+		if (!batch->results[i] &&
+		    strcmp(batch->sites[i], part->str) == 0)
+			break;
+	}
+	assert(i < batch->next);
+
+	batch_set_result(batch, i, err);
+	batch->active--;
+
+	task_destroy(part, NULL);
+
+	batch_run(batch);
+}
+
+/* Start refreshing (or rebuilding) site 'i', as dbus_refresh() would.
+ * Either records the result now, or adds a part waiting for the index.
+ */
+static void batch_start(Batch *batch, int i)
+{
+	const char *site = batch->sites[i];
+	Task *child = NULL, *part;
+	Index *index;
+	char *path;
+
+	if (!valid_site(site)) {
+		batch_set_result(batch, i, "Bad hostname");
+		return;
+	}
+
+	path = build_string("/%s", site);
+	if (!path) {
+		batch_set_result(batch, i, batch_oom);
+		return;
+	}
+
+	if (batch->force)
+		negative_clear(site);
+
+	index = get_index(path, &child, batch->force);
+	free(path);
+	if (index) {
+		batch_set_result(batch, i, build_ddds_for_site(index, site) ?
+				 NULL : "Failed to rebuild '...' index files");
+		index_free(index);
+		return;
+	}
+
+	if (!child) {
+		batch_set_result(batch, i, "Failed to start fetching index");
+		return;
+	}
+
+	part = task_new(TASK_SUBTASK);
+	if (part)
+		task_set_string(part, site);
+	if (!part || !part->str) {
+		if (part)
+			task_destroy(part, NULL);
+		batch_set_result(batch, i, batch_oom);
+		return;
+	}
+	part->data = batch;
+	part->child_task = child;
+	part->step = batch_part_done;
+	batch->active++;
+}
+
+static void batch_free(Batch *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->n_sites; i++) {
+		if (batch->results && batch->results[i] &&
+		    batch->results[i] != batch_oom)
+			free(batch->results[i]);
+	}
+	if (batch->results)
+		free(batch->results);
+	dbus_free_string_array(batch->sites);
+	free(batch);
+}
+
+/* Start more of the batch's sites, or reply if they're all done */
+static void batch_run(Batch *batch)
+{
+	DBusMessage *reply;
+	Task *client = batch->client;
+
+	while (batch->active < BATCH_ACTIVE_MAX &&
+	       batch->next < batch->n_sites) {
+		batch->next++;
+		batch_start(batch, batch->next - 1);
+	}
+
+	if (batch->active || batch->next < batch->n_sites)
+		return;
+
+	reply = dbus_message_new_method_return(client->message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					batch->sites, batch->n_sites,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					batch->results, batch->n_sites,
+				DBUS_TYPE_INVALID) ||
+	    !dbus_connection_send(client->connection, reply, NULL))
+		error("Out of memory");
+	if (reply)
+		dbus_message_unref(reply);
+
+	client->data = NULL;
+	task_destroy(client, NULL);
+	batch_free(batch);
+}
+
+/* Message asks for an array of sites to be refreshed (or rebuilt, if
+ * 'force' is 0). See Batch, above.
+ */
+static void dbus_refresh_many(DBusConnection *connection,
+			DBusMessage *message, DBusError *error, int force)
+{
+	Batch *batch;
+	Task *task;
+	unsigned long uid;
+	char **sites;
+	int n_sites;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&sites, &n_sites,
+				DBUS_TYPE_INVALID))
+		return;
+
+	batch = my_malloc(sizeof(Batch));
+	if (!batch) {
+		dbus_free_string_array(sites);
+		goto oom;
+	}
+	batch->sites = sites;
+	batch->n_sites = n_sites;
+	batch->next = batch->active = 0;
+	batch->force = force;
+	batch->results = my_malloc((n_sites + 1) * sizeof(char *));
+	if (!batch->results) {
+		batch_free(batch);
+		goto oom;
+	}
+	memset(batch->results, 0, (n_sites + 1) * sizeof(char *));
+
+	task = task_new(TASK_CLIENT);
+	if (!task) {
+		batch_free(batch);
+		goto oom;
+	}
+	if (!dbus_connection_get_unix_user(connection, &uid))
+		assert(0);
+	task->uid = uid;
+	task->data = batch;
+	task_set_message(task, connection, message);
+	batch->client = task;
+
+	batch_run(batch);
+	return;
+oom:
+	dbus_set_error_const(error, "Error", "Out of memory");
+}
+
+/* We have (or failed to get) the index for a Prefetch request */
+static void prefetch_got_index(Task *task, const char *err)
+{
+	if (!err)
+		task_steal_index(task, get_index(task->str, NULL, 0));
+
+	if (!task->index) {
+		send_result(task, err ? err : "Failed to get index");
+		return;
+	}
+
+	err = prefetch_start_job(task);
+	if (err)
+		send_result(task, err);
+}
+
+/* Message asks for everything under a path to be fetched now. We reply
+ * when it's all in the cache, sending PrefetchProgress signals to the
+ * caller as we go.
+ */
+static void dbus_prefetch(DBusConnection *connection, DBusMessage *message,
+			  DBusError *error)
+{
+	char *path = NULL;
+	dbus_bool_t recursive;
+	Task *task = NULL;
+	unsigned long uid;
+	Index *index;
+	const char *err;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_STRING, &path,
+				DBUS_TYPE_BOOLEAN, &recursive,
+				DBUS_TYPE_INVALID))
+		return;
+
+	/* Just check the site name; the rest is looked up in the index */
+	if (path[0] != '/' || path[1] == '.' || path[1] == '/' || !path[1]) {
+		dbus_set_error_const(error, "Error", "Bad path");
+		goto out;
+	}
+
+	task = task_new(TASK_CLIENT);
+	if (!task)
+		goto oom;
+	task->step = prefetch_got_index;
+	if (!dbus_connection_get_unix_user(connection, &uid))
+		assert(0);
+	task->uid = uid;
+	task_set_message(task, connection, message);
+	if (recursive)
+		task->flags |= TASK_RECURSIVE;
+
+	task_set_string(task, path);
+	if (!task->str)
+		goto oom;
+
+	index = get_index(task->str, &task->child_task, 0);
+	if (index) {
+		task_steal_index(task, index);
+		err = prefetch_start_job(task);
+		if (err) {
+			dbus_set_error_const(error, "Error", err);
+			goto out;
+		}
+		task = NULL;	/* Replies when done */
+	} else if (task->child_task) {
+		control_notify_update(task);
+		task = NULL;
+	} else {
+		dbus_set_error_const(error, "Error",
+				"Failed to start fetching index");
+	}
+	goto out;
+oom:
+	dbus_set_error_const(error, "Error", "Out of memory");
+out:
+	if (task)
+		task_destroy(task, NULL);
+	free(path);
+}
+
+/* Message asks what a Prefetch of the same path would fetch. Replies with
+ * the number of missing groups, their total size, an estimate of how many
+ * seconds they would take to fetch (-1 if we don't know the site's speed)
+ * and one file from each group. Only cached indexes are used; nothing is
+ * ever fetched.
+ */
+static DBusMessage *dbus_plan(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	char *path = NULL;
+	dbus_bool_t recursive;
+	Index *index = NULL;
+	char **files = NULL;
+	int n_groups = 0;
+	long bytes = 0, speed;
+	dbus_int32_t eta = -1;
+	const char *err;
+	int i;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_STRING, &path,
+				DBUS_TYPE_BOOLEAN, &recursive,
+				DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (path[0] != '/' || path[1] == '.' || path[1] == '/' || !path[1]) {
+		dbus_set_error_const(error, "Error", "Bad path");
+		goto out;
+	}
+
+	index = get_index(path, NULL, 0);
+	if (!index) {
+		dbus_set_error_const(error, "Error",
+				"Site index not cached (use Refresh first)");
+		goto out;
+	}
+
+	err = prefetch_plan(path, index, recursive,
+			    &files, &n_groups, &bytes);
+	if (err) {
+		dbus_set_error_const(error, "Error", err);
+		goto out;
+	}
+
+	speed = mirrors_get_throughput(index->site);
+	if (speed > 0)
+		eta = (bytes + speed - 1) / speed;
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_INT32, (dbus_int32_t) n_groups,
+				DBUS_TYPE_INT64, (dbus_int64_t) bytes,
+				DBUS_TYPE_INT32, eta,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					files, n_groups,
+				DBUS_TYPE_INVALID)) {
+		dbus_set_error_const(error, "Error", "Out of memory");
+		if (reply) {
+			dbus_message_unref(reply);
+			reply = NULL;
+		}
+	}
+out:
+	if (files) {
+		for (i = 0; i < n_groups; i++)
+			free(files[i]);
+		free(files);
+	}
+	if (index)
+		index_free(index);
+	free(path);
+	return reply;
+}
+
+/* 1 if 'path' (/site/...) is on 'index''s site */
+static int on_site(const char *path, Index *index)
+{
+	int len = strlen(index->site);
+
+	return strncmp(path + 1, index->site, len) == 0 &&
+	       (path[len + 1] == '/' || path[len + 1] == '\0');
+}
+
+/* Message asks whether each of an array of paths (/site/...) is cached,
+ * without fetching anything (not even indexes). Replies with a state for
+ * each one: "cached", "missing" (with the MD5sum and size of the group
+ * which would be fetched), "not-found" (not in the site's index) or
+ * "unknown-site" (the site's index isn't cached, or the site itself is
+ * known to be missing). The group is "" and the size 0 unless the state
+ * is "missing".
+ */
+static DBusMessage *dbus_cache_status(DBusConnection *connection,
+			DBusMessage *message, DBusError *error)
+{
+	DBusMessage *reply = NULL;
+	char **paths = NULL;
+	const char **states = NULL, **groups = NULL;
+	dbus_int64_t *sizes = NULL;
+	Index **indexes = NULL;
+	int n_paths, n_indexes = 0, i;
+
+	if (!dbus_message_get_args(message, error,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&paths, &n_paths,
+				DBUS_TYPE_INVALID))
+		return NULL;
+
+	states = my_malloc((n_paths + 1) * sizeof(char *));
+	groups = my_malloc((n_paths + 1) * sizeof(char *));
+	sizes = my_malloc((n_paths + 1) * sizeof(dbus_int64_t));
+	if (!states || !groups || !sizes)
+		goto oom;
+
+	/* The group strings are in the indexes, so keep each site's index
+	 * until we've replied (there are usually many paths on a few sites).
+	 */
+	for (i = 0; i < n_paths; i++) {
+		const char *path = paths[i];
+		Element *group;
+		Index *index = NULL;
+		int j;
+
+		states[i] = "unknown-site";
+		groups[i] = "";
+		sizes[i] = 0;
+
+		if (path[0] != '/' || path[1] == '.' || path[1] == '/' ||
+		    !path[1])
+			continue;
+
+		for (j = n_indexes - 1; j >= 0; j--) {
+			if (on_site(path, indexes[j])) {
+				index = indexes[j];
+				break;
+			}
+		}
+		if (!index) {
+			Index **new;
+			char *site;
+
+			/* Look up the site itself: get_index(path) would also
+			 * fail if just this path was known to be missing.
+			 */
+			site = build_string("/%h", path + 1);
+			if (!site)
+				goto oom;
+			index = get_index(site, NULL, 0);
+			free(site);
+			if (!index)
+				continue;
+			new = my_realloc(indexes,
+					 (n_indexes + 1) * sizeof(Index *));
+			if (!new) {
+				index_free(index);
+				goto oom;
+			}
+			indexes = new;
+			indexes[n_indexes++] = index;
+		}
+
+		switch (prefetch_path_cached(path, index, &group)) {
+			case 1:
+				states[i] = "cached";
+				break;
+			case 0:
+				states[i] = "missing";
+				groups[i] = xml_get_attr(group, "MD5sum");
+				sizes[i] = atol(xml_get_attr(group, "size"));
+				break;
+			default:
+				states[i] = "not-found";
+		}
+	}
+
+	reply = dbus_message_new_method_return(message);
+	if (!reply || !dbus_message_append_args(reply,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					states, n_paths,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					groups, n_paths,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_INT64,
+					sizes, n_paths,
+				DBUS_TYPE_INVALID)) {
+		if (reply) {
+			dbus_message_unref(reply);
+			reply = NULL;
+		}
+		goto oom;
+	}
+	goto out;
+oom:
+	dbus_set_error_const(error, "Error", "Out of memory");
+out:
+	while (n_indexes)
+		index_free(indexes[--n_indexes]);
+	if (indexes)
+		free(indexes);
+	if (states)
+		free(states);
+	if (groups)
+		free(groups);
+	if (sizes)
+		free(sizes);
+	dbus_free_string_array(paths);
+
+	return reply;
+}
+
+/* Tell the client how its Prefetch request is getting on */
+void control_prefetch_progress(Task *task, int groups_done, int groups,
+			       long bytes_done, long bytes)
+{
+	DBusMessage *message;
+
+	message = dbus_message_new_signal("/Main", DBUS_Z_NS,
+					  "PrefetchProgress");
+
+	if (message &&
+	    dbus_message_append_args(message,
+			DBUS_TYPE_STRING, task->str,
+			DBUS_TYPE_INT32, (dbus_int32_t) groups_done,
+			DBUS_TYPE_INT32, (dbus_int32_t) groups,
+			DBUS_TYPE_INT64, (dbus_int64_t) bytes_done,
+			DBUS_TYPE_INT64, (dbus_int64_t) bytes,
+			DBUS_TYPE_INVALID) &&
+	    dbus_connection_send(task->connection, message, NULL)) {
+	} else {
+		error("Out of memory");
+	}
+
+	if (message)
+		dbus_message_unref(message);
+}
+
+/* The Prefetch request has finished. Reply and destroy the task. */
+void control_prefetch_done(Task *task, const char *err)
+{
+	send_result(task, err);
+}
+
+void control_check_select(fd_set *rfds, fd_set *wfds)
+{
+	current_watch = dbus_watches;
+	while (current_watch) {
+		DBusWatch *this = current_watch;
+
+		/* current_watch may get moved forward by remove_watch */
+		current_watch = dbus_watch_get_data(this);
+
+		if (dbus_watch_get_enabled(this)) {
+			int fd = dbus_watch_get_fd(this);
+			unsigned int flags = 0;
+
+			if (FD_ISSET(fd, rfds))
+				flags |= DBUS_WATCH_READABLE;
+			if (FD_ISSET(fd, wfds))
+				flags |= DBUS_WATCH_WRITABLE;
+
+			if (flags && !dbus_watch_handle(this, flags)) {
+				/* XXX: OOM */
+				printf("[ OOM ]\n");
+			}
+		}
+	}
+	current_watch = NULL;
+}
+
+/* 1 if 'task' is waiting for a download whose progress monitors want */
+static int downloading_for(Task *task)
+{
+	return (task->type == TASK_CLIENT || task->type == TASK_KERNEL) &&
+	       task->child_task &&
+	       (task->child_task->flags & TASK_DOWNLOADING);
+}
+
+/* Make a Progress signal giving the bytes received so far, the total size
+ * (-1 if unknown) and the current rate of each download that the 'n'
+ * requests in 'tasks' (all from one user) are waiting for.
+ * NULL on OOM.
+ */
+static DBusMessage *progress_message(Task **tasks, int n)
+{
+	DBusMessage *message = NULL;
+	const char **paths = NULL;
+	dbus_int64_t *received = NULL, *sizes = NULL, *rates = NULL;
+	int i;
+
+	paths = my_malloc(n * sizeof(char *));
+	received = my_malloc(n * sizeof(dbus_int64_t));
+	sizes = my_malloc(n * sizeof(dbus_int64_t));
+	rates = my_malloc(n * sizeof(dbus_int64_t));
+	if (!paths || !received || !sizes || !rates)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		paths[i] = tasks[i]->str;
+		received[i] = tasks[i]->child_task->received;
+		sizes[i] = tasks[i]->child_task->size;
+		rates[i] = tasks[i]->child_task->rate;
+	}
+
+	message = dbus_message_new_signal("/Main", DBUS_Z_NS, "Progress");
+
+	if (message &&
+	    !dbus_message_append_args(message,
+			DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, paths, n,
+			DBUS_TYPE_ARRAY, DBUS_TYPE_INT64, received, n,
+			DBUS_TYPE_ARRAY, DBUS_TYPE_INT64, sizes, n,
+			DBUS_TYPE_ARRAY, DBUS_TYPE_INT64, rates, n,
+			DBUS_TYPE_INVALID)) {
+		dbus_message_unref(message);
+		message = NULL;
+	}
+
+out:
+	if (paths)
+		free(paths);
+	if (received)
+		free(received);
+	if (sizes)
+		free(sizes);
+	if (rates)
+		free(rates);
+	return message;
+}
+
+/* Send current_progress to a monitor of task's user */
+static void send_progress(DBusConnection *connection, Task *task)
+{
+	assert(current_progress);
+
+	if (!dbus_connection_send(connection, current_progress, NULL))
+		error("Out of memory");
+}
+
+static int compare_uid(const void *a, const void *b)
+{
+	uid_t x = (*(Task **) a)->uid;
+	uid_t y = (*(Task **) b)->uid;
+
+	return x < y ? -1 : x > y;
+}
+
+static void progress_tick(void *data)
+{
+	progress_timer = NULL;
+	control_push_updates();
+}
+
+/* Make sure control_push_updates() gets called soon */
+static void start_progress_timer(void)
+{
+	if (!progress_timer && monitors.next)
+		progress_timer = timer_add(PROGRESS_MS, progress_tick, NULL);
+}
+
+/* Tell monitors about new downloads since last time. Called PROGRESS_MS
+ * after the first one, so the cost doesn't depend on how often things
+ * happen.
+ */
+void control_push_updates(void)
+{
+	Task *task;
+
+	for (task = all_tasks; task; task = task->next) {
+		if (!(task->flags & TASK_UPDATE_PENDING))
+			continue;
+		task->flags &= ~TASK_UPDATE_PENDING;
+		if (task->child_task && task->child_task->str)
+			list_foreach(&monitors, send_task_update, 0, task);
+	}
+}
+
+/* Download progress has changed (checked every PROGRESS_MS by fetch.c).
+ * Send each monitor a single Progress signal covering all its user's
+ * downloads. Each user's signal is made once, and only sent to that
+ * user's monitors.
+ */
+void control_notify_progress(void)
+{
+	Task **tasks, *task;
+	int n = 0, i, j;
+
+	if (!monitors.next)
+		return;
+
+	for (task = all_tasks; task; task = task->next) {
+		if (downloading_for(task))
+			n++;
+	}
+	if (!n)
+		return;
+
+	tasks = my_malloc(n * sizeof(Task *));
+	if (!tasks)
+		return;
+
+	n = 0;
+	for (task = all_tasks; task; task = task->next) {
+		if (downloading_for(task))
+			tasks[n++] = task;
+	}
+	qsort(tasks, n, sizeof(Task *), compare_uid);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && tasks[j]->uid == tasks[i]->uid; j++)
+			;
+
+		assert(!current_progress);
+		current_progress = progress_message(tasks + i, j - i);
+		if (!current_progress) {
+			error("Out of memory");
+			continue;
+		}
+		list_foreach(&monitors, send_progress, 0, tasks[i]);
+		dbus_message_unref(current_progress);
+		current_progress = NULL;
+	}
+
+	free(tasks);
+}
+
+/* 'task' is now waiting for task->child_task. Monitors will be told
+ * shortly (see control_push_updates()).
+ */
 void control_notify_update(Task *task)
 {
-	list_foreach(&monitors, send_task_update, 0, task);
+	task->flags |= TASK_UPDATE_PENDING;
+	start_progress_timer();
 }
 
 void control_notify_end(Task *task)
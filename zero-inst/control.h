@@ -5,6 +5,10 @@ void control_drop_clients(void);
 void control_push_updates(void);
 
 void control_notify_update(Task *task);
+void control_notify_progress(void);
 void control_notify_end(Task *task);
 void control_notify_error(Task *task, const char *message);
 void control_cancel_task(Task *task);
+void control_prefetch_progress(Task *task, int groups_done, int groups,
+			       long bytes_done, long bytes);
+void control_prefetch_done(Task *task, const char *err);
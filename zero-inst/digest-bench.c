@@ -0,0 +1,125 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Measures the throughput of each digest algorithm (see digest.c), both
+ * on data in memory and, optionally, on files (as when checking a
+ * downloaded archive).
+ *
+ * Usage: digest-bench [MB] [FILE...]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "global.h"
+#include "digest.h"
+
+/* support.c needs these */
+int copy_stderr = 1;
+char cache_dir[] = "/";
+int cache_dir_len = 1;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void bench_memory(const DigestAlgorithm *algo, const char *impl,
+			 const unsigned char *data, size_t len)
+{
+	char hex[DIGEST_MAX_SIZE * 2 + 1];
+	double start, secs;
+	Digest *digest;
+	int rounds = 0;
+
+	start = now();
+	do {
+		digest = digest_new(algo);
+		if (!digest)
+			exit(EXIT_FAILURE);
+		digest_update(digest, data, len);
+		digest_final(digest, hex);
+		rounds++;
+		secs = now() - start;
+	} while (secs < 1);
+
+	printf("%-8s %-16s %8.1f MB/s\n", algo->name, impl,
+			rounds * (len / 1048576.0) / secs);
+}
+
+static void bench_file(const DigestAlgorithm *algo, const char *path)
+{
+	double start, secs;
+	char *hex;
+
+	start = now();
+	hex = digest_file(path, algo);
+	secs = now() - start;
+	if (!hex)
+		exit(EXIT_FAILURE);
+
+	printf("%-8s %8.3f s  %s  %s\n", algo->name, secs, hex, path);
+	free(hex);
+}
+
+int main(int argc, char **argv)
+{
+	const DigestAlgorithm *algo;
+	unsigned char *data;
+	size_t len = 16;
+	size_t i;
+	int arg = 1;
+
+	if (arg < argc && argv[arg][0] >= '0' && argv[arg][0] <= '9')
+		len = atoi(argv[arg++]);
+	if (len < 1) {
+		fprintf(stderr, "Usage: %s [MB] [FILE...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	len *= 1024 * 1024;
+
+	data = malloc(len);
+	if (!data) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < len; i++)
+		data[i] = i * 7 + (i >> 9);
+
+	for (algo = digest_algorithms; algo->name; algo++) {
+		const char *impl;
+
+		digest_set_accelerated(1);
+		impl = digest_implementation(algo);
+		bench_memory(algo, impl, data, len);
+
+		digest_set_accelerated(0);
+		if (strcmp(digest_implementation(algo), impl) != 0)
+			bench_memory(algo, digest_implementation(algo),
+				     data, len);
+	}
+
+	digest_set_accelerated(1);
+	for (; arg < argc; arg++) {
+		for (algo = digest_algorithms; algo->name; algo++)
+			bench_file(algo, argv[arg]);
+	}
+
+	free(data);
+
+	return EXIT_SUCCESS;
+}
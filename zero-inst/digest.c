@@ -0,0 +1,822 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Message digests. Every <group> in an index gives the MD5 sum of its
+ * archive (the MD5sum attribute), and may also give a stronger digest of
+ * it (sha256 or blake2b). The strongest one given is the one checked.
+ * Items with their own MD5sum may have the others too.
+ *
+ * SHA-256 uses the CPU's SHA extensions, if it has them (this is usually
+ * several times faster than MD5). Files are read DIGEST_READ_SIZE bytes
+ * at a time.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "global.h"
+#include "support.h"
+#include "digest.h"
+
+#if defined(__GNUC__) && !defined(__clang__) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define HAVE_SHA_NI
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+/*
+ * This code implements the MD5 message-digest algorithm.
+ * The algorithm is due to Ron Rivest. The original code was
+ * written by Colin Plumb in 1993, and put in the public domain.
+ * 
+ * Modified to use glib datatypes. Put under GPL to simplify
+ * licensing for Zero Install. Taken from Debian's dpkg package.
+ */
+
+#define md5byte unsigned char
+
+static void MD5Transform(u_int32_t buf[4], u_int32_t const in[16]);
+
+typedef struct _MD5Context MD5Context;
+
+struct _MD5Context {
+	u_int32_t buf[4];
+	u_int32_t bytes[2];
+	u_int32_t in[16];
+};
+
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+static void byteSwap(u_int32_t *buf, unsigned words)
+{
+	md5byte *p = (md5byte *)buf;
+
+	do {
+		*buf++ = (u_int32_t)((unsigned)p[3] << 8 | p[2]) << 16 |
+			((unsigned)p[1] << 8 | p[0]);
+		p += 4;
+	} while (--words);
+}
+#else
+#define byteSwap(buf,words)
+#endif
+
+/*
+ * Start MD5 accumulation. Set bit count to 0 and buffer to mysterious
+ * initialization constants.
+ */
+static void MD5Init(MD5Context *ctx)
+{
+	ctx->buf[0] = 0x67452301;
+	ctx->buf[1] = 0xefcdab89;
+	ctx->buf[2] = 0x98badcfe;
+	ctx->buf[3] = 0x10325476;
+
+	ctx->bytes[0] = 0;
+	ctx->bytes[1] = 0;
+}
+
+/*
+ * Update context to reflect the concatenation of another buffer full
+ * of bytes.
+ */
+static void MD5Update(MD5Context *ctx, md5byte const *buf, unsigned len)
+{
+	u_int32_t t;
+
+	/* Update byte count */
+
+	t = ctx->bytes[0];
+	if ((ctx->bytes[0] = t + len) < t)
+		ctx->bytes[1]++;	/* Carry from low to high */
+
+	t = 64 - (t & 0x3f);	/* Space available in ctx->in (at least 1) */
+	if (t > len) {
+		memcpy((md5byte *)ctx->in + 64 - t, buf, len);
+		return;
+	}
+	/* First chunk is an odd size */
+	memcpy((md5byte *)ctx->in + 64 - t, buf, t);
+	byteSwap(ctx->in, 16);
+	MD5Transform(ctx->buf, ctx->in);
+	buf += t;
+	len -= t;
+
+	/* Process data in 64-byte chunks */
+	while (len >= 64) {
+		memcpy(ctx->in, buf, 64);
+		byteSwap(ctx->in, 16);
+		MD5Transform(ctx->buf, ctx->in);
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Handle any remaining bytes of data. */
+	memcpy(ctx->in, buf, len);
+}
+
+/*
+ * Final wrapup - pad to 64-byte boundary with the bit pattern 
+ * 1 0* (64-bit count of bits processed, MSB-first)
+ * Stores the 16-byte hash in 'out'.
+ */
+static void MD5Final(MD5Context *ctx, unsigned char *out)
+{
+	int count = ctx->bytes[0] & 0x3f;	/* Number of bytes in ctx->in */
+	md5byte *p = (md5byte *)ctx->in + count;
+
+	/* Set the first char of padding to 0x80.  There is always room. */
+	*p++ = 0x80;
+
+	/* Bytes of padding needed to make 56 bytes (-8..55) */
+	count = 56 - 1 - count;
+
+	if (count < 0) {	/* Padding forces an extra block */
+		memset(p, 0, count + 8);
+		byteSwap(ctx->in, 16);
+		MD5Transform(ctx->buf, ctx->in);
+		p = (md5byte *)ctx->in;
+		count = 56;
+	}
+	memset(p, 0, count);
+	byteSwap(ctx->in, 14);
+
+	/* Append length in bits and transform */
+	ctx->in[14] = ctx->bytes[0] << 3;
+	ctx->in[15] = ctx->bytes[1] << 3 | ctx->bytes[0] >> 29;
+	MD5Transform(ctx->buf, ctx->in);
+
+	byteSwap(ctx->buf, 4);
+
+	memcpy(out, ctx->buf, 16);
+}
+
+# ifndef ASM_MD5
+
+/* The four core functions - F1 is optimized somewhat */
+
+/* #define F1(x, y, z) (x & y | ~x & z) */
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+/* This is the central step in the MD5 algorithm. */
+#define MD5STEP(f,w,x,y,z,in,s) \
+	 (w += f(x,y,z) + in, w = (w<<s | w>>(32-s)) + x)
+
+/*
+ * The core of the MD5 algorithm, this alters an existing MD5 hash to
+ * reflect the addition of 16 longwords of new data.  MD5Update blocks
+ * the data and converts bytes into longwords for this routine.
+ */
+static void MD5Transform(u_int32_t buf[4], u_int32_t const in[16])
+{
+	register u_int32_t a, b, c, d;
+
+	a = buf[0];
+	b = buf[1];
+	c = buf[2];
+	d = buf[3];
+
+	MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+	MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+	MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
+	MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+	MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+	MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+	MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
+	MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
+	MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
+	MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+	MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+	MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+	MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+	MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+	MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+	MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
+	MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+	MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+	MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
+	MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+	MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+	MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+	MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+	MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+	MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+	MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+	MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+	MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+# endif /* ASM_MD5 */
+
+/* SHA-256 (FIPS 180-2) */
+
+typedef struct _Sha256Context Sha256Context;
+
+struct _Sha256Context {
+	u_int32_t state[8];
+	u_int64_t bytes;
+	unsigned char in[64];
+};
+
+static const u_int32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Process 'n' 64-byte blocks from 'data' */
+static void sha256_blocks_portable(u_int32_t state[8],
+				   const unsigned char *data, size_t n)
+{
+	u_int32_t w[64];
+	u_int32_t a, b, c, d, e, f, g, h;
+	int i;
+
+	for (; n; n--, data += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = (u_int32_t) data[i * 4] << 24 |
+			       (u_int32_t) data[i * 4 + 1] << 16 |
+			       (u_int32_t) data[i * 4 + 2] << 8 |
+			       (u_int32_t) data[i * 4 + 3];
+		for (; i < 64; i++) {
+			u_int32_t s0, s1;
+
+			s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+			     (w[i - 15] >> 3);
+			s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+			     (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 64; i++) {
+			u_int32_t t1, t2;
+
+			t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+			     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+			     ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef HAVE_SHA_NI
+/* As sha256_blocks_portable(), using the SHA extensions. Each step does
+ * four rounds; the message schedule is kept in msg[], four words each.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_ni(u_int32_t state[8],
+			     const unsigned char *data, size_t n)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					     0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg[4], wk, tmp;
+	int i;
+
+	/* The instructions want the state as ABEF and CDGH */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) &state[0]), 0xb1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) &state[4]),
+				   0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+	for (; n; n--, data += 64) {
+		abef = state0;
+		cdgh = state1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *) (data + i * 16)),
+					bswap);
+			} else {
+				tmp = _mm_sha256msg1_epu32(msg[i & 3],
+							   msg[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(
+						msg[(i + 3) & 3],
+						msg[(i + 2) & 3], 4));
+				msg[i & 3] = _mm_sha256msg2_epu32(tmp,
+							msg[(i + 3) & 3]);
+			}
+
+			wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128(
+					(const __m128i *) &sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+			wk = _mm_shuffle_epi32(wk, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i *) &state[0], state0);
+	_mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+/* 1 if the CPU has the SHA extensions (and the SSE4.1 they need) */
+static int cpu_has_sha(void)
+{
+	unsigned int a, b, c, d;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid(1, a, b, c, d);
+	if (!(c & bit_SSE4_1) || !(c & bit_SSSE3))
+		return 0;
+	__cpuid_count(7, 0, a, b, c, d);
+	return (b >> 29) & 1;
+}
+#endif
+
+static void (*sha256_blocks)(u_int32_t state[8], const unsigned char *data,
+			     size_t n) = NULL;
+
+static void sha256_init(Digest *digest);
+static void sha256_update(Digest *digest, const unsigned char *data,
+			  size_t len);
+static void sha256_final(Digest *digest, unsigned char *out);
+
+/* BLAKE2b (RFC 7693), unkeyed, with a 64-byte result */
+
+typedef struct _Blake2bContext Blake2bContext;
+
+struct _Blake2bContext {
+	u_int64_t h[8];
+	u_int64_t t[2];		/* Bytes compressed so far */
+	unsigned char in[128];
+	size_t in_len;
+};
+
+static const u_int64_t blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static const unsigned char blake2b_sigma[12][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+	{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+	{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+	{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+	{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+	{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+	{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+	{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+	{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+};
+
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define B2B_G(a, b, c, d, x, y) do { \
+		v[a] += v[b] + (x); v[d] = ROR64(v[d] ^ v[a], 32); \
+		v[c] += v[d];       v[b] = ROR64(v[b] ^ v[c], 24); \
+		v[a] += v[b] + (y); v[d] = ROR64(v[d] ^ v[a], 16); \
+		v[c] += v[d];       v[b] = ROR64(v[b] ^ v[c], 63); \
+	} while (0)
+
+static void blake2b_compress(Blake2bContext *ctx, int last)
+{
+	u_int64_t v[16], m[16];
+	int i, j;
+
+	for (i = 0; i < 16; i++) {
+		m[i] = 0;
+		for (j = 7; j >= 0; j--)
+			m[i] = m[i] << 8 | ctx->in[i * 8 + j];
+	}
+
+	for (i = 0; i < 8; i++) {
+		v[i] = ctx->h[i];
+		v[i + 8] = blake2b_iv[i];
+	}
+	v[12] ^= ctx->t[0];
+	v[13] ^= ctx->t[1];
+	if (last)
+		v[14] = ~v[14];
+
+	for (i = 0; i < 12; i++) {
+		const unsigned char *s = blake2b_sigma[i];
+
+		B2B_G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+		B2B_G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+		B2B_G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+		B2B_G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+		B2B_G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+		B2B_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+		B2B_G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+		B2B_G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		ctx->h[i] ^= v[i] ^ v[i + 8];
+}
+
+static void blake2b_init(Digest *digest);
+static void blake2b_update(Digest *digest, const unsigned char *data,
+			   size_t len);
+static void blake2b_final(Digest *digest, unsigned char *out);
+
+static void md5_init(Digest *digest);
+static void md5_update(Digest *digest, const unsigned char *data,
+		       size_t len);
+static void md5_final(Digest *digest, unsigned char *out);
+
+struct _Digest {
+	const DigestAlgorithm *algo;
+	union {
+		MD5Context md5;
+		Sha256Context sha256;
+		Blake2bContext blake2b;
+	} ctx;
+};
+
+const DigestAlgorithm digest_algorithms[] = {
+	{"sha256", 32, sha256_init, sha256_update, sha256_final},
+	{"blake2b", 64, blake2b_init, blake2b_update, blake2b_final},
+	{"MD5sum", 16, md5_init, md5_update, md5_final},
+	{NULL, 0, NULL, NULL, NULL},
+};
+
+static void sha256_init(Digest *digest)
+{
+	static const u_int32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	Sha256Context *ctx = &digest->ctx.sha256;
+
+	if (!sha256_blocks)
+		digest_set_accelerated(1);
+
+	memcpy(ctx->state, h0, sizeof(h0));
+	ctx->bytes = 0;
+}
+
+static void sha256_update(Digest *digest, const unsigned char *data,
+			  size_t len)
+{
+	Sha256Context *ctx = &digest->ctx.sha256;
+	size_t used = ctx->bytes & 63;
+
+	ctx->bytes += len;
+
+	if (used) {
+		size_t space = 64 - used;
+
+		if (len < space) {
+			memcpy(ctx->in + used, data, len);
+			return;
+		}
+		memcpy(ctx->in + used, data, space);
+		sha256_blocks(ctx->state, ctx->in, 1);
+		data += space;
+		len -= space;
+	}
+
+	if (len >= 64) {
+		sha256_blocks(ctx->state, data, len / 64);
+		data += len & ~(size_t) 63;
+		len &= 63;
+	}
+
+	memcpy(ctx->in, data, len);
+}
+
+static void sha256_final(Digest *digest, unsigned char *out)
+{
+	Sha256Context *ctx = &digest->ctx.sha256;
+	u_int64_t bits = ctx->bytes * 8;
+	unsigned char pad[72];
+	size_t pad_len;
+	int i;
+
+	/* 0x80, zeros, then the length in bits; ending on a block */
+	pad_len = 64 - ((ctx->bytes + 8) & 63);
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++)
+		pad[pad_len + i] = bits >> (56 - i * 8);
+	sha256_update(digest, pad, pad_len + 8);
+
+	for (i = 0; i < 8; i++) {
+		out[i * 4] = ctx->state[i] >> 24;
+		out[i * 4 + 1] = ctx->state[i] >> 16;
+		out[i * 4 + 2] = ctx->state[i] >> 8;
+		out[i * 4 + 3] = ctx->state[i];
+	}
+}
+
+static void blake2b_init(Digest *digest)
+{
+	Blake2bContext *ctx = &digest->ctx.blake2b;
+
+	memcpy(ctx->h, blake2b_iv, sizeof(ctx->h));
+	ctx->h[0] ^= 0x01010000 ^ 64;	/* No key; 64-byte result */
+	ctx->t[0] = ctx->t[1] = 0;
+	ctx->in_len = 0;
+}
+
+static void blake2b_update(Digest *digest, const unsigned char *data,
+			   size_t len)
+{
+	Blake2bContext *ctx = &digest->ctx.blake2b;
+
+	/* The last block is compressed differently, so a full buffer is
+	 * only compressed once we know more data follows.
+	 */
+	while (len) {
+		size_t n;
+
+		if (ctx->in_len == sizeof(ctx->in)) {
+			ctx->t[0] += sizeof(ctx->in);
+			if (ctx->t[0] < sizeof(ctx->in))
+				ctx->t[1]++;
+			blake2b_compress(ctx, 0);
+			ctx->in_len = 0;
+		}
+
+		n = sizeof(ctx->in) - ctx->in_len;
+		if (n > len)
+			n = len;
+		memcpy(ctx->in + ctx->in_len, data, n);
+		ctx->in_len += n;
+		data += n;
+		len -= n;
+	}
+}
+
+static void blake2b_final(Digest *digest, unsigned char *out)
+{
+	Blake2bContext *ctx = &digest->ctx.blake2b;
+	int i;
+
+	ctx->t[0] += ctx->in_len;
+	if (ctx->t[0] < ctx->in_len)
+		ctx->t[1]++;
+	memset(ctx->in + ctx->in_len, 0, sizeof(ctx->in) - ctx->in_len);
+	blake2b_compress(ctx, 1);
+
+	for (i = 0; i < 64; i++)
+		out[i] = ctx->h[i / 8] >> (8 * (i % 8));
+}
+
+static void md5_init(Digest *digest)
+{
+	MD5Init(&digest->ctx.md5);
+}
+
+static void md5_update(Digest *digest, const unsigned char *data,
+		       size_t len)
+{
+	MD5Update(&digest->ctx.md5, data, len);
+}
+
+static void md5_final(Digest *digest, unsigned char *out)
+{
+	MD5Final(&digest->ctx.md5, out);
+}
+
+/* The algorithm whose index attribute is 'name', or NULL */
+const DigestAlgorithm *digest_find(const char *name)
+{
+	const DigestAlgorithm *algo;
+
+	for (algo = digest_algorithms; algo->name; algo++) {
+		if (strcmp(algo->name, name) == 0)
+			return algo;
+	}
+
+	return NULL;
+}
+
+/* A description of the code used for 'algo', for the benchmark */
+const char *digest_implementation(const DigestAlgorithm *algo)
+{
+#ifdef HAVE_SHA_NI
+	if (algo->init == sha256_init) {
+		if (!sha256_blocks)
+			digest_set_accelerated(1);
+		if (sha256_blocks == sha256_blocks_ni)
+			return "SHA extensions";
+	}
+#endif
+	return "portable C";
+}
+
+/* Use the CPU's extensions, if it has them (the default), or not (to
+ * check or compare the portable code).
+ */
+void digest_set_accelerated(int accelerated)
+{
+	sha256_blocks = sha256_blocks_portable;
+#ifdef HAVE_SHA_NI
+	if (accelerated && cpu_has_sha())
+		sha256_blocks = sha256_blocks_ni;
+#endif
+}
+
+/* A new digest context. NULL on OOM. */
+Digest *digest_new(const DigestAlgorithm *algo)
+{
+	Digest *digest;
+
+	digest = my_malloc(sizeof(Digest));
+	if (!digest)
+		return NULL;
+	digest->algo = algo;
+	algo->init(digest);
+
+	return digest;
+}
+
+void digest_update(Digest *digest, const void *data, size_t len)
+{
+	digest->algo->update(digest, data, len);
+}
+
+/* Store the result as a hex string in 'hex' (room for DIGEST_MAX_SIZE * 2
+ * + 1 bytes), or just discard it if 'hex' is NULL. Frees 'digest'.
+ */
+void digest_final(Digest *digest, char *hex)
+{
+	unsigned char out[DIGEST_MAX_SIZE];
+	int i;
+
+	digest->algo->final(digest, out);
+
+	if (hex) {
+		for (i = 0; i < digest->algo->size; i++)
+			sprintf(hex + i * 2, "%02x", out[i]);
+	}
+
+	free(digest);
+}
+
+/* Calculate the 'algo' digest of 'path', as a hex string.
+ * NULL on error. free() the result.
+ */
+char *digest_file(const char *path, const DigestAlgorithm *algo)
+{
+	static unsigned char *buffer = NULL;
+	Digest *digest = NULL;
+	char *hex;
+	int fd;
+
+	if (!buffer) {
+		buffer = my_malloc(DIGEST_READ_SIZE);
+		if (!buffer)
+			return NULL;
+	}
+
+	hex = my_malloc(DIGEST_MAX_SIZE * 2 + 1);
+	if (!hex)
+		return NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		error("open: %m");
+		goto err;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	digest = digest_new(algo);
+	if (!digest)
+		goto err;
+
+	while (1) {
+		int got;
+
+		got = read(fd, buffer, DIGEST_READ_SIZE);
+		if (got < 0) {
+			error("read: %m");
+			goto err;
+		}
+		if (got == 0)
+			break;
+		digest_update(digest, buffer, got);
+	}
+
+	my_close(fd);
+	digest_final(digest, hex);
+
+	return hex;
+err:
+	if (fd != -1)
+		my_close(fd);
+	if (digest)
+		digest_final(digest, NULL);
+	free(hex);
+	return NULL;
+}
+
+/* Calculate the 'algo' digest for 'path' and compare it with 'expected'.
+ * Returns 1 if they match, 0 if not.
+ */
+int digest_check_file(const char *path, const DigestAlgorithm *algo,
+		      const char *expected)
+{
+	char *real;
+	int retval;
+
+	real = digest_file(path, algo);
+	if (!real)
+		return 0;
+
+	retval = strcmp(real, expected) == 0;
+	free(real);
+
+	return retval;
+}
@@ -0,0 +1,27 @@
+typedef struct _Digest Digest;
+typedef struct _DigestAlgorithm DigestAlgorithm;
+
+#define DIGEST_MAX_SIZE 64		/* Bytes, for the largest algorithm */
+#define DIGEST_READ_SIZE (64 * 1024)	/* Bytes read from a file at once */
+
+/* A digest algorithm (see digest.c) */
+struct _DigestAlgorithm {
+	const char *name;	/* Attribute giving it in the index */
+	int size;		/* Bytes */
+	void (*init)(Digest *digest);
+	void (*update)(Digest *digest, const unsigned char *data, size_t len);
+	void (*final)(Digest *digest, unsigned char *out);
+};
+
+/* Strongest first. The last one has a NULL name. */
+extern const DigestAlgorithm digest_algorithms[];
+
+const DigestAlgorithm *digest_find(const char *name);
+const char *digest_implementation(const DigestAlgorithm *algo);
+void digest_set_accelerated(int accelerated);
+Digest *digest_new(const DigestAlgorithm *algo);
+void digest_update(Digest *digest, const void *data, size_t len);
+void digest_final(Digest *digest, char *hex);
+char *digest_file(const char *path, const DigestAlgorithm *algo);
+int digest_check_file(const char *path, const DigestAlgorithm *algo,
+		      const char *expected);
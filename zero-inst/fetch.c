@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <time.h>
+#include <utime.h>
 
 #include "global.h"
 #include "support.h"
@@ -19,21 +20,49 @@
 #include "gpg.h"
 #include "xml.h"
 #include "mirrors.h"
+#include "timer.h"
+#include "negative.h"
+#include "breaker.h"
+#include "catalog.h"
+#include "store.h"
+#include "digest.h"
+#include "metrics.h"
+#include "spans.h"
+#include "log.h"
+#include "control.h"
 
 #define TMP_PREFIX ".0inst-tmp-"
+#define UNPACK_PREFIX ".0inst-unpack-"
 
 /* The number of seconds after the user rejects a request during which
  * we will auto-reject identical requests.
  */
 #define AUTO_REJECT_PERIOD 5
 
+/* How often (ms) to look for files which can be committed early when
+ * unpacking archives as they download.
+ */
+#define STREAM_POLL_MS 100
+
+/* Download progress is checked this often while anything is downloading */
+#define PROGRESS_MS 250
+
 static char *last_reject_request = NULL;
 static uid_t last_reject_user = 0;
 static time_t last_reject_time = 0;
 
 static char *wget_log = NULL;
 
+static Timer *progress_timer = NULL;
+
+/* The files of a site's index, in META, which must match each other */
+static const char *index_files[] = {
+	"keyring.pub", "mirrors.xml", "index.xml.sig", "index.xml", NULL
+};
+
 static void build_ddd_from_index(Element *dir_node, char *dir);
+static void progress_tick(void *data);
+static int finish_install(void);
 
 /* 0 on success (cwd is changed). */
 static int chdir_meta(const char *site)
@@ -57,43 +86,168 @@ static int chdir_meta(const char *site)
 	return 0;
 }
 
+/* Parsed indexes are kept here, so that we don't have to check the
+ * signature and parse the XML every time. An entry is used only if the
+ * index, its signature and override.xml are all unchanged on disk.
+ */
+#define INDEX_CACHE_SIZE 16
+
+typedef struct _Stamp Stamp;
+typedef struct _CachedIndex CachedIndex;
+
+struct _Stamp {
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+};
+
+struct _CachedIndex {
+	Index *index;		/* We hold a ref; NULL if unused */
+	Stamp stamps[3];	/* index.xml, index.xml.sig, override.xml */
+	time_t last_used;
+};
+
+static CachedIndex index_cache[INDEX_CACHE_SIZE];
+
+static const char *stamped_files[] = {
+	"index.xml", "index.xml.sig", "override.xml"
+};
+
+/* Record the state of site's meta files in 'stamps'. 0 if index.xml
+ * doesn't exist (or on OOM).
+ */
+static int stamp_index(const char *site, Stamp *stamps)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		struct stat info;
+		char *path;
+		int ok;
+
+		path = build_string("%s/%h/" META "/%s", cache_dir, site,
+				    stamped_files[i]);
+		if (!path)
+			return 0;	/* OOM */
+		ok = stat(path, &info) == 0;
+		free(path);
+
+		if (!ok) {
+			if (i == 0)
+				return 0;
+			info.st_ino = 0;
+			info.st_size = -1;
+			info.st_mtime = 0;
+		}
+
+		stamps[i].ino = info.st_ino;
+		stamps[i].size = info.st_size;
+		stamps[i].mtime = info.st_mtime;
+	}
+
+	return 1;
+}
+
+static int same_stamps(Stamp *a, Stamp *b)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (a[i].ino != b[i].ino || a[i].size != b[i].size ||
+		    a[i].mtime != b[i].mtime)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* The cache slot holding site's index, or else the one to reuse for it */
+static CachedIndex *find_slot(const char *site)
+{
+	CachedIndex *slot = index_cache;
+	int i;
+
+	for (i = 0; i < INDEX_CACHE_SIZE; i++) {
+		CachedIndex *c = &index_cache[i];
+
+		if (c->index && strcmp(c->index->site, site) == 0)
+			return c;
+		if (slot->index &&
+		    (!c->index || c->last_used < slot->last_used))
+			slot = c;
+	}
+
+	return slot;
+}
+
+/* Keep 'index' (which has just been checked) in the cache, replacing
+ * any old version.
+ */
+static void remember_index(Index *index)
+{
+	CachedIndex *slot;
+
+	slot = find_slot(index->site);
+	if (slot->index)
+		index_free(slot->index);
+	slot->index = NULL;
+
+	if (!stamp_index(index->site, slot->stamps))
+		return;
+
+	slot->index = index;
+	index->ref++;
+	slot->last_used = time(NULL);
+}
+
 /* Return the index for site. If index does not exist, or signature does
  * not match (index out-of-date), returns NULL.
+ * While a new index is being fetched, the files it replaces are left
+ * alone (see install_index), so this continues to return the old one.
  */
 static Index *load_index(const char *site)
 {
 	Index *index = NULL;
-	struct stat info;
-	char *index_path = NULL;
+	Stamp stamps[3];
+	CachedIndex *slot;
 
 	assert(strchr(site, '/') == NULL);
 
-	index_path = build_string("%s/%h/" META "/index.xml", cache_dir, site);
-	if (!index_path)
-		goto out;	/* OOM */
+	if (!stamp_index(site, stamps))
+		return NULL;	/* Index file doesn't exist */
+
+	slot = find_slot(site);
+	if (slot->index && strcmp(slot->index->site, site) == 0 &&
+	    same_stamps(slot->stamps, stamps)) {
+		slot->last_used = time(NULL);
+		slot->index->ref++;
+		metrics_count("zeroinstall_index_cache_total", "hit", 1);
+		return slot->index;
+	}
+
+	metrics_count("zeroinstall_index_cache_total", "miss", 1);
 
-	if (stat(index_path, &info) != 0)
-		goto out;	/* Index file doesn't exist */
-	
 	if (chdir_meta(site))
 		goto out;
 
-	if (gpg_trusted(site, "index.xml", 0) != NULL)
+	if (access(INSTALLING, F_OK) == 0)
+		finish_install();	/* We stopped while installing */
+
+	if (gpg_trusted(site, ".", "index.xml", 0) != NULL)
 		goto out;
 		
-	index = parse_index(index_path, 0, site);
+	index = parse_index("index.xml", 0, site);
 
 out:
-	if (index_path)
-		free(index_path);
-
 	if (chdir("/"))
 		abort();
 
+	if (index)
+		remember_index(index);
+
 	return index;
 }
 
-
 /* Create directory 'path' from 'node' */
 void fetch_create_directory(const char *path, Element *node)
 {
@@ -112,6 +266,147 @@ void fetch_create_directory(const char *path, Element *node)
 		abort();
 }
 
+/* Check 'path' against the strongest digest the index gives for 'node' (a
+ * <group>, or an item with its own digests). 1 if it matches.
+ */
+int fetch_digest_matches(const char *path, Element *node)
+{
+	const DigestAlgorithm *algo;
+
+	for (algo = digest_algorithms; algo->name; algo++) {
+		const char *expected;
+
+		expected = xml_get_attr(node, algo->name);
+		if (expected)
+			return digest_check_file(path, algo, expected);
+	}
+
+	return 0;
+}
+
+/* Small files may have their contents in the index itself, base64-encoded
+ * in a 'data' attribute (as well as being in the group's archive). If
+ * 'item' is one of these, write it into the directory 'dir' straight away,
+ * with no download. 1 on success, 0 if not inline or on error.
+ */
+static int write_inline_file(Element *item, const char *dir)
+{
+	const char *data, *leaf;
+	unsigned char *buffer = NULL;
+	char *tmp = NULL, *dst = NULL;
+	struct utimbuf times;
+	long size;
+	int len, fd;
+	int ok = 0;
+
+	if (item->name[0] != 'f' && item->name[0] != 'e')
+		return 0;
+	data = xml_get_attr(item, "data");
+	if (!data)
+		return 0;
+
+	leaf = xml_get_attr(item, "name");
+	size = atol(xml_get_attr(item, "size"));
+
+	buffer = my_malloc(strlen(data) * 3 / 4 + 1);
+	tmp = build_string("%s/" TMP_PREFIX "%s", dir,
+			   xml_get_attr(item, "MD5sum"));
+	dst = build_string("%s/%s", dir, leaf);
+	if (!buffer || !tmp || !dst)
+		goto out;
+
+	len = base64_decode(data, buffer);
+	if (len != size) {
+		error("Bad inline data for '%s'", leaf);
+		goto out;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC,
+			item->name[0] == 'e' ? 0755 : 0644);
+	if (fd == -1) {
+		error("open '%s': %m", tmp);
+		goto out;
+	}
+	if (write(fd, buffer, len) != len) {
+		error("write '%s': %m", tmp);
+		my_close(fd);
+		goto err;
+	}
+	my_close(fd);
+
+	if (!fetch_digest_matches(tmp, item)) {
+		error("'%s' has wrong checksum!", leaf);
+		goto err;
+	}
+
+	times.actime = times.modtime = atol(xml_get_attr(item, "mtime"));
+	if (utime(tmp, &times)) {
+		error("utime: %m");
+		goto err;
+	}
+
+	if (rename(tmp, dst)) {
+		error("rename: %m");
+		goto err;
+	}
+
+	if (verbose)
+		syslog(LOG_DEBUG, "Wrote inline file '%s'", dst);
+	ok = 1;
+	goto out;
+err:
+	if (unlink(tmp))
+		error("unlink '%s': %m", tmp);
+out:
+	if (buffer)
+		free(buffer);
+	if (tmp)
+		free(tmp);
+	if (dst)
+		free(dst);
+	return ok;
+}
+
+/* Write inline files we don't already have (see above).
+ * The current directory is 'data'.
+ */
+static void write_inline_item(Element *item, void *data)
+{
+	struct stat info;
+	const char *name;
+
+	if (item->name[0] == 'd' || item->name[0] == 'l')
+		return;
+
+	name = xml_get_attr(item, "name");
+	if (!xml_get_attr(item, "data") ||
+	    (lstat(name, &info) == 0 &&
+	     info.st_size == atol(xml_get_attr(item, "size")) &&
+	     info.st_mtime == atol(xml_get_attr(item, "mtime"))))
+		return;
+
+	write_inline_file(item, data);
+}
+
+/* 'file' is the cache-relative path of 'item'. If its contents are in
+ * the index, write it now. 1 on success.
+ */
+int fetch_inline_file(const char *file, Element *item)
+{
+	char *dir;
+	int ok;
+
+	dir = build_string("%s%d", cache_dir, file);
+	if (!dir)
+		return 0;
+
+	ok = write_inline_file(item, dir);
+
+	free(dir);
+
+	return ok;
+}
+
 static void recurse_ddd(Element *item, void *data)
 {
 	char *path = data;
@@ -199,7 +494,9 @@ static void build_ddd_from_index(Element *dir_node, char *dir)
 	if (rename("....", "..."))
 		goto err;
 
-	/* TODO: delete old stuff */
+	/* Old stuff is deleted later, by gc.c */
+
+	index_foreach(dir_node, write_inline_item, dir);
 
 	index_foreach(dir_node, recurse_ddd, dir);
 	return;
@@ -207,164 +504,292 @@ err:
 	error("build_ddd_from_index: %m");
 }
 
-/* Called with cwd in directory where files have been extracted.
- * Moves each file in 'group' up if everything is correct.
+/* 1 if 'info' has the mode 'item' needs: an <exec> must be executable */
+static int right_mode(Element *item, struct stat *info)
+{
+	return item->name[0] != 'e' || (info->st_mode & S_IXUSR);
+}
+
+/* Move the file 'item' from 'staging' (where it has been extracted) to
+ * 'dir' (the directory it belongs in), if it has the right type, size,
+ * mtime and mode. If 'check_digest' is set, the file's own digest must
+ * match too.
+ * Each file is committed with a single rename(), so other groups can be
+ * unpacking into 'dir' at the same time.
+ * A file which has already been committed early is OK too.
+ * 1 on success.
  */
-static void pull_up_files(Element *group)
+static int pull_up_file(Element *item, const char *staging, const char *dir,
+			int check_digest)
 {
-	Element *item;
+	char src[MAX_PATH_LEN];
+	char dst[MAX_PATH_LEN];
 	struct stat info;
-	const char *leaf = NULL;
+	const char *leaf, *md5;
+	long size, mtime;
+
+	assert(item->name[0] == 'f' || item->name[0] == 'e');
+
+	leaf = xml_get_attr(item, "name");
+	size = atol(xml_get_attr(item, "size"));
+	mtime = atol(xml_get_attr(item, "mtime"));
+	md5 = xml_get_attr(item, "MD5sum");
+
+	if (snprintf(src, sizeof(src), "%s/%s", staging, leaf) >=
+			sizeof(src) ||
+	    snprintf(dst, sizeof(dst), "%s/%s", dir, leaf) >=
+			sizeof(dst)) {
+		error("'%s' way too long", leaf);
+		return 0;
+	}
+
+	if (lstat(src, &info)) {
+		if (errno == ENOENT && lstat(dst, &info) == 0 &&
+		    S_ISREG(info.st_mode) && info.st_size == size &&
+		    info.st_mtime == mtime && right_mode(item, &info))
+			return 1;	/* Already committed early */
+		error("lstat: %m ('%s' missing from archive)", leaf);
+		return 0;
+	}
+
+	if (!S_ISREG(info.st_mode)) {
+		error("'%s' is not a regular file!", leaf);
+		return 0;
+	}
+
+	if (info.st_size != size) {
+		error("'%s' has wrong size!", leaf);
+		return 0;
+	}
+
+	if (info.st_mtime != mtime) {
+		error("'%s' has wrong mtime!", leaf);
+		return 0;
+	}
+
+	if (!right_mode(item, &info)) {
+		error("'%s' is not executable!", leaf);
+		return 0;
+	}
+
+	if (check_digest && (!md5 || !fetch_digest_matches(src, item))) {
+		error("'%s' has wrong checksum!", leaf);
+		return 0;
+	}
+
+	store_add(src, &info, check_digest ? md5 : NULL);
+
+	if (rename(src, dst)) {
+		error("rename: %m");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Move each file in 'group' up from 'staging' to 'dir' (see above) */
+static void pull_up_files(Element *group, const char *staging,
+			  const char *dir)
+{
+	Element *item;
+	long bytes = 0;
 
 	if (verbose)
 		syslog(LOG_DEBUG, "(unpacked OK)");
 
 	for (item = group->lastChild; item; item = item->previousSibling) {
-		char up[MAX_PATH_LEN] = "../";
-		const char *size_s, *mtime_s;
-		long size, mtime;
-
 		if (item->name[0] == 'a')
 			continue;
-		assert(item->name[0] == 'f' || item->name[0] == 'e');
 
-		assert(!leaf);
-		leaf = xml_get_attr(item, "name");
+		if (!pull_up_file(item, staging, dir, 0))
+			return;
+		bytes += atol(xml_get_attr(item, "size"));
+	}
 
-		size_s = xml_get_attr(item, "size");
-		size = atol(size_s);
+	catalog_group_cached(dir + cache_dir_len, group, bytes, 1, time(NULL));
+}
 
-		mtime_s = xml_get_attr(item, "mtime");
-		mtime = atol(mtime_s);
+/* Returns the staging directory for a downloaded archive. Each download
+ * gets its own directory (named after the download's unique tmp file),
+ * so several groups in the same directory can be unpacked at once.
+ * free() the result.
+ */
+static char *get_unpack_dir(const char *archive_path)
+{
+	const char *leaf;
 
-		if (lstat(leaf, &info)) {
-			error("lstat: %m ('%s' missing from archive)", leaf);
-			return;
-		}
+	leaf = strrchr(archive_path, '/');
+	assert(leaf);
+	leaf++;
+	assert(strncmp(leaf, TMP_PREFIX, sizeof(TMP_PREFIX) - 1) == 0);
 
-		if (!S_ISREG(info.st_mode)) {
-			error("'%s' is not a regular file!", leaf);
-			return;
-		}
+	return build_string("%d/" UNPACK_PREFIX "%s", archive_path,
+			    leaf + sizeof(TMP_PREFIX) - 1);
+}
 
-		if (info.st_size != size) {
-			error("'%s' has wrong size!", leaf);
-			return;
-		}
+/* The <group> being fetched by this archive task */
+static Element *task_group(Task *task)
+{
+	Element *node = task->data;
 
-		if (info.st_mtime != mtime) {
-			error("'%s' has wrong mtime!", leaf);
-			return;
-		}
+	assert(task->type == TASK_ARCHIVE);
 
-		if (strlen(leaf) > sizeof(up) - 4) {
-			error("'%s' way too long", leaf);
-			return;
-		}
-		strcpy(up + 3, leaf);
-		if (rename(leaf, up)) {
-			error("rename: %m");
-			return;
-		}
-		leaf = NULL;
-	}
+	if (task->flags & TASK_MEMBER)
+		node = node->parentNode;	/* data is the <file> */
+
+	assert(node->name[0] == 'g');
+
+	return node;
 }
 
-/* Unpacks the archive. Uses the group to find out what other files should be
- * there and extract them too. Ensures types, sizes and MD5 sums match.
- * Changes cwd.
+/* Check that the archive downloaded by 'task' has the size and digest
+ * given in the index. 1 if OK.
  */
-static void unpack_archive(const char *archive_path, const char *archive_dir,
-				Element *group)
+static int check_archive(Task *task, const char *archive_path,
+			 Element *group)
 {
-	int status = 0;
+	struct timeval start;
 	struct stat info;
-	pid_t child;
-	const char *argv[] = {"tar", "-xzf", ".tgz", NULL};
-	const char *size, *md5;
-	
-	if (verbose)
-		syslog(LOG_DEBUG, "(unpacking %s)", archive_path);
-	argv[2] = archive_path;
-
-	if (chdir(archive_dir)) {
-		error("chdir: %m");
-		return;
-	}
+	const char *size;
+	int ok;
 
 	if (lstat(archive_path, &info)) {
 		error("lstat: %m");
-		return;
+		return 0;
 	}
 
 	size = xml_get_attr(group, "size");
 
 	if (info.st_size != atol(size)) {
 		error("Downloaded archive has wrong size!");
-		return;
+		return 0;
 	}
 
-	md5 = xml_get_attr(group, "MD5sum");
-	if (!check_md5(archive_path, md5)) {
-		error("Downloaded archive has wrong MD5 checksum!");
-		return;
-	}
-	
-	if (access(".0inst-tmp", F_OK) == 0) {
-		/* error("Removing old .0inst-tmp directory"); */
-		if (system("rm -r .0inst-tmp"))
-			error("rm .0inst-tmp");
+	gettimeofday(&start, NULL);
+	ok = fetch_digest_matches(archive_path, group);
+	span_record("check_digest", task, NULL, &start, info.st_size);
+	if (!ok) {
+		error("Downloaded archive has wrong checksum!");
+		return 0;
 	}
 
-	if (mkdir(".0inst-tmp", 0700)) {
+	return 1;
+}
+
+/* Create a new, empty staging directory for this archive.
+ * Returns its path (free() it), or NULL on error.
+ */
+static char *make_unpack_dir(const char *archive_path)
+{
+	char *staging;
+
+	staging = get_unpack_dir(archive_path);
+	if (!staging)
+		return NULL;
+
+	/* Left over from a crash? No-one else can be using it, since
+	 * fetch_archive merges requests for the same group.
+	 */
+	if (access(staging, F_OK) == 0 && !remove_tree(staging))
+		goto err;
+
+	if (mkdir(staging, 0700)) {
 		error("mkdir: %m");
-		return;
-	}
-	
-	if (chdir(".0inst-tmp")) {
-		error("chdir: %m");
-		return;
+		goto err;
 	}
 
+	return staging;
+err:
+	free(staging);
+	return NULL;
+}
+
+/* Fork a child process to run 'argv' in directory 'dir'.
+ * Returns the child's PID, or -1 on error.
+ */
+static pid_t spawn_in_dir(const char *dir, const char **argv)
+{
+	pid_t child;
+
 	child = fork();
 	if (child == -1) {
 		error("fork: %m");
-		return;
+		return -1;
 	}
 
 	if (child == 0) {
+		if (chdir(dir)) {
+			error("chdir: %m");
+			_exit(1);
+		}
 		execvp(argv[0], (char **) argv);
-		error("Trying to run tar: execvp: %m");
+		error("Trying to run %s: execvp: %m", argv[0]);
 		_exit(1);
 	}
 
-	while (1) {
-		if (waitpid(child, &status, 0) != -1 || errno != EINTR)
-			break;
-	}
+	return child;
+}
 
-	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
-		error("Error unpacking archive");
-	} else {
-		pull_up_files(group);
-	}
+/* Starts tar extracting the archive into a new staging directory. The tar
+ * process runs in the background; task->step will be called when it
+ * finishes. Sets task->child_pid. On error, task->child_pid will still
+ * be -1.
+ */
+static void untar_archive(Task *task, const char *archive_path)
+{
+	const char *argv[] = {"tar", "-xzf", ".tgz", NULL};
+	char *staging;
+	
+	if (verbose)
+		syslog(LOG_DEBUG, "(unpacking %s)", archive_path);
+	argv[2] = archive_path;
 
-	if (chdir(".."))
-		error("chdir: %m");
-	else {
-		if (system("rm -rf .0inst-tmp"))
-			error("rm .0inst-tmp");
-	}
-}
+	assert(task->child_pid == -1);
 
-static void may_rotate_log(void) {
-	struct stat log_info;
-	char *backup = NULL;
+	staging = make_unpack_dir(archive_path);
+	if (!staging)
+		return;
 
-	if (stat(wget_log, &log_info) != 0)
-		return;	/* Doesn't exist yet? OK. */
+	gettimeofday(&task->started, NULL);	/* Download already noted */
+	task->child_pid = spawn_in_dir(staging, argv);
+	if (task->child_pid == -1 && !remove_tree(staging))
+		error("Failed to remove '%s'", staging);
 
-	if (log_info.st_size < 10000)
+	free(staging);
+}
+
+/* Checks the archive's size and MD5 sum against the group, and then
+ * unpacks it, as for untar_archive().
+ */
+static void unpack_archive(Task *task, const char *archive_path,
+			   Element *group)
+{
+	assert(task->child_pid == -1);
+
+	if (!check_archive(task, archive_path, group))
+		return;
+
+	untar_archive(task, archive_path);
+}
+
+/* Seconds between checks on the size of wget's log */
+#define ROTATE_CHECK_INTERVAL 60
+
+static void may_rotate_log(void) {
+	static time_t last_check = 0;
+	struct stat log_info;
+	char *backup = NULL;
+	time_t now = time(NULL);
+
+	/* Not before every download; it doesn't grow that fast */
+	if (now < last_check + ROTATE_CHECK_INTERVAL && now >= last_check)
+		return;
+	last_check = now;
+
+	if (stat(wget_log, &log_info) != 0)
+		return;	/* Doesn't exist yet? OK. */
+
+	if (log_info.st_size < 10000)
 		return;	/* Nice and small. Keep it. */
 
 	backup = build_string("%s.old", wget_log);
@@ -377,80 +802,651 @@ static void may_rotate_log(void) {
 	}
 }
 
+/* task has just started downloading 'uri' into task->str (somewhere in
+ * a site's cache directory). Tell the circuit breakers, remember the
+ * mirror in task->mirror, and start watching its progress.
+ */
+static void note_started(Task *task, const char *uri)
+{
+	char *site, *slash;
+
+	if (task->mirror)
+		free(task->mirror);
+	task->mirror = my_strdup(uri);
+	if (task->mirror) {
+		slash = strrchr(task->mirror, '/');
+		if (slash)
+			*slash = '\0';
+	}
+
+	site = build_string("%h", task->str + cache_dir_len + 1);
+	if (site && task->mirror)
+		breaker_started(task->child_pid, site, task->mirror);
+
+	if (site)
+		free(site);
+
+	if (!progress_timer)
+		progress_timer = timer_add(PROGRESS_MS, progress_tick, NULL);
+}
+
 /* Begins fetching 'uri', storing the file as 'path'.
+ * If 'range' is given, it is a "bytes=first-last" HTTP byte range.
+ * With TASK_OWN_LOG, wget's messages go to <path>.log (see take_own_log).
  * Sets task->child_pid and makes task->str a copy of 'path'.
  * On error, task->child_pid will still be -1.
  */
-static void wget(Task *task, const char *uri, const char *path, int use_cache)
+static void wget(Task *task, const char *uri, const char *path, int use_cache,
+		 const char *range)
 {
 	const char *argv[] = {"wget",
 			"-O", NULL,
 			verbose ? "--tries=1" : "--tries=3",
 			"-a", wget_log,
-			use_cache ? uri  : "--cache=off",
-			use_cache ? NULL : uri,
-			NULL};
+			NULL, NULL, NULL, NULL};
+	char *header = NULL, *log = NULL;
 	char *slash;
+	int i = 6;
+
+	log_task(SUB_FETCH, LOG_INFO, task, "fetch", "Fetching '%s'%s%s", uri,
+			range ? " " : "", range ? range : "");
+
+	assert(task->child_pid == -1);
+
+	task_set_string(task, path);
+	if (!task->str)
+		return;
+	argv[2] = task->str;
+
+	if (task->flags & TASK_OWN_LOG) {
+		log = build_string("%s.log", path);
+		if (!log)
+			goto err;
+		argv[4] = "-o";
+		argv[5] = log;
+	}
+
+	if (!use_cache)
+		argv[i++] = "--cache=off";
+	if (range) {
+		header = build_string("--header=Range: %s", range);
+		if (!header)
+			goto err;
+		argv[i++] = header;
+	}
+	argv[i++] = uri;	/* Some versions of wget need this last */
+
+	slash = strrchr(task->str, '/');
+	assert(slash != NULL);
+
+	*slash = '\0';
+	if (!ensure_dir(task->str))
+		goto err;
+	*slash = '/';
+
+	may_rotate_log();
+
+	gettimeofday(&task->started, NULL);
+	task->received = 0;
+	task->rate = 0;
+	task->child_pid = fork();
+	if (task->child_pid == -1) {
+		error("fork: %m");
+		goto err;
+	} else if (task->child_pid) {
+		note_started(task, uri);
+		task->flags |= TASK_DOWNLOADING;
+		if (header)
+			free(header);
+		if (log)
+			free(log);
+		return;
+	}
+
+	execvp(argv[0], (char **) argv);
+
+	error("Trying to run wget: execvp: %m");
+	_exit(1);
+err:
+	if (header)
+		free(header);
+	if (log)
+		free(log);
+	task_set_string(task, NULL);
+}
+
+/* task's wget (run with TASK_OWN_LOG) has finished. Add its log to the
+ * main wget log and remove it.
+ * 1 if the server said the file doesn't exist (404 or 410).
+ */
+static int take_own_log(Task *task)
+{
+	char line[1024];
+	char *path;
+	FILE *in, *out;
+	int missing = 0;
+
+	task->flags &= ~TASK_OWN_LOG;
+
+	path = build_string("%s.log", task->str);
+	if (!path)
+		return 0;
+
+	in = fopen(path, "r");
+	if (!in) {
+		error("fopen(%s): %m", path);
+		goto out;
+	}
+
+	out = fopen(wget_log, "a");
+	if (!out)
+		error("fopen(%s): %m", wget_log);
+
+	while (fgets(line, sizeof(line), in)) {
+		if (strstr(line, "ERROR 404") || strstr(line, "ERROR 410"))
+			missing = 1;
+		if (out)
+			fputs(line, out);
+	}
+
+	fclose(in);
+	if (out && fclose(out))
+		error("Writing %s: %m", wget_log);
+
+	if (unlink(path))
+		error("unlink(%s): %m", path);
+out:
+	free(path);
+	return missing;
+}
+
+/* Update task->received and task->rate for each download in progress,
+ * from the size of its file so far. Sets *changed if any have changed.
+ * Returns the number of downloads in progress.
+ */
+static int update_progress(int *changed)
+{
+	static struct timeval last = {0, 0};
+	struct timeval now;
+	struct stat info;
+	Task *task;
+	int active = 0;
+
+	gettimeofday(&now, NULL);
+
+	for (task = all_tasks; task; task = task->next) {
+		const struct timeval *since;
+		double secs;
+		long rate;
+
+		if (!(task->flags & TASK_DOWNLOADING))
+			continue;
+		active++;
+
+		if (lstat(task->str, &info))
+			continue;	/* Nothing yet */
+
+		since = timercmp(&task->started, &last, >) ?
+				&task->started : &last;
+		secs = (now.tv_sec - since->tv_sec) +
+		       (now.tv_usec - since->tv_usec) / 1e6;
+		if (secs <= 0)
+			continue;
+
+		/* Smooth it a little, but not so much that stalls don't show */
+		rate = (info.st_size - task->received) / secs;
+		if (task->received)
+			rate = (task->rate + rate) / 2;
+
+		if (info.st_size != task->received || rate != task->rate)
+			*changed = 1;
+		task->received = info.st_size;
+		task->rate = rate;
+	}
+
+	last = now;
+
+	return active;
+}
+
+/* The one timer for download progress. The status table (status.c) just
+ * reads task->received and task->rate; monitors are told when they change.
+ */
+static void progress_tick(void *data)
+{
+	int changed = 0;
+
+	progress_timer = NULL;
+
+	if (update_progress(&changed))
+		progress_timer = timer_add(PROGRESS_MS, progress_tick, NULL);
+
+	if (changed)
+		control_notify_progress();
+}
+
+/* task has successfully downloaded task->str. Record how fast it came,
+ * for estimating how long future fetches will take.
+ */
+static void note_download(Task *task)
+{
+	struct timeval now;
+	struct stat info;
+	long ms;
+
+	if (!timerisset(&task->started) || !task->index ||
+	    lstat(task->str, &info))
+		return;
+
+	gettimeofday(&now, NULL);
+	ms = (now.tv_sec - task->started.tv_sec) * 1000 +
+	     (now.tv_usec - task->started.tv_usec) / 1000;
+
+	mirrors_note_download(task->index->site, info.st_size, ms);
+
+	span_record("download", task, NULL, &task->started, info.st_size);
+	metrics_count("zeroinstall_download_bytes_total", task->index->site,
+		      info.st_size);
+	if (ms > 0 && task->mirror)
+		metrics_observe("zeroinstall_download_bytes_per_second",
+				task->mirror, info.st_size * 1000.0 / ms);
+}
+
+/* task->str has been unpacked and moved into place. Record how long
+ * that took.
+ */
+static void note_unpacked(Task *task)
+{
+	/* Streamed archives are unpacked as they download */
+	if (task->flags & TASK_STREAMING || !timerisset(&task->started))
+		return;
+
+	metrics_observe("zeroinstall_unpack_seconds", NULL,
+			metrics_seconds_since(&task->started));
+	span_record("unpack", task, NULL, &task->started, -1);
+}
+
+/* The archive has been unpacked into its staging directory (unless 'err'
+ * is set). Move the files into place, clean up and finish the task.
+ */
+static void finish_archive(Task *task, const char *err)
+{
+	Element *group = task_group(task);
+	char *staging, *dir;
+
+	staging = get_unpack_dir(task->str);
+	dir = build_string("%d", task->str);
+
+	if (err)
+		error("Error unpacking archive");
+	else if (staging && dir) {
+		struct timeval start;
+
+		gettimeofday(&start, NULL);
+		pull_up_files(group, staging, dir);
+		span_record("pull_up_files", task, NULL, &start, -1);
+		note_unpacked(task);
+	}
+	else
+		err = "Out of memory";
+
+	if (staging && access(staging, F_OK) == 0 && !remove_tree(staging))
+		error("Failed to remove '%s'", staging);
+
+	if (staging)
+		free(staging);
+	if (dir)
+		free(dir);
+
+	if (unlink(task->str) && errno != ENOENT)
+		error("unlink '%s': %m", task->str);
+
+	task_destroy(task, err);
+}
+
+/* tar has finished (successfully or not) for this archive task */
+static void unpacked_archive(Task *task, const char *err)
+{
+	finish_archive(task, err);
+}
+
+static void got_archive(Task *task, const char *err)
+{
+	if (!err) {
+		note_download(task);
+		unpack_archive(task, task->str, task->data);
+		if (task->child_pid != -1) {
+			task->step = unpacked_archive;
+			return;
+		}
+		err = "Failed to unpack archive";
+	} else {
+		/* XXX: maybe the index is too old? force a refresh... */
+		error("Failed to fetch archive (%s)", task->str);
+	}
+
+	if (unlink(task->str))
+		error("unlink '%s': %m", task->str);
+
+	task_destroy(task, err);
+}
+
+/* Seekable archives:
+ *
+ * A seekable archive is a series of gzip members, one per file (each
+ * containing just that file's tar header and data), followed by a final
+ * member holding the tar end-of-archive blocks. tar can unpack the whole
+ * thing as usual, but any single member can also be unpacked on its own.
+ * The index gives each file's 'offset' and 'length' within the archive,
+ * and the file's own MD5sum, so that when only one file from a large group
+ * is wanted we can fetch just that member using an HTTP Range request.
+ * Servers which ignore Range send the whole archive, which we then use as
+ * normal.
+ */
+
+/* Don't bother with single members for groups smaller than this */
+#define MEMBER_MIN_GROUP_SIZE 65536
+
+/* Returns the <file> or <exec> element for 'file' if it's worth fetching
+ * just that member of 'group', or NULL to fetch the whole archive.
+ */
+static Element *seekable_member(const char *file, Element *group)
+{
+	Element *item, *found = NULL;
+	const char *leaf;
+	long group_size;
+	int n_files = 0;
+
+	group_size = atol(xml_get_attr(group, "size"));
+	if (group_size < MEMBER_MIN_GROUP_SIZE)
+		return NULL;
+
+	leaf = strrchr(file, '/');
+	assert(leaf);
+	leaf++;
+
+	for (item = group->lastChild; item; item = item->previousSibling) {
+		if (item->name[0] == 'a')
+			continue;
+		n_files++;
+		if (strcmp(xml_get_attr(item, "name"), leaf) == 0)
+			found = item;
+	}
+
+	if (!found || n_files < 2 || !xml_get_attr(found, "offset"))
+		return NULL;
+
+	/* Most of the archive anyway? Get it all while we're at it. */
+	if (atol(xml_get_attr(found, "length")) * 2 > group_size)
+		return NULL;
+
+	return found;
+}
+
+/* tar has finished unpacking a single member */
+static void unpacked_member(Task *task, const char *err)
+{
+	Element *item = task->data;
+	char *staging, *dir;
+
+	staging = get_unpack_dir(task->str);
+	dir = build_string("%d", task->str);
+
+	if (err)
+		error("Error unpacking archive member");
+	else if (!staging || !dir)
+		err = "Out of memory";
+	else if (!pull_up_file(item, staging, dir, 1))
+		err = "Archive member is corrupted";
+	else {
+		catalog_file_cached(dir + cache_dir_len, item);
+		note_unpacked(task);
+	}
+
+	if (staging && access(staging, F_OK) == 0 && !remove_tree(staging))
+		error("Failed to remove '%s'", staging);
+
+	if (staging)
+		free(staging);
+	if (dir)
+		free(dir);
+
+	if (unlink(task->str) && errno != ENOENT)
+		error("unlink '%s': %m", task->str);
+
+	task_destroy(task, err);
+}
+
+static void got_member(Task *task, const char *err)
+{
+	Element *item = task->data;
+	struct stat info;
+
+	if (err) {
+		error("Failed to fetch archive member (%s)", task->str);
+	} else if (lstat(task->str, &info)) {
+		error("lstat: %m");
+		err = "Failed to fetch archive member";
+	} else if (info.st_size == atol(xml_get_attr(item, "length"))) {
+		note_download(task);
+		untar_archive(task, task->str);
+		if (task->child_pid != -1) {
+			task->step = unpacked_member;
+			return;
+		}
+		err = "Failed to unpack archive member";
+	} else {
+		/* Server ignored the Range header. Maybe we got
+		 * the whole archive instead?
+		 */
+		syslog(LOG_INFO, "Range not supported; using whole archive");
+		unpack_archive(task, task->str, task_group(task));
+		if (task->child_pid != -1) {
+			task->step = unpacked_archive;
+			return;
+		}
+		err = "Failed to unpack archive";
+	}
+
+	if (unlink(task->str) && errno != ENOENT)
+		error("unlink '%s': %m", task->str);
+
+	task_destroy(task, err);
+}
+
+/* Start fetching just the member 'item' from its group's archive at 'uri',
+ * storing it as 'path'. As for wget().
+ */
+static void wget_member(Task *task, const char *uri, const char *path,
+			Element *item)
+{
+	char range[64];
+	long offset, length;
+
+	offset = atol(xml_get_attr(item, "offset"));
+	length = atol(xml_get_attr(item, "length"));
+	assert(length > 0);
+
+	snprintf(range, sizeof(range), "bytes=%ld-%ld",
+			offset, offset + length - 1);
+
+	wget(task, uri, path, 1, range);
+}
+
+/* Streaming (--early-wakeup) mode:
+ *
+ * wget's output is piped through tar as it arrives, while a copy of the
+ * archive is kept so that its MD5 sum can be checked at the end. Every
+ * STREAM_POLL_MS we look in the staging directory for files which tar has
+ * finished (size, mtime and mode correct; GNU tar sets the mtime before
+ * the mode, so an <exec> isn't done until it's executable). Those with
+ * their own MD5sum in the index are checked and committed at once, and any
+ * kernel requests for just that file are woken up. Files without their own
+ * MD5 sum must wait for the archive's sum to be checked, as before.
+ */
+
+/* 1 if any file in the group has its own MD5 sum */
+static int group_has_file_digests(Element *group)
+{
+	Element *item;
+
+	for (item = group->lastChild; item; item = item->previousSibling) {
+		if (item->name[0] != 'a' && xml_get_attr(item, "MD5sum"))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Move each completed and verified file in 'task's staging directory into
+ * place, waking up any requests waiting for just that file.
+ */
+static void commit_verified_files(Task *task)
+{
+	Element *group = task->data;
+	Element *item;
+	char *staging, *dir;
+
+	staging = get_unpack_dir(task->str);
+	dir = build_string("%d", task->str);
+	if (!staging || !dir)
+		goto out;
+
+	for (item = group->lastChild; item; item = item->previousSibling) {
+		char src[MAX_PATH_LEN];
+		char dst[MAX_PATH_LEN];
+		struct stat info;
+		const char *leaf, *md5;
+
+		if (item->name[0] == 'a')
+			continue;
+		md5 = xml_get_attr(item, "MD5sum");
+		if (!md5)
+			continue;
+		leaf = xml_get_attr(item, "name");
+
+		if (snprintf(src, sizeof(src), "%s/%s", staging, leaf) >=
+				sizeof(src) ||
+		    snprintf(dst, sizeof(dst), "%s/%s", dir, leaf) >=
+				sizeof(dst))
+			continue;
+
+		if (lstat(src, &info) || !S_ISREG(info.st_mode))
+			continue;	/* Not started, or already committed */
+		if (info.st_size != atol(xml_get_attr(item, "size")) ||
+		    info.st_mtime != atol(xml_get_attr(item, "mtime")) ||
+		    !right_mode(item, &info))
+			continue;	/* tar hasn't finished with it yet */
+
+		if (!fetch_digest_matches(src, item)) {
+			error("'%s' has wrong checksum!", leaf);
+			continue;
+		}
+
+		if (rename(src, dst)) {
+			error("rename: %m");
+			continue;
+		}
+
+		kernel_file_ready(task, dst);
+	}
+out:
+	if (staging)
+		free(staging);
+	if (dir)
+		free(dir);
+}
+
+static Timer *stream_timer = NULL;
+
+static void poll_streams(void *data)
+{
+	Task *task;
+	int active = 0;
+
+	stream_timer = NULL;
+
+	for (task = all_tasks; task; task = task->next) {
+		if (task->type == TASK_ARCHIVE &&
+		    (task->flags & TASK_STREAMING) &&
+		    task->child_pid != -1) {
+			commit_verified_files(task);
+			active = 1;
+		}
+	}
+
+	if (active)
+		stream_timer = timer_add(STREAM_POLL_MS, poll_streams, NULL);
+}
+
+/* The wget | tee | tar pipeline has finished */
+static void streamed_archive(Task *task, const char *err)
+{
+	/* Files with their own MD5 sums are safe whatever happened
+	 * to the rest of the archive.
+	 */
+	commit_verified_files(task);
+
+	if (!err && !check_archive(task, task->str, task->data))
+		err = "Downloaded archive is corrupted";
+	if (!err)
+		note_download(task);
+
+	finish_archive(task, err);
+}
+
+/* Like wget(), but unpacks the archive into the group's staging directory
+ * as it downloads (see above). Sets task->child_pid.
+ */
+static void wget_streaming(Task *task, const char *uri, const char *path)
+{
+	const char *argv[] = {"sh", "-c",
+		"wget -O - --tries=$1 -a \"$2\" \"$3\" | "
+		"tee \"$4\" | tar -xzf -",
+		"sh", verbose ? "1" : "3", wget_log, uri, NULL,
+		NULL};
+	char *staging;
 
-	syslog(LOG_INFO, "Fetching '%s'", uri);
+	log_task(SUB_FETCH, LOG_INFO, task, "fetch",
+			"Fetching '%s' (unpacking as it arrives)", uri);
 
 	assert(task->child_pid == -1);
 
 	task_set_string(task, path);
 	if (!task->str)
 		return;
-	argv[2] = task->str;
-
-	slash = strrchr(task->str, '/');
-	assert(slash != NULL);
+	argv[7] = task->str;
 
-	*slash = '\0';
-	if (!ensure_dir(task->str))
-		goto err;
-	*slash = '/';
+	staging = make_unpack_dir(task->str);
+	if (!staging)
+		return;
 
 	may_rotate_log();
 
-	task->child_pid = fork();
+	gettimeofday(&task->started, NULL);
+	task->received = 0;
+	task->rate = 0;
+	task->child_pid = spawn_in_dir(staging, argv);
 	if (task->child_pid == -1) {
-		error("fork: %m");
-		goto err;
-	} else if (task->child_pid)
-		return;
-
-	execvp(argv[0], (char **) argv);
-
-	error("Trying to run wget: execvp: %m");
-	_exit(1);
-err:
-	task_set_string(task, NULL);
-}
-
-static void got_archive(Task *task, const char *err)
-{
-	if (!err) {
-		char *dir;
-
-		dir = build_string("%d", task->str);
-		if (dir) {
-			unpack_archive(task->str, dir, task->data);
-			free(dir);
-		}
+		if (!remove_tree(staging))
+			error("Failed to remove '%s'", staging);
 	} else {
-		/* XXX: maybe the index is too old? force a refresh... */
-		error("Failed to fetch archive (%s)", task->str);
+		note_started(task, uri);
+		task->flags |= TASK_STREAMING | TASK_DOWNLOADING;
+		task->step = streamed_archive;
+		if (!stream_timer)
+			stream_timer = timer_add(STREAM_POLL_MS,
+						 poll_streams, NULL);
 	}
 
-	if (unlink(task->str))
-		error("unlink '%s': %m", task->str);
-
-	task_destroy(task, err);
+	free(staging);
 }
 
 /* 1 on success */
 int build_ddds_for_site(Index *index, const char *site)
 {
 	char path[MAX_PATH_LEN];
+	struct timeval start;
 	char *dir;
 
 	assert(site != NULL);
@@ -470,34 +1466,134 @@ int build_ddds_for_site(Index *index, const char *site)
 	strcpy(path, dir);
 	free(dir);
 
+	gettimeofday(&start, NULL);
 	build_ddd_from_index(index_get_root(index), path);
+	metrics_observe("zeroinstall_ddd_build_seconds", NULL,
+			metrics_seconds_since(&start));
+	span_record("build_ddds", NULL, site, &start, -1);
+
+	catalog_site_indexed(site, catalog_generation(site));
 
 	return 1;
 }
 
 /* The index.tar.bz2 file is in site's meta directory.
- * Unpack it. NULL on success, or pointer to error message.
+ * Unpack it into the STAGED directory there, leaving the current files
+ * alone until the new index has been checked (see install_index).
+ * NULL on success, or pointer to error message.
  */
 static const char *unpack_site_archive(const char *site)
 {
-	const char *err = "Error";
+	const char *err = "Failed to extract GPG signature/keyring/mirrors!";
+	char *staged;
 
 	assert(strchr(site, '/') == NULL);
 
-	if (chdir_meta(site))
+	staged = build_string("%s/%s/" META "/" STAGED, cache_dir, site);
+	if (!staged)
+		return "Out of memory";
+
+	if (chdir_meta(site)) {
+		free(staged);
 		return "chdir failed";
+	}
 
-	if (system("tar --bzip2 -xf index.tar.bz2 keyring.pub mirrors.xml "
-		   "index.xml.sig") == 0)
-		err = NULL;
-	else
-		err = "Failed to extract GPG signature/keyring/mirrors!";
+	if (access(STAGED, F_OK) == 0 && !remove_tree(staged))
+		goto out;
+	if (mkdir(STAGED, 0755)) {
+		error("mkdir(%s): %m", staged);
+		goto out;
+	}
 
+	if (system("tar -C " STAGED " --bzip2 -xf index.tar.bz2 "
+		   "keyring.pub mirrors.xml index.xml.sig") == 0)
+		err = NULL;
+out:
+	free(staged);
 	if (chdir("/"))
 		abort();
 	return err;
 }
 
+/* Move the files of a checked index from INSTALLING into place, and
+ * remove it. Files already moved are skipped, so this also finishes an
+ * install we were stopped in the middle of.
+ * Must be in site's meta directory. 0 on error.
+ */
+static int finish_install(void)
+{
+	char path[MAX_PATH_LEN];
+	int i;
+
+	for (i = 0; index_files[i]; i++) {
+		snprintf(path, sizeof(path), INSTALLING "/%s", index_files[i]);
+		if (rename(path, index_files[i]) && errno != ENOENT) {
+			error("rename(%s): %m", path);
+			return 0;
+		}
+	}
+
+	if (rmdir(INSTALLING)) {
+		error("rmdir(%s): %m", INSTALLING);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Check ./<leafname> against the signature unpacked into STAGED, and
+ * parse it. If it's OK, move it into STAGED as index.xml and rename
+ * STAGED to INSTALLING; that is the point at which the new set is
+ * installed. Then move its files into place (finish_install). Until then
+ * the old files are untouched, so the old index is still served (and
+ * still checks out) while the new one is being fetched, and a bad archive
+ * changes nothing. If we're stopped part way through moving the files,
+ * load_index() finishes the job.
+ * Must be in site's meta directory.
+ * Returns the new index, or NULL on failure (err is set).
+ */
+static Index *install_index(const char *site, const char *leafname,
+			    int is_new, const char **err)
+{
+	Index *index;
+
+	*err = gpg_trusted(site, STAGED, leafname, is_new);
+	if (*err)
+		return NULL;
+
+	index = parse_index(leafname, 1, site);
+	if (!index) {
+		*err = "Index is not valid";
+		return NULL;
+	}
+
+	/* An old, unfinished install would stop the rename below */
+	if (access(INSTALLING, F_OK) == 0 && !finish_install())
+		goto err;
+
+	if (strcmp(leafname, "index.xml") != 0 &&
+	    rename(leafname, STAGED "/index.xml")) {
+		error("rename(%s): %m", leafname);
+		goto err;
+	}
+
+	if (rename(STAGED, INSTALLING)) {
+		error("rename(%s): %m", STAGED);
+		goto err;
+	}
+
+	if (!finish_install())
+		goto err;
+
+	remember_index(index);
+
+	return index;
+err:
+	*err = "Failed to install new index";
+	index_free(index);
+	return NULL;
+}
+
 /* The index.xml.bz2 file is in site's meta directory.
  * Check signatures, validates and build all ... files.
  * Returns the new index on success, or NULL on failure (error is set).
@@ -521,23 +1617,17 @@ static Index *unpack_site_index(const char *site, const char **err)
 			error("unlink bz2: %m");
 	}
 
-	*err = gpg_trusted(site, "index.new", 1);
-	if (*err) {
-		if (unlink("index.new"))
+	/* Check the new index completely before replacing the old one, which
+	 * is still being used until then.
+	 */
+	index = install_index(site, "index.new", 1, err);
+	if (!index) {
+		if (unlink("index.new") && errno != ENOENT)
 			error("unlink: %m");
 		goto out;
 	}
 
-	if (rename("index.new", "index.xml")) {
-		error("rename: %m");
-		goto out;
-	}
-
-	index = load_index(site);
-	if (!index) {
-		*err = "Index is not valid";
-		goto out;
-	}
+	negative_clear(site);
 
 	if (!build_ddds_for_site(index, site)) {
 		*err = "Failed to create index files";
@@ -552,6 +1642,16 @@ out:
 	return index;
 }
 
+/* task has fetched part of 'site''s index into task->str */
+static void note_index_download(Task *task, const char *site)
+{
+	struct stat info;
+
+	if (span_capacity && lstat(task->str, &info) == 0)
+		span_record("download_index", task, site, &task->started,
+			    info.st_size);
+}
+
 static void got_site_index(Task *task, const char *err)
 {
 	assert(task->type == TASK_INDEX);
@@ -562,6 +1662,7 @@ static void got_site_index(Task *task, const char *err)
 
 		site = build_string("%h", task->str + cache_dir_len + 1);
 		if (site) {
+			note_index_download(task, site);
 			task_steal_index(task, unpack_site_index(site, &err));
 			if (!err && !task->index)
 				err = "Failed to load index";
@@ -576,6 +1677,27 @@ static void got_site_index(Task *task, const char *err)
 	task_destroy(task, err);
 }
 
+/* We've just unpacked a new index archive for 'site'. If the index.xml we
+ * have is the one it signs, install the archive's files and return the
+ * index. NULL if we need to fetch the new index.xml.
+ */
+static Index *check_current_index(const char *site)
+{
+	Index *index = NULL;
+	const char *err = NULL;
+
+	if (chdir_meta(site))
+		return NULL;
+
+	if (access("index.xml", F_OK) == 0)
+		index = install_index(site, "index.xml", 0, &err);
+
+	if (chdir("/"))
+		abort();
+
+	return index;
+}
+
 /* We've downloaded the index archive, but don't have an up-to-date
  * index.xml. Start fetching that...
  * 1 on success (fetch in progress).
@@ -584,7 +1706,7 @@ static int fetch_index_file(Task *task, const char *site)
 {
 	char *uri, *bz;
 
-	uri = mirrors_get_best_url(site, NULL);
+	uri = mirrors_get_staged_index_url(site);
 	if (!uri)
 		return 0;
 
@@ -595,7 +1717,7 @@ static int fetch_index_file(Task *task, const char *site)
 	}
 
 	task->step = got_site_index;
-	wget(task, uri, bz, 1);
+	wget(task, uri, bz, 1, NULL);
 	free(bz);
 	free(uri);
 
@@ -607,20 +1729,45 @@ static int fetch_index_file(Task *task, const char *site)
 
 static void got_site_index_archive(Task *task, const char *err)
 {
+	int missing;
+
 	assert(task->type == TASK_INDEX);
 	assert(task->child_pid == -1);
 
-	if (err)
+	missing = take_own_log(task);
+
+	if (err) {
+		char *site, *old;
+
+		/* If the server says it has no index (404 or 410), and we've
+		 * never had one from it, maybe it isn't a site at all. Don't
+		 * keep trying. Other errors (eg, 500) and network problems
+		 * are left to the breakers.
+		 */
+		site = build_string("/%h", task->str + cache_dir_len + 1);
+		old = build_string("%s/%h/" META "/index.xml", cache_dir,
+				   task->str + cache_dir_len + 1);
+		if (site && old && missing &&
+		    task->flags & TASK_SERVER_ERROR &&
+		    access(old, F_OK) != 0)
+			negative_add(site);
+		if (site)
+			free(site);
+		if (old)
+			free(old);
 		err = "Failed to fetch index archive";
+	}
 
 	if (!err) {
 		char *site = NULL;
 
 		site = build_string("%h", task->str + cache_dir_len + 1);
 		if (site) {
+			note_index_download(task, site);
 			err = unpack_site_archive(site);
 			if (!err) {
-				task_steal_index(task, load_index(site));
+				task_steal_index(task,
+						 check_current_index(site));
 				if (!task->index) {
 					if (fetch_index_file(task, site))
 						return;
@@ -646,7 +1793,7 @@ static Task *fetch_site_index(const char *path, int use_cache)
 {
 	Task *task = NULL;
 	char *tbz = NULL, *uri = NULL;
-	char *site_dir = NULL;
+	char *site_dir = NULL, *site = NULL;
 
 	assert(path[0] != '/');
 
@@ -656,7 +1803,8 @@ static Task *fetch_site_index(const char *path, int use_cache)
 
 	for (task = all_tasks; task; task = task->next) {
 		if (task->type == TASK_INDEX && strcmp(task->str, tbz) == 0) {
-			syslog(LOG_INFO, "Merging with task %d", task->n);
+			log_task(SUB_FETCH, LOG_INFO, task, "merge",
+					"Merging with task %d", task->n);
 			goto out;
 		}
 	}
@@ -667,6 +1815,15 @@ static Task *fetch_site_index(const char *path, int use_cache)
 	if (!uri)
 		goto out;
 
+	site = build_string("%h", path);
+	if (!site)
+		goto out;
+	if (!breaker_allow(site)) {
+		syslog(LOG_INFO, "Not fetching index for '%s' now (%s)", site,
+				offline ? "offline" : "site is failing");
+		goto out;
+	}
+
 	site_dir = build_string("%s/%h", cache_dir, path);
 	if (!site_dir || !ensure_dir(site_dir))
 		goto out;
@@ -676,8 +1833,9 @@ static Task *fetch_site_index(const char *path, int use_cache)
 		goto out;
 
 	task->step = got_site_index_archive;
+	task->flags |= TASK_OWN_LOG;
 
-	wget(task, uri, tbz, use_cache);
+	wget(task, uri, tbz, use_cache, NULL);
 	if (task->child_pid == -1) {
 		task_destroy(task, "Failed to fork child process");
 		task = NULL;
@@ -690,6 +1848,8 @@ out:
 		free(uri);
 	if (site_dir)
 		free(site_dir);
+	if (site)
+		free(site);
 	return task;
 }
 
@@ -783,6 +1943,9 @@ Index *get_index(const char *path, Task **task, int force)
 		return NULL;	/* Don't waste time looking for these */
 	}
 
+	if (!force && negative_check(path - 1))
+		return NULL;	/* Failed recently */
+
 	/* TODO: compare times? */
 	if (!force) {
 		Index *index;
@@ -805,6 +1968,282 @@ Index *get_index(const char *path, Task **task, int force)
 	return NULL;
 }
 
+/* Batched fetches:
+ *
+ * When a program starts, the kernel often asks for files from several
+ * groups of the same site at once, and fetching each group separately
+ * means one connection per group. If the site publishes a pack (all its
+ * archives, one after another, in a single file; see 0build --pack),
+ * requests for packed groups wait BATCH_WINDOW_MS for others to arrive.
+ * Groups lying close together in the pack are then fetched with a single
+ * Range request, split out, and checked against their own MD5 sums just
+ * as if they had been fetched separately.
+ */
+#define BATCH_WINDOW_MS 5
+
+/* Fetch separately rather than download a gap bigger than this */
+#define BATCH_MAX_GAP 65536
+
+/* Most groups to collect from one site in one window */
+#define BATCH_MAX 64
+
+static Timer *batch_timer = NULL;
+
+static long pack_offset(Task *task)
+{
+	return atol(xml_get_attr(task->data, "pack_offset"));
+}
+
+static const char *task_pack(Task *task)
+{
+	return xml_get_attr(task->index->doc, "pack");
+}
+
+static int compare_pack_offsets(const void *a, const void *b)
+{
+	long diff = pack_offset(*(Task **) a) - pack_offset(*(Task **) b);
+
+	return diff < 0 ? -1 : diff > 0 ? 1 : 0;
+}
+
+/* Copy 'size' bytes from 'src', starting at 'offset', into a new
+ * file 'dst'. 1 on success.
+ */
+static int copy_range(const char *src, long offset, long size,
+		      const char *dst)
+{
+	char buffer[65536];
+	int in, out = -1;
+	int ok = 0;
+
+	in = open(src, O_RDONLY);
+	if (in == -1) {
+		error("open '%s': %m", src);
+		return 0;
+	}
+
+	if (lseek(in, offset, SEEK_SET) != offset) {
+		error("lseek: %m");
+		goto out;
+	}
+
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out == -1) {
+		error("open '%s': %m", dst);
+		goto out;
+	}
+
+	while (size > 0) {
+		int got;
+
+		got = read(in, buffer,
+			   size < sizeof(buffer) ? size : sizeof(buffer));
+		if (got <= 0) {
+			error("Short read from '%s'", src);
+			goto out;
+		}
+		if (write(out, buffer, got) != got) {
+			error("write: %m");
+			goto out;
+		}
+		size -= got;
+	}
+
+	ok = 1;
+out:
+	my_close(in);
+	my_close(out);
+	return ok;
+}
+
+/* The pack data for a batch has arrived (or failed to). Split out each
+ * group's archive and carry on as if it had been fetched by itself.
+ * bundle->data is the first group in the range.
+ */
+static void got_bundle(Task *bundle, const char *err)
+{
+	struct stat info;
+	long base = 0;
+	Task *task;
+
+	if (!err) {
+		if (lstat(bundle->str, &info)) {
+			error("lstat: %m");
+			err = "Failed to fetch pack";
+		} else if (info.st_size == bundle->size) {
+			note_download(bundle);
+			base = atol(xml_get_attr(bundle->data, "pack_offset"));
+		}
+		/* else the server ignored Range and sent the whole pack */
+	} else
+		error("Failed to fetch pack (%s)", bundle->str);
+
+	task = all_tasks;
+	while (task) {
+		if (task->child_task != bundle) {
+			task = task->next;
+			continue;
+		}
+
+		task->child_task = NULL;
+		if (err)
+			task_destroy(task, err);
+		else if (!copy_range(bundle->str, pack_offset(task) - base,
+				     task->size, task->str)) {
+			if (unlink(task->str) && errno != ENOENT)
+				error("unlink '%s': %m", task->str);
+			task_destroy(task, "Failed to split pack");
+		} else
+			got_archive(task, NULL);
+
+		task = all_tasks;
+	}
+
+	if (bundle->str && unlink(bundle->str) && errno != ENOENT)
+		error("unlink '%s': %m", bundle->str);
+
+	task_destroy(bundle, err);
+}
+
+/* Start fetching the archive for a single waiting task on its own */
+static void fetch_alone(Task *task)
+{
+	char *uri, *path;
+
+	path = task->str;
+	task->str = NULL;
+
+	uri = mirrors_get_best_url(task->index->site,
+				   xml_get_attr(task->data, "href"));
+	if (uri) {
+		wget(task, uri, path, 1, NULL);
+		free(uri);
+	}
+	free(path);
+
+	if (task->child_pid == -1)
+		task_destroy(task, "Failed to fork child process");
+}
+
+/* Fetch the groups for 'tasks' (sorted by pack offset, all from the same
+ * pack) with a single request.
+ */
+static void fetch_batch(Task **tasks, int n)
+{
+	Task *bundle;
+	char path[MAX_PATH_LEN];
+	char range[64];
+	long start, end;
+	char *uri = NULL;
+	int i;
+
+	if (n == 1) {
+		fetch_alone(tasks[0]);
+		return;
+	}
+
+	start = pack_offset(tasks[0]);
+	end = pack_offset(tasks[n - 1]) + tasks[n - 1]->size;
+
+	bundle = task_new(TASK_ARCHIVE);
+	if (!bundle) {
+		for (i = 0; i < n; i++)
+			task_destroy(tasks[i], "Out of memory");
+		return;
+	}
+	task_set_index(bundle, tasks[0]->index);
+	bundle->flags |= TASK_BUNDLE;
+	bundle->step = got_bundle;
+	bundle->data = tasks[0]->data;
+	bundle->size = end - start;
+
+	for (i = 0; i < n; i++)
+		tasks[i]->child_task = bundle;
+
+	log_task(SUB_FETCH, LOG_INFO, bundle, "batch",
+			"Fetching %d groups from '%s' together",
+			n, bundle->index->site);
+
+	uri = mirrors_get_best_url(bundle->index->site, task_pack(bundle));
+	if (snprintf(path, sizeof(path), "%s/%s/" TMP_PREFIX "pack-%ld",
+		     cache_dir, bundle->index->site, start) < sizeof(path) &&
+	    uri) {
+		snprintf(range, sizeof(range), "bytes=%ld-%ld",
+				start, end - 1);
+		wget(bundle, uri, path, 1, range);
+	}
+
+	if (uri)
+		free(uri);
+
+	if (bundle->child_pid == -1)
+		got_bundle(bundle, "Failed to fork child process");
+}
+
+/* The batch window has closed. Group the waiting tasks by pack, and fetch
+ * each run of nearby groups together.
+ */
+static void start_batches(void *data)
+{
+	Task *batch[BATCH_MAX];
+	Task *first, *task;
+	int i, start, n;
+
+	batch_timer = NULL;
+
+	while (1) {
+		for (first = all_tasks; first; first = first->next) {
+			if (first->flags & TASK_BATCHED)
+				break;
+		}
+		if (!first)
+			break;
+
+		n = 0;
+		for (task = first; task && n < BATCH_MAX; task = task->next) {
+			if ((task->flags & TASK_BATCHED) &&
+			    strcmp(task->index->site, first->index->site) == 0 &&
+			    strcmp(task_pack(task), task_pack(first)) == 0) {
+				task->flags &= ~TASK_BATCHED;
+				batch[n++] = task;
+			}
+		}
+
+		qsort(batch, n, sizeof(Task *), compare_pack_offsets);
+
+		start = 0;
+		for (i = 1; i <= n; i++) {
+			if (i == n || pack_offset(batch[i]) > pack_offset(
+				batch[i - 1]) + batch[i - 1]->size +
+				BATCH_MAX_GAP) {
+				fetch_batch(batch + start, i - start);
+				start = i;
+			}
+		}
+	}
+}
+
+/* 1 if 'group' is in the site's pack, and so may be fetched with others */
+static int batchable(Element *group, Index *index)
+{
+	return xml_get_attr(group, "pack_offset") &&
+	       xml_get_attr(index->doc, "pack");
+}
+
+/* Put 'task' in the current batch instead of fetching its archive now.
+ * task->str is set to 'path'.
+ */
+static void wait_for_batch(Task *task, const char *path)
+{
+	task_set_string(task, path);
+	if (!task->str)
+		return;
+
+	task->flags |= TASK_BATCHED;
+	if (!batch_timer)
+		batch_timer = timer_add(BATCH_WINDOW_MS, start_batches, NULL);
+}
+
 /* file is the cache-relative path of a file in the group.
  * Returns a full path for the new tmp file. The MD5sum is used
  * to make the name unique within the directory.
@@ -824,12 +2263,17 @@ static char *get_tmp_path_for_group(const char *file, Element *group)
 	return tgz;
 }
 
-/* 'file' is the path of a file within the archive */
-Task *fetch_archive(const char *file, Element *group, Index *index)
+/* 'file' is the path of a file within the archive.
+ * 'flags' are FETCH_* bits (see fetch.h).
+ */
+Task *fetch_archive(const char *file, Element *group, Index *index,
+		    int flags)
 {
 	Task *task = NULL;
+	Element *member;
 	char *uri = NULL;
 	char *tgz = NULL;
+	char *member_tmp = NULL;
 
 	assert(group->name[0] == 'g');
 
@@ -841,14 +2285,26 @@ Task *fetch_archive(const char *file, Element *group, Index *index)
 	if (!tgz)
 		goto out;
 
+	member = (flags & FETCH_WHOLE) ? NULL : seekable_member(file, group);
+	if (member) {
+		member_tmp = build_string("%s-%s", tgz,
+					  xml_get_attr(member, "offset"));
+		if (!member_tmp)
+			goto out;
+	}
+
 	if (verbose)
-		printf("Fetch archive as '%s'\n", tgz);
+		printf("Fetch archive as '%s'\n", member_tmp ? member_tmp : tgz);
 	
-	/* Check that we're not already downloading it */
+	/* Check that we're not already downloading it (or the whole group) */
 	for (task = all_tasks; task; task = task->next) {
 		if (task->type == TASK_ARCHIVE &&
-				strcmp(task->str, tgz) == 0) {
-			syslog(LOG_INFO, "Merging with task %d", task->n);
+		    (strcmp(task->str, tgz) == 0 ||
+		     (member_tmp && strcmp(task->str, member_tmp) == 0))) {
+			log_task(SUB_FETCH, LOG_INFO, task, "merge",
+					"Merging with task %d", task->n);
+			if (!(flags & FETCH_PREFETCH))
+				task->flags &= ~TASK_PREFETCH;
 			goto out;
 		}
 	}
@@ -857,19 +2313,31 @@ Task *fetch_archive(const char *file, Element *group, Index *index)
 	if (!task)
 		goto out;
 	task_set_index(task, index);
-
-	task->step = got_archive;
-	wget(task, uri, tgz, 1);
-	task->data = group;
-
-	/* Store the size, for progress indicators */
-	{
-		const char *size_s;
-		size_s = xml_get_attr(group, "size");
-		task->size = atol(size_s);
+	if (flags & FETCH_PREFETCH)
+		task->flags |= TASK_PREFETCH;
+
+	if (member) {
+		task->step = got_member;
+		task->data = member;
+		task->flags |= TASK_MEMBER;
+		wget_member(task, uri, member_tmp, member);
+		task->size = atol(xml_get_attr(member, "length"));
+	} else {
+		task->step = got_archive;
+		task->data = group;
+		if (early_wakeup && !(flags & FETCH_PREFETCH) &&
+		    group_has_file_digests(group))
+			wget_streaming(task, uri, tgz);
+		else if (batchable(group, index))
+			wait_for_batch(task, tgz);
+		else
+			wget(task, uri, tgz, 1, NULL);
+
+		/* Store the size, for progress indicators */
+		task->size = atol(xml_get_attr(group, "size"));
 	}
 
-	if (task->child_pid == -1) {
+	if (task->child_pid == -1 && !(task->flags & TASK_BATCHED)) {
 		task_destroy(task, "Failed to fork child process");
 		task = NULL;
 	}
@@ -879,6 +2347,8 @@ out:
 		free(uri);
 	if (tgz)
 		free(tgz);
+	if (member_tmp)
+		free(member_tmp);
 	return task;
 }
 
@@ -957,9 +2427,69 @@ static void test_valid_site_name(void)
 			       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa") == 1);
 }
 
+static void test_base64_decode(void)
+{
+	unsigned char out[16];
+
+	assert(base64_decode("", out) == 0);
+	assert(base64_decode("aGVsbG8K", out) == 6);
+	assert(memcmp(out, "hello\n", 6) == 0);
+	assert(base64_decode("aGk=", out) == 2);
+	assert(memcmp(out, "hi", 2) == 0);
+	assert(base64_decode("AP8=", out) == 2);
+	assert(out[0] == 0 && out[1] == 0xff);
+	assert(base64_decode("aG k=", out) == -1);
+	assert(base64_decode("aGk=x", out) == -1);
+}
+
+/* 'hex' is the 'name' digest of 'data' */
+static int digest_is(const char *name, const char *data, const char *hex)
+{
+	char out[DIGEST_MAX_SIZE * 2 + 1];
+	Digest *digest;
+
+	digest = digest_new(digest_find(name));
+	assert(digest);
+	digest_update(digest, data, strlen(data));
+	digest_final(digest, out);
+
+	return strcmp(out, hex) == 0;
+}
+
+static void test_digests(void)
+{
+	const char *two_blocks;
+	int accelerated;
+
+	assert(digest_is("MD5sum", "abc", "900150983cd24fb0d6963f7d28e17f72"));
+	assert(digest_is("blake2b", "abc",
+		"ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d1"
+		"7d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923"));
+	assert(digest_is("blake2b", "",
+		"786a02f742015903c6c6fd852552d272912f4740e15847618a86e217f71f5419"
+		"d25e1031afee585313896444934eb04b903a685b1448b755d56f701afe9be2ce"));
+
+	two_blocks = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		    "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+
+	/* Check the CPU's SHA extensions (if any) and the portable code */
+	for (accelerated = 0; accelerated < 2; accelerated++) {
+		digest_set_accelerated(accelerated);
+		assert(digest_is("sha256", "abc",
+		  "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+		assert(digest_is("sha256",
+		  "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+		  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"));
+		assert(digest_is("sha256", two_blocks,
+		  "6836cf13bac400e9105071cd6af47084dfacad4e5e302c94bfed24e013afb73e"));
+	}
+}
+
 void fetch_run_tests(void)
 {
 	test_valid_site_name();
+	test_base64_decode();
+	test_digests();
 }
 
 void fetch_init(void)
@@ -1,8 +1,15 @@
 Index *get_index(const char *path, Task **task, int force);
 void fetch_create_directory(const char *path, Element *node);
-Task *fetch_archive(const char *file, Element *group, Index *index);
+Task *fetch_archive(const char *file, Element *group, Index *index,
+		    int flags);
+int fetch_inline_file(const char *file, Element *item);
+int fetch_digest_matches(const char *path, Element *node);
 int build_ddds_for_site(Index *index, const char *site);
 void fetch_run_tests(void);
 void fetch_set_auto_reject(const char *request, uid_t uid);
 int fetch_check_auto_reject(const char *request, uid_t uid);
 void fetch_init(void);
+
+/* fetch_archive() flags */
+#define FETCH_WHOLE 1		/* Get the whole group, not just 'file' */
+#define FETCH_PREFETCH 2	/* Nobody is waiting for it yet (prefetch.c) */
@@ -0,0 +1,574 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Garbage collection. Every GC_PERIOD seconds we go through the cache,
+ * one site at a time. Sites whose index has changed since we last looked
+ * are checked against the disk, GC_SCAN_STEP directory entries per step
+ * (the directories being read are kept open between steps): anything
+ * which isn't in the site's current index (or doesn't match its entry
+ * there, eg an old version of a file) is an orphan, and is deleted, and
+ * the catalog is brought up to date. If max_cache_size is set
+ * (--max-cache) and the cache comes to more than that, the least recently
+ * used groups (according to the catalog, double-checked against the
+ * files' access times) are deleted until we're under the limit. They will
+ * simply be fetched again if they're needed.
+ * Finally, files in the store (see store.c) which are no longer used are
+ * deleted.
+ *
+ * Nothing is deleted from a directory while a task is working in it.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+
+#include "global.h"
+#include "support.h"
+#include "index.h"
+#include "fetch.h"
+#include "task.h"
+#include "zero-install.h"
+#include "xml.h"
+#include "timer.h"
+#include "catalog.h"
+#include "store.h"
+#include "gc.h"
+
+#define GC_PERIOD (10 * 60)	/* Seconds between passes */
+#define GC_STEP_MS 2000		/* Time between steps of a pass */
+#define GC_EVICT_STEP 16	/* Most groups evicted per step */
+#define GC_SCAN_STEP 64		/* Directory entries read per step */
+
+/* A group being counted by scan_some() */
+typedef struct _Seen Seen;
+
+/* A directory being scanned */
+typedef struct _ScanDir ScanDir;
+
+struct _Seen {
+	Element *group;
+	long bytes;
+	int files;
+	time_t used;		/* Most recent access time */
+};
+
+struct _ScanDir {
+	DIR *dir;
+	char *path;		/* Cache-relative, "/site/dir" */
+	Seen *seen;		/* Groups counted so far */
+	int n_seen;
+	ScanDir *parent;
+};
+
+static Timer *gc_timer = NULL;
+
+/* The site being scanned, if any. We hold a ref on its index, since the
+ * Seen records point into it.
+ */
+static Index *scan_index = NULL;
+static long scan_generation = 0;
+static ScanDir *scan_top = NULL;	/* Innermost directory being read */
+
+/* State of the current pass */
+static char **sites = NULL;
+static int n_sites = 0, next_site = 0;
+static long orphans_removed = 0, groups_evicted = 0;
+
+/* Set if an orphan couldn't be removed because its directory was busy */
+static int orphans_skipped = 0;
+
+/* 1 if some task is working in directory 'path' (cache-relative) */
+int gc_dir_busy(const char *path)
+{
+	Task *task;
+	int len = strlen(path);
+
+	for (task = all_tasks; task; task = task->next) {
+		const char *str = task->str;
+		const char *slash;
+
+		if (!str)
+			continue;
+		if (strncmp(str, cache_dir, cache_dir_len) == 0)
+			str += cache_dir_len;
+		slash = strrchr(str, '/');
+		if (slash && slash - str == len && strncmp(str, path, len) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* 1 if 'name' is ours rather than part of the site */
+static int special_name(const char *name)
+{
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+	       strcmp(name, "...") == 0 || strcmp(name, "....") == 0 ||
+	       strncmp(name, ".0inst-", 7) == 0;
+}
+
+/* 1 if 'info' is the cached copy of file 'item' */
+static int matches(Element *item, struct stat *info)
+{
+	return S_ISREG(info->st_mode) &&
+	       info->st_size == atol(xml_get_attr(item, "size")) &&
+	       info->st_mtime == atol(xml_get_attr(item, "mtime"));
+}
+
+static void remove_orphan(const char *path, int busy)
+{
+	if (busy) {
+		orphans_skipped = 1;
+		return;
+	}
+
+	if (verbose)
+		error("GC: removing orphan '%s'", path);
+	if (remove_tree(path))
+		orphans_removed++;
+}
+
+static int n_files(Element *group)
+{
+	Element *item;
+	int n = 0;
+
+	for (item = group->lastChild; item; item = item->previousSibling) {
+		if (item->name[0] != 'a')
+			n++;
+	}
+
+	return n;
+}
+
+/* Count the cached copy of 'item' in 'seen'. 0 on OOM. */
+static int count_file(Seen **seen, int *n_seen, Element *item,
+		      struct stat *info)
+{
+	Element *group = item->parentNode;
+	Seen *s;
+	int i;
+
+	for (i = 0; i < *n_seen; i++) {
+		if ((*seen)[i].group == group)
+			break;
+	}
+
+	if (i == *n_seen) {
+		s = my_realloc(*seen, (*n_seen + 1) * sizeof(Seen));
+		if (!s)
+			return 0;
+		*seen = s;
+		s = &s[(*n_seen)++];
+		s->group = group;
+		s->bytes = 0;
+		s->files = 0;
+		s->used = 0;
+	} else
+		s = &(*seen)[i];
+
+	s->bytes += info->st_size;
+	s->files++;
+	if (info->st_atime > s->used)
+		s->used = info->st_atime;
+
+	return 1;
+}
+
+/* Start reading directory 'path' (cache-relative, "/site/dir") */
+static void scan_push(const char *path)
+{
+	ScanDir *d;
+	char *dir_path;
+	DIR *dir;
+
+	dir_path = build_string("%s%s", cache_dir, path);
+	if (!dir_path)
+		return;
+	dir = opendir(dir_path);
+	free(dir_path);
+	if (!dir)
+		return;
+
+	d = my_malloc(sizeof(ScanDir));
+	if (d)
+		d->path = my_strdup(path);
+	if (!d || !d->path) {
+		if (d)
+			free(d);
+		closedir(dir);
+		return;
+	}
+
+	d->dir = dir;
+	d->seen = NULL;
+	d->n_seen = 0;
+	d->parent = scan_top;
+	scan_top = d;
+}
+
+/* Finish with the innermost directory. If 'record', put the groups found
+ * in it into the catalog.
+ */
+static void scan_pop(int record)
+{
+	ScanDir *d = scan_top;
+	int i;
+
+	scan_top = d->parent;
+	closedir(d->dir);
+
+	for (i = 0; record && i < d->n_seen; i++) {
+		Seen *s = &d->seen[i];
+
+		catalog_group_cached(d->path, s->group, s->bytes,
+				     s->files == n_files(s->group), s->used);
+	}
+
+	if (d->seen)
+		free(d->seen);
+	free(d->path);
+	free(d);
+}
+
+/* Stop scanning. If 'finished', the whole site has been checked. */
+static void scan_stop(int finished)
+{
+	while (scan_top)
+		scan_pop(0);
+
+	/* If anything was skipped, try again next time */
+	if (finished && !orphans_skipped)
+		catalog_end_scan(scan_index->site);
+
+	index_free(scan_index);
+	scan_index = NULL;
+}
+
+/* Start checking 'site' against the disk, if its index has changed since
+ * we last did.
+ */
+static void scan_start(const char *site)
+{
+	char *path;
+	long generation;
+
+	generation = catalog_generation(site);
+	if (!generation || !catalog_site_needs_scan(site, generation))
+		return;
+
+	path = build_string("/%s", site);
+	if (!path)
+		return;
+
+	scan_index = get_index(path, NULL, 0);
+	if (scan_index) {
+		orphans_skipped = 0;
+		scan_generation = generation;
+		catalog_begin_scan(site, generation);
+		scan_push(path);
+	}
+
+	free(path);
+}
+
+/* Check up to 'max' more entries of the site being scanned, removing
+ * orphans and recording each directory's groups in the catalog once it
+ * has been read. 1 if there is more to do.
+ */
+static int scan_some(int max)
+{
+	if (!scan_index)
+		return 0;
+
+	/* If a new index has arrived, its files would look like orphans */
+	if (catalog_generation(scan_index->site) != scan_generation) {
+		scan_stop(0);
+		return 0;
+	}
+
+	while (scan_top && max-- > 0) {
+		ScanDir *d = scan_top;
+		struct dirent *ent;
+		struct stat info;
+		Element *item;
+		char *child, *full;
+
+		ent = readdir(d->dir);
+		if (!ent) {
+			scan_pop(1);
+			continue;
+		}
+
+		if (special_name(ent->d_name))
+			continue;
+
+		child = build_string("%s/%s", d->path, ent->d_name);
+		full = child ? build_string("%s%s", cache_dir, child) : NULL;
+		if (!full || lstat(full, &info)) {
+			if (child)
+				free(child);
+			if (full)
+				free(full);
+			continue;
+		}
+
+		item = index_lookup(scan_index,
+				    child + strlen(scan_index->site) + 1);
+
+		if (!item) {
+			remove_orphan(full, gc_dir_busy(d->path));
+		} else if (item->name[0] == 'd') {
+			if (S_ISDIR(info.st_mode))
+				scan_push(child);
+			else
+				remove_orphan(full, gc_dir_busy(d->path));
+		} else if (item->name[0] == 'f' || item->name[0] == 'e') {
+			if (!matches(item, &info))
+				remove_orphan(full, gc_dir_busy(d->path));
+			else if (!count_file(&d->seen, &d->n_seen, item, &info))
+				error("GC: Out of memory");
+		}
+		/* else a symlink; the kernel handles those itself */
+
+		free(child);
+		free(full);
+	}
+
+	if (scan_top)
+		return 1;
+
+	scan_stop(1);
+	return 0;
+}
+
+/* Start a new pass. 0 on error. */
+static int list_sites(void)
+{
+	DIR *dir;
+	struct dirent *ent;
+
+	dir = opendir(cache_dir);
+	if (!dir) {
+		error("opendir(%s): %m", cache_dir);
+		return 0;
+	}
+
+	while ((ent = readdir(dir))) {
+		char **new;
+
+		if (ent->d_name[0] == '.')
+			continue;
+
+		new = my_realloc(sites, (n_sites + 1) * sizeof(char *));
+		if (!new)
+			break;
+		sites = new;
+		sites[n_sites] = my_strdup(ent->d_name);
+		if (!sites[n_sites])
+			break;
+		n_sites++;
+	}
+	closedir(dir);
+
+	return 1;
+}
+
+static void end_pass(void)
+{
+	long entries, bytes, saved;
+	int i;
+
+	if (orphans_removed || groups_evicted)
+		syslog(LOG_INFO, "GC: removed %ld orphans and %ld groups; "
+				"%ld bytes in cache", orphans_removed,
+				groups_evicted, catalog_total_bytes());
+
+	/* Drop stored files which are no longer used */
+	store_scan(1, &entries, &bytes, &saved);
+	if (entries && verbose)
+		syslog(LOG_DEBUG, "GC: %ld files stored, %ld bytes saved",
+				entries, saved);
+
+	for (i = 0; i < n_sites; i++)
+		free(sites[i]);
+	if (sites)
+		free(sites);
+	sites = NULL;
+	n_sites = next_site = 0;
+
+	orphans_removed = 0;
+	groups_evicted = 0;
+}
+
+/* Delete the cached files of the group with catalog record 'g'.
+ * 1 if we did, or if we found it had been used recently after all.
+ */
+static int evict(CatalogGroup *g)
+{
+	char path[MAX_PATH_LEN];
+	Index *index;
+	Element *group, *item;
+	time_t used = 0;
+	int done = 0;
+
+	if (snprintf(path, sizeof(path), "/%s",
+		     catalog_site_name(g)) >= sizeof(path))
+		return 0;
+
+	index = get_index(path, NULL, 0);
+	if (!index)
+		return 0;
+
+	group = catalog_find_group(g, index_get_root(index), path);
+	if (!group) {
+		/* Not in the index any more. It will be tidied up when the
+		 * site is scanned.
+		 */
+		goto out;
+	}
+
+	if (gc_dir_busy(path))
+		goto out;
+
+	/* The kernel doesn't tell us when cached files are used, but the
+	 * access times do. Has it been used since we last looked?
+	 */
+	for (item = group->lastChild; item; item = item->previousSibling) {
+		char full[MAX_PATH_LEN];
+		struct stat info;
+
+		if (item->name[0] == 'a')
+			continue;
+		if (snprintf(full, sizeof(full), "%s%s/%s", cache_dir, path,
+			     xml_get_attr(item, "name")) < sizeof(full) &&
+		    lstat(full, &info) == 0 && info.st_atime > used)
+			used = info.st_atime;
+	}
+	if (used > g->used) {
+		catalog_touch(g, used);
+		done = 1;
+		goto out;
+	}
+
+	if (verbose)
+		error("GC: evicting group from '%s' (%ld bytes)",
+				path, (long) g->bytes);
+
+	for (item = group->lastChild; item; item = item->previousSibling) {
+		char full[MAX_PATH_LEN];
+
+		if (item->name[0] == 'a')
+			continue;
+		if (snprintf(full, sizeof(full), "%s%s/%s", cache_dir, path,
+			     xml_get_attr(item, "name")) >= sizeof(full))
+			continue;
+		if (unlink(full) && errno != ENOENT)
+			error("unlink '%s': %m", full);
+	}
+
+	catalog_group_removed(path, group);
+	groups_evicted++;
+	done = 1;
+out:
+	index_free(index);
+	return done;
+}
+
+/* Evict up to GC_EVICT_STEP groups if we're over budget. 1 if there may
+ * be more to do.
+ */
+static int evict_some(void)
+{
+	CatalogGroup **lru;
+	int i, n, done = 0;
+
+	if (!max_cache_size || catalog_total_bytes() <= max_cache_size)
+		return 0;
+
+	lru = catalog_lru(GC_EVICT_STEP * 4, &n);
+	if (!lru)
+		return 0;
+
+	for (i = 0; i < n && done < GC_EVICT_STEP &&
+		    catalog_total_bytes() > max_cache_size; i++)
+		done += evict(lru[i]);
+
+	free(lru);
+
+	return done > 0 && catalog_total_bytes() > max_cache_size;
+}
+
+static void gc_step(void *data)
+{
+	int delay = GC_STEP_MS;
+	Task *task;
+
+	gc_timer = NULL;
+
+	/* Keep out of the way of downloads */
+	for (task = all_tasks; task; task = task->next) {
+		if (task->child_pid != -1)
+			goto out;
+	}
+
+	if (!sites && !list_sites()) {
+		delay = GC_PERIOD * 1000;
+		goto out;
+	}
+
+	if (scan_index || next_site < n_sites) {
+		if (!scan_index)
+			scan_start(sites[next_site++]);
+		scan_some(GC_SCAN_STEP);
+		goto out;
+	}
+
+	if (evict_some())
+		goto out;
+
+	end_pass();
+	delay = GC_PERIOD * 1000;
+out:
+	gc_timer = timer_add(delay, gc_step, NULL);
+}
+
+/* Start collecting garbage in the background */
+void gc_init(void)
+{
+	if (!gc_timer)
+		gc_timer = timer_add(GC_STEP_MS, gc_step, NULL);
+}
+
+/* Check every site against the disk now, filling in the catalog
+ * (--rebuild-catalog).
+ */
+void gc_rebuild(void)
+{
+	if (!list_sites())
+		return;
+
+	while (next_site < n_sites) {
+		scan_start(sites[next_site++]);
+		while (scan_some(GC_SCAN_STEP))
+			;
+	}
+
+	syslog(LOG_INFO, "Cache catalog rebuilt; %ld bytes in cache",
+			catalog_total_bytes());
+	end_pass();
+}
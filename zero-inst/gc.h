@@ -0,0 +1,3 @@
+void gc_init(void);
+int gc_dir_busy(const char *path);
+void gc_rebuild(void);
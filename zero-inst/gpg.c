@@ -4,10 +4,14 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "global.h"
 #include "support.h"
 #include "gpg.h"
+#include "metrics.h"
+#include "task.h"
+#include "spans.h"
 
 /* Implements the GPG signature checking. Someone who understands GPG
  * fully should really check this stuff over...
@@ -68,18 +72,9 @@ static int ok_for_site(const char *name, const char *site)
 	return *email == '>';	/* XXX: space or newline next? */
 }
 
-/* Check that ./<leafname> is signed by ./index.xml.sig, whose public key
- * is known to us. <leafname> must not contain funny characters.
- * Merge keyring.pub into our database of known keys, and check there is
- * a trust path to it.
- * If we have no keys yet, trust everything in keyring.pub!
- * NULL if <leafname> looks OK, otherwise returns an error message.
- *
- * 'is_new' is just used for reporting messages. It is true if we've just
- * downloaded the archive for the index (will match, but may be invalid),
- * otherwise we're just checking that it's not out-of-date.
- */
-const char *gpg_trusted(const char *site, const char *leafname, int is_new)
+/* Does the work for gpg_trusted() */
+static const char *check_trusted(const char *site, const char *dir,
+				 const char *leafname, int is_new)
 {
 	/* The key used to sign the last accepted version of the index.
 	 * We ultimately trust this key to sign others. The key used to sign
@@ -89,17 +84,23 @@ const char *gpg_trusted(const char *site, const char *leafname, int is_new)
 	 */
 	char *command;
 	FILE *out;
-	int trusted = 0;
+	int trusted = 0, failed;
 	char current_key[17];
 	int have_trusted_key = 0;
 
 	/* TODO: escape it somehow */
 	assert(strchr(site, '\'') == NULL);
 	assert(strchr(site, '\\') == NULL);
-	
-	if (system("gpg " GPG_OPTIONS " --import keyring.pub")) {
+	assert(strchr(dir, '\'') == NULL);
+
+	command = build_string("gpg " GPG_OPTIONS " --import '%s/keyring.pub'",
+			       dir);
+	if (!command)
+		return "Out of memory";
+	failed = system(command);
+	free(command);
+	if (failed)
 		return "Failed to merge new keys! Is GPG installed?";
-	}
 
 	/* Try to get the key we used last time */
 	{
@@ -128,15 +129,15 @@ const char *gpg_trusted(const char *site, const char *leafname, int is_new)
 			command = build_string("gpg " GPG_OPTIONS
 				" --status-fd 1"
 				" --trusted-key %s"
-				" --verify index.xml.sig '%s'",
-				trusted_key, leafname);
+				" --verify '%s/index.xml.sig' '%s'",
+				trusted_key, dir, leafname);
 
 			free(trusted_key);
 		} else {
 			command = build_string("gpg " GPG_OPTIONS
 				" --status-fd 1"
-				" --verify index.xml.sig '%s'",
-				leafname);
+				" --verify '%s/index.xml.sig' '%s'",
+				dir, leafname);
 		}
 	}
 
@@ -213,3 +214,28 @@ const char *gpg_trusted(const char *site, const char *leafname, int is_new)
 	return NULL;
 }
 
+/* Check that ./<leafname> is signed by <dir>/index.xml.sig, whose public
+ * key is known to us. <dir> and <leafname> must not contain funny
+ * characters. Merge <dir>/keyring.pub into our database of known keys, and
+ * check there is a trust path to it.
+ * If we have no keys yet, trust everything in keyring.pub!
+ * NULL if <leafname> looks OK, otherwise returns an error message.
+ *
+ * 'is_new' is just used for reporting messages. It is true if we've just
+ * downloaded the archive for the index (will match, but may be invalid),
+ * otherwise we're just checking that it's not out-of-date.
+ */
+const char *gpg_trusted(const char *site, const char *dir,
+			const char *leafname, int is_new)
+{
+	struct timeval start;
+	const char *err;
+
+	gettimeofday(&start, NULL);
+	err = check_trusted(site, dir, leafname, is_new);
+	metrics_observe("zeroinstall_gpg_seconds", NULL,
+			metrics_seconds_since(&start));
+	span_record("gpg", NULL, site, &start, -1);
+
+	return err;
+}
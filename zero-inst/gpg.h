@@ -1 +1,2 @@
-const char *gpg_trusted(const char *site, const char *leafname, int is_new);
+const char *gpg_trusted(const char *site, const char *dir,
+			const char *leafname, int is_new);
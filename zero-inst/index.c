@@ -7,12 +7,17 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "global.h"
 #include "index.h"
 #include "support.h"
 #include "zero-install.h"
 #include "xml.h"
+#include "digest.h"
+#include "metrics.h"
+#include "task.h"
+#include "spans.h"
 
 static int dir_valid(Element *dir);
 
@@ -53,6 +58,79 @@ static int item_valid(Element *node)
 	return 0;
 }
 
+/* 1 if 'hex' is 'len' lower-case hex digits */
+static int hex_valid(const char *hex, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if ((hex[i] < '0' || hex[i] > '9') &&
+		    (hex[i] < 'a' || hex[i] > 'f'))
+			return 0;
+	}
+
+	return hex[len] == '\0';
+}
+
+/* 1 if each digest given for 'node' (MD5sum, sha256, etc) looks valid */
+static int digests_valid(Element *node)
+{
+	const DigestAlgorithm *algo;
+
+	for (algo = digest_algorithms; algo->name; algo++) {
+		const char *value;
+
+		value = xml_get_attr(node, algo->name);
+		if (value && !hex_valid(value, algo->size * 2)) {
+			error("Bad %s attribute for <%s>", algo->name,
+					node->name);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* 1 if 'str' is a non-empty string of decimal digits */
+static int number_valid(const char *str)
+{
+	if (!*str)
+		return 0;
+	for (; *str; str++) {
+		if (*str < '0' || *str > '9')
+			return 0;
+	}
+	return 1;
+}
+
+/* Items in seekable archives give the 'offset' and 'length' of their own
+ * gzip member. These are only any use with the item's own MD5sum.
+ * 1 if OK (or not given).
+ */
+static int member_valid(Element *item)
+{
+	const char *offset, *length;
+
+	offset = xml_get_attr(item, "offset");
+	length = xml_get_attr(item, "length");
+
+	if (!offset && !length)
+		return 1;
+
+	if (!offset || !length || !xml_get_attr(item, "MD5sum")) {
+		error("Need offset, length and MD5sum for archive member");
+		return 0;
+	}
+
+	if (!number_valid(offset) || !number_valid(length) ||
+	    atol(length) < 1) {
+		error("Bad offset or length attribute for item");
+		return 0;
+	}
+
+	return 1;
+}
+
 static int count_group(Element *group)
 {
 	int n_items = 0;
@@ -66,11 +144,31 @@ static int count_group(Element *group)
 		return -1;
 	}
 
+	if (!digests_valid(group))
+		return -1;
+
+	if (xml_get_attr(group, "pack_offset") &&
+	    !number_valid(xml_get_attr(group, "pack_offset"))) {
+		error("Bad pack_offset attribute for <group>");
+		return -1;
+	}
+
 	for (node = group->lastChild; node; node = node->previousSibling) {
 		if (strcmp(node->name, "file") == 0 ||
 		    strcmp(node->name, "exec") == 0) {
+			const char *md5;
+
 			if (!item_valid(node))
 				return -1;
+			md5 = xml_get_attr(node, "MD5sum");
+			if (!digests_valid(node))
+				return -1;
+			if (!member_valid(node))
+				return -1;
+			if (xml_get_attr(node, "data") && !md5) {
+				error("Inline data needs an MD5sum");
+				return -1;
+			}
 			n_items++;
 		} else if (strcmp(node->name, "archive") == 0) {
 			if (!xml_get_attr(node, "href")) {
@@ -307,9 +405,12 @@ static int index_merge_overrides(Index *index)
  */
 Index *parse_index(const char *pathname, int validate, const char *site)
 {
+	struct timeval start;
 	Element *doc;
 	Index *index;
 
+	gettimeofday(&start, NULL);
+
 	validate = 1;	/* Always validate. Files may be from old version. */
 
 	assert(site);
@@ -344,6 +445,10 @@ Index *parse_index(const char *pathname, int validate, const char *site)
 		return NULL;
 	}
 
+	metrics_observe("zeroinstall_index_parse_seconds", NULL,
+			metrics_seconds_since(&start));
+	span_record("parse_index", NULL, site, &start, -1);
+
 	return index;
 }
 
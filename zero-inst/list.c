@@ -6,11 +6,26 @@
 #include "task.h"
 #include "list.h"
 
+struct _ListLink {
+	DBusConnection *connection;
+	ListLink *prev, *next;
+	ListLink *uid_prev, *uid_next;	/* In head->by_uid (if has_uid) */
+	unsigned long uid;
+	int has_uid;
+};
+
+#define UID_BUCKET(head, uid) (&(head)->by_uid[(uid) % LIST_UID_BUCKETS])
+
 void list_init(ListHead *head)
 {
+	int i;
+
 	assert(head->next == NULL);
 	assert(head->slot == -1);
 
+	for (i = 0; i < LIST_UID_BUCKETS; i++)
+		head->by_uid[i] = NULL;
+
 	if (!dbus_connection_allocate_data_slot(&head->slot)) {
 		error("dbus_connection_allocate_data_slot(): OOM");
 		exit(EXIT_FAILURE);
@@ -23,92 +38,132 @@ void list_init(ListHead *head)
 void list_prepend(ListHead *head, DBusConnection *connection)
 {
 	dbus_int32_t slot = head->slot;
+	ListLink *link;
 
 	assert(slot != -1);
 	assert(dbus_connection_get_data(connection, slot) == NULL);
-	
+
+	link = my_malloc(sizeof(ListLink));
+	if (!link)
+		abort();
+	if (!dbus_connection_set_data(connection, slot, link, NULL))
+		abort();
+
+	link->connection = connection;
+	link->prev = NULL;
+	link->next = head->next;
 	if (head->next)
-	{
-		if (!dbus_connection_set_data(connection, slot,
-						head->next, NULL))
-			abort();
+		head->next->prev = link;
+	head->next = link;
+
+	link->uid_prev = NULL;
+	link->uid_next = NULL;
+	link->has_uid = dbus_connection_get_unix_user(connection, &link->uid);
+	if (link->has_uid) {
+		ListLink **bucket = UID_BUCKET(head, link->uid);
+
+		link->uid_next = *bucket;
+		if (*bucket)
+			(*bucket)->uid_prev = link;
+		*bucket = link;
 	}
 
-	head->next = connection;
 	dbus_connection_ref(connection);
 }
 
-void list_remove(ListHead *head, DBusConnection *connection)
+/* Take 'link' out of the chains, and out of its connection. Doesn't
+ * free it or unref the connection.
+ */
+static void unlink_link(ListHead *head, ListLink *link)
 {
-	DBusConnection *prev, *next;
-	dbus_int32_t slot = head->slot;
-
-	assert(slot != -1);
-	assert(head->next != NULL);
-	assert(connection != NULL);
-
-	next = dbus_connection_get_data(connection, slot);
-
-	if (head->next == connection) {
-		/* First link */
-		head->next = next;
-		goto out;
+	if (link->prev)
+		link->prev->next = link->next;
+	else
+		head->next = link->next;
+	if (link->next)
+		link->next->prev = link->prev;
+
+	if (link->has_uid) {
+		if (link->uid_prev)
+			link->uid_prev->uid_next = link->uid_next;
+		else
+			*UID_BUCKET(head, link->uid) = link->uid_next;
+		if (link->uid_next)
+			link->uid_next->uid_prev = link->uid_prev;
 	}
 
-	prev = head->next;
+	dbus_connection_set_data(link->connection, head->slot, NULL, NULL);
+}
 
-	while (prev) {
-		DBusConnection *this;
+void list_remove(ListHead *head, DBusConnection *connection)
+{
+	ListLink *link;
 
-		this = dbus_connection_get_data(prev, slot);
-		if (this == connection) {
-			if (!dbus_connection_set_data(prev, slot, next, NULL))
-				abort();
-			goto out;
-		}
-	}
+	assert(head->slot != -1);
+	assert(connection != NULL);
+
+	link = dbus_connection_get_data(connection, head->slot);
+	assert(link != NULL);
 
-	assert(0);
-out:
-	dbus_connection_set_data(connection, slot, NULL, NULL);
+	unlink_link(head, link);
+	free(link);
 	dbus_connection_unref(connection);
-	return;
 }
 
 /* Call 'callback(connection, task)' for each connection in the list.
- * If empty is 1, the list will be empty at the end.
- * If task is given, the UID must match.
+ * If empty is 1, the list will be empty at the end (connections may be
+ * added again by the callback).
+ * If task is given, the UID must match (only that UID's connections are
+ * visited).
+ * The callback may remove the connection it is given.
  */
 void list_foreach(ListHead *head,
 		void (*callback)(DBusConnection *connection, Task *task),
 		int empty, Task *task)
 {
-	dbus_int32_t slot = head->slot;
-	DBusConnection *next = head->next;
+	ListLink *link, *next;
 
-	assert(slot != -1);
+	assert(head->slot != -1);
 	assert(empty == 0 || empty == 1);
 
-	if (empty)
-		head->next = NULL;
+	if (empty) {
+		ListLink *links = head->next;
+		int i;
 
-	while (next) {
-		DBusConnection *this = next;
+		/* Detach everything first, so the callback can add
+		 * connections back.
+		 */
+		head->next = NULL;
+		for (i = 0; i < LIST_UID_BUCKETS; i++)
+			head->by_uid[i] = NULL;
+		for (link = links; link; link = link->next)
+			dbus_connection_set_data(link->connection, head->slot,
+						 NULL, NULL);
 
-		if (task) {
-			unsigned long uid;
+		for (link = links; link; link = next) {
+			DBusConnection *this = link->connection;
 
-			if (dbus_connection_get_unix_user(this, &uid) &&
-			    uid == task->uid)
+			next = link->next;
+			if (!task || (link->has_uid && link->uid == task->uid))
 				callback(this, task);
-		} else {
-			callback(this, NULL);
+			dbus_connection_unref(this);
+			free(link);
 		}
+		return;
+	}
 
-		next = dbus_connection_get_data(this, slot);
+	if (!task) {
+		for (link = head->next; link; link = next) {
+			next = link->next;
+			callback(link->connection, NULL);
+		}
+		return;
+	}
 
-		if (empty)
-			dbus_connection_unref(this);
+	for (link = *UID_BUCKET(head, task->uid); link; link = next) {
+		next = link->uid_next;
+		if (link->uid == task->uid)
+			callback(link->connection, task);
 	}
 }
 
@@ -125,21 +180,8 @@ void list_destroy(ListHead *head)
 
 int list_contains(ListHead *head, DBusConnection *connection)
 {
-	DBusConnection *next;
-	dbus_int32_t slot = head->slot;
-
-	assert(slot != -1);
+	assert(head->slot != -1);
 	assert(connection);
 
-#if 0
-	if (dbus_connection_get_data(connection, slot) != NULL)
-		return 1;
-#endif
-
-	for (next = head->next; next;
-			next = dbus_connection_get_data(next, slot)) {
-		if (next == connection)
-			return 1;
-	}
-	return 0;
+	return dbus_connection_get_data(connection, head->slot) != NULL;
 }
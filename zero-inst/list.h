@@ -1,8 +1,16 @@
 typedef struct _ListHead ListHead;
+typedef struct _ListLink ListLink;
 
+#define LIST_UID_BUCKETS 64
+
+/* A list of connections. Each connection's link is kept in its data slot,
+ * so finding, adding and removing a connection take constant time.
+ * Connections are also chained by UID, for list_foreach() with a task.
+ */
 struct _ListHead {
-	DBusConnection *next;
+	ListLink *next;		/* First link, or NULL if empty */
 	dbus_int32_t slot;
+	ListLink *by_uid[LIST_UID_BUCKETS];
 };
 
 #define LIST_INIT {NULL, -1}
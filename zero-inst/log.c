@@ -0,0 +1,442 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Logging. syslog() can block while syslogd is busy, which holds up every
+ * request while we're logging lots (eg, a storm of misses). Instead,
+ * messages are formatted into an in-memory queue, which the main loop
+ * writes down a pipe to a separate writer process whenever the pipe has
+ * room. The writer passes them on to syslog. If the queue fills up, new
+ * messages are dropped (and counted) rather than waiting.
+ *
+ * Until log_start() (and in child processes, and if the writer dies)
+ * messages go straight to syslog instead.
+ *
+ * Each message belongs to a subsystem, which has its own level (changed
+ * with the SetLogLevel control method); less important messages are
+ * thrown away before being formatted. Messages about a task get key=value
+ * fields for the task's number, site, user and phase. A message format
+ * used more than RATE_BURST times in RATE_WINDOW seconds is suppressed
+ * for the rest of that time, and the number suppressed is logged after.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "global.h"
+#include "support.h"
+#include "task.h"
+#include "index.h"
+#include "log.h"
+
+#define QUEUE_SIZE 65536	/* Bytes of messages waiting for the writer */
+#define LINE_MAX_LEN 1024	/* Longer messages are cut short */
+#define RATE_SLOTS 64
+#define RATE_WINDOW 10		/* Seconds */
+#define RATE_BURST 20		/* Messages per format per window */
+#define RESTART_DELAY 60	/* Seconds before restarting a dead writer */
+
+static const char *subsystem_names[] = {
+	"main", "fetch", "task", "control", "cache", NULL
+};
+
+static int levels[SUB_COUNT] = {
+	LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO, LOG_INFO
+};
+
+/* Rate limiting, by format string */
+typedef struct {
+	const char *format;
+	time_t window;		/* When the current window began */
+	int count;		/* Messages in this window */
+	int suppressed;
+} Rate;
+
+static Rate rates[RATE_SLOTS];
+
+/* Records are "<priority> <message>\n" */
+static char queue[QUEUE_SIZE];
+static int queue_start = 0, queue_len = 0;
+static long dropped = 0;
+
+static int log_fd = -1;		/* Pipe to the writer, or -1 */
+static pid_t writer_pid = -1;
+static pid_t log_pid = -1;	/* The process which may use the queue */
+static time_t writer_started = 0;
+
+static void sigpipe(int signum)
+{
+	/* Just make write() fail with EPIPE. A handler (unlike SIG_IGN)
+	 * isn't inherited by the programs we run.
+	 */
+}
+
+/* Runs in the writer process */
+static void writer_main(int fd)
+{
+	char line[LINE_MAX_LEN + 32];
+	FILE *in;
+	int i;
+
+	signal(SIGINT, SIG_IGN);	/* Finish the queue on shutdown */
+
+	/* Don't hold lazyfs's connection (or anything else) open. We use
+	 * select(), so nothing is above FD_SETSIZE.
+	 */
+	closelog();
+	for (i = 0; i < FD_SETSIZE; i++) {
+		if (i != fd)
+			close(i);
+	}
+	openlog("zero-install", 0, LOG_DAEMON);
+
+	in = fdopen(fd, "r");
+	if (!in)
+		_exit(1);
+
+	while (fgets(line, sizeof(line), in)) {
+		char *msg;
+		int priority;
+
+		priority = strtol(line, &msg, 10);
+		if (*msg == ' ')
+			msg++;
+		msg[strcspn(msg, "\n")] = '\0';
+		syslog(priority, "%s", msg);
+	}
+
+	_exit(0);
+}
+
+/* Pass anything still queued straight to syslog */
+static void drain_to_syslog(void)
+{
+	while (queue_len) {
+		char line[LINE_MAX_LEN + 32];
+		char *msg;
+		int len = 0, priority;
+
+		while (len < queue_len && len < sizeof(line) - 1) {
+			line[len] = queue[(queue_start + len) % QUEUE_SIZE];
+			if (line[len++] == '\n')
+				break;
+		}
+		line[len] = '\0';
+		queue_start = (queue_start + len) % QUEUE_SIZE;
+		queue_len -= len;
+
+		priority = strtol(line, &msg, 10);
+		if (*msg == ' ')
+			msg++;
+		msg[strcspn(msg, "\n")] = '\0';
+		syslog(priority, "%s", msg);
+	}
+	queue_start = 0;
+}
+
+/* The writer has gone. Log directly instead. */
+static void lost_writer(void)
+{
+	if (log_fd != -1) {
+		close(log_fd);
+		log_fd = -1;
+	}
+	drain_to_syslog();
+	syslog(LOG_ERR, "Log writer has gone; logging directly");
+}
+
+/* Write as much of the queue to the writer as it will take now */
+static void log_flush(void)
+{
+	while (queue_len && log_fd != -1) {
+		int chunk, n;
+
+		chunk = QUEUE_SIZE - queue_start;
+		if (chunk > queue_len)
+			chunk = queue_len;
+
+		n = write(log_fd, queue + queue_start, chunk);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			lost_writer();
+			return;
+		}
+
+		queue_start = (queue_start + n) % QUEUE_SIZE;
+		queue_len -= n;
+	}
+
+	if (!queue_len)
+		queue_start = 0;
+}
+
+/* Add a record to the queue. 0 if there's no room. */
+static int enqueue(int priority, const char *msg)
+{
+	char record[LINE_MAX_LEN + 32];
+	int len, i;
+
+	len = snprintf(record, sizeof(record), "%d %s", priority, msg);
+	if (len >= sizeof(record) - 1)
+		len = sizeof(record) - 2;
+	for (i = 0; i < len; i++) {
+		if (record[i] == '\n')
+			record[i] = ' ';
+	}
+	record[len++] = '\n';
+
+	if (queue_len + len > QUEUE_SIZE)
+		return 0;
+
+	for (i = 0; i < len; i++)
+		queue[(queue_start + queue_len + i) % QUEUE_SIZE] = record[i];
+	queue_len += len;
+
+	return 1;
+}
+
+/* Send out a formatted message */
+static void emit(int priority, const char *msg)
+{
+	if (log_fd == -1 || getpid() != log_pid) {
+		syslog(priority, "%s", msg);
+		return;
+	}
+
+	if (dropped) {
+		char note[64];
+
+		snprintf(note, sizeof(note), "(%ld log messages dropped)",
+				dropped);
+		if (!enqueue(LOG_WARNING, note)) {
+			dropped++;
+			return;
+		}
+		dropped = 0;
+	}
+
+	if (!enqueue(priority, msg))
+		dropped++;
+}
+
+/* 1 if a message with this format may be logged now */
+static int rate_ok(const char *format)
+{
+	Rate *rate = &rates[((unsigned long) format >> 3) % RATE_SLOTS];
+	time_t now = time(NULL);
+	char note[LINE_MAX_LEN];
+
+	if (rate->format != format || now >= rate->window + RATE_WINDOW) {
+		if (rate->suppressed) {
+			snprintf(note, sizeof(note),
+				"(%d more messages like \"%s\" suppressed)",
+				rate->suppressed, rate->format);
+			emit(LOG_WARNING, note);
+		}
+		rate->format = format;
+		rate->window = now;
+		rate->count = 0;
+		rate->suppressed = 0;
+	}
+
+	if (++rate->count <= RATE_BURST)
+		return 1;
+
+	rate->suppressed++;
+	return 0;
+}
+
+/* Format and send a message, adding 'task' and 'phase' as fields if
+ * given.
+ */
+static void log_va(LogSubsystem subsystem, int priority, Task *task,
+		   const char *phase, const char *format, va_list ap)
+{
+	char msg[LINE_MAX_LEN];
+	int old_errno = errno;
+	int len;
+
+	if (priority > levels[subsystem] || !rate_ok(format))
+		return;
+
+	/* rate_ok() may have logged a summary, which can change errno
+	 * before %m gets expanded.
+	 */
+	errno = old_errno;
+	len = vsnprintf(msg, sizeof(msg), format, ap);
+	if (len >= sizeof(msg))
+		len = sizeof(msg) - 1;
+
+	if (task) {
+		len += snprintf(msg + len, sizeof(msg) - len, " [task=%d",
+				task->n);
+		if (len < sizeof(msg) && task->index)
+			len += snprintf(msg + len, sizeof(msg) - len,
+					" site=%s", task->index->site);
+		if (len < sizeof(msg) &&
+		    (task->type == TASK_KERNEL || task->type == TASK_CLIENT))
+			len += snprintf(msg + len, sizeof(msg) - len,
+					" uid=%ld", (long) task->uid);
+		if (len < sizeof(msg) && phase)
+			len += snprintf(msg + len, sizeof(msg) - len,
+					" phase=%s", phase);
+		if (len < sizeof(msg))
+			snprintf(msg + len, sizeof(msg) - len, "]");
+	}
+
+	emit(priority, msg);
+}
+
+/* Log a message for the main subsystem, as syslog() would (used by the
+ * error() macro). errno is preserved.
+ */
+void log_printf(int priority, const char *format, ...)
+{
+	int old_errno = errno;
+	va_list ap;
+
+	va_start(ap, format);
+	log_va(SUB_MAIN, priority, NULL, NULL, format, ap);
+	va_end(ap);
+
+	errno = old_errno;
+}
+
+/* Log a message about 'task' (which may be NULL) for 'subsystem'.
+ * 'phase' (which may also be NULL) says what the task is doing.
+ */
+void log_task(LogSubsystem subsystem, int priority, Task *task,
+	      const char *phase, const char *format, ...)
+{
+	int old_errno = errno;
+	va_list ap;
+
+	va_start(ap, format);
+	log_va(subsystem, priority, task, phase, format, ap);
+	va_end(ap);
+
+	errno = old_errno;
+}
+
+/* Set the level for 'subsystem' ("all" for every one). Returns the old
+ * level (of "main", for "all"), or -1 if there's no such subsystem.
+ */
+int log_set_level(const char *subsystem, int level)
+{
+	int i, old = -1;
+
+	for (i = 0; subsystem_names[i]; i++) {
+		if (strcmp(subsystem, "all") == 0 ||
+		    strcmp(subsystem, subsystem_names[i]) == 0) {
+			if (old == -1)
+				old = levels[i];
+			levels[i] = level;
+		}
+	}
+
+	return old;
+}
+
+/* Start the writer process. Messages go through the queue after this. */
+void log_start(void)
+{
+	struct sigaction act;
+	int fds[2];
+
+	writer_started = time(NULL);
+
+	act.sa_handler = sigpipe;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	if (sigaction(SIGPIPE, &act, NULL))
+		abort();
+
+	if (pipe(fds)) {
+		error("pipe: %m");
+		return;
+	}
+
+	writer_pid = fork();
+	if (writer_pid == -1) {
+		error("fork: %m");
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+
+	if (writer_pid == 0) {
+		close(fds[1]);
+		writer_main(fds[0]);
+	}
+
+	close(fds[0]);
+	log_fd = fds[1];
+	log_pid = getpid();
+	close_on_exec(log_fd, 1);
+	set_blocking(log_fd, 0);
+}
+
+/* Process 'pid' has exited. 1 if it was the writer. */
+int log_child_done(pid_t pid)
+{
+	if (pid != writer_pid)
+		return 0;
+
+	writer_pid = -1;
+	lost_writer();
+
+	/* Try again, unless it's just been restarted */
+	if (time(NULL) >= writer_started + RESTART_DELAY)
+		log_start();
+
+	return 1;
+}
+
+/* Add the writer's pipe to 'wfds' if we have something for it */
+int log_add_select(int n, fd_set *wfds)
+{
+	if (log_fd == -1 || !queue_len)
+		return n;
+
+	FD_SET(log_fd, wfds);
+
+	return log_fd >= n ? log_fd + 1 : n;
+}
+
+void log_check_select(fd_set *wfds)
+{
+	if (log_fd != -1 && FD_ISSET(log_fd, wfds))
+		log_flush();
+}
+
+/* Send everything still queued, and stop the writer */
+void log_stop(void)
+{
+	if (log_fd == -1)
+		return;
+
+	set_blocking(log_fd, 1);
+	log_flush();
+	if (log_fd != -1) {
+		close(log_fd);
+		log_fd = -1;
+	}
+	if (writer_pid != -1)
+		waitpid(writer_pid, NULL, 0);
+}
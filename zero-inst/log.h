@@ -0,0 +1,20 @@
+#include <sys/select.h>
+
+/* Subsystems, each with its own level (see log.c) */
+typedef enum {
+	SUB_MAIN,
+	SUB_FETCH,
+	SUB_TASK,
+	SUB_CONTROL,
+	SUB_CACHE,
+	SUB_COUNT
+} LogSubsystem;
+
+void log_task(LogSubsystem subsystem, int priority, Task *task,
+	      const char *phase, const char *format, ...);
+int log_set_level(const char *subsystem, int level);
+void log_start(void);
+void log_stop(void);
+int log_child_done(pid_t pid);
+int log_add_select(int n, fd_set *wfds);
+void log_check_select(fd_set *wfds);
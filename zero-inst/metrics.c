@@ -0,0 +1,413 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Metrics. Counters, gauges and histograms for how the helper is doing,
+ * reported by the Stats control method and, if metrics_interval is set
+ * (--metrics=SECONDS), written in Prometheus's text format to
+ * .0inst-metrics.prom in the cache directory that often (for a node
+ * exporter's textfile collector to pick up).
+ *
+ * Every metric is listed in 'families' below. A metric may have one label
+ * (eg, the site), giving a separate series for each value. Histograms have
+ * HISTOGRAM_BUCKETS buckets, each twice the size of the one before.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "global.h"
+#include "support.h"
+#include "zero-install.h"
+#include "task.h"
+#include "timer.h"
+#include "catalog.h"
+#include "metrics.h"
+
+#define SERIES_MAX 256
+#define HISTOGRAM_BUCKETS 24
+#define METRICS_FILE ".0inst-metrics.prom"
+
+typedef enum {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM,
+} MetricType;
+
+typedef struct _Family Family;
+typedef struct _Series Series;
+
+struct _Family {
+	const char *name;
+	MetricType type;
+	const char *label;	/* Label name, or NULL */
+	double base;		/* Upper bound of a histogram's first bucket */
+	const char *help;
+};
+
+struct _Series {
+	const Family *family;	/* NULL if unused */
+	char *label;		/* Label value, or NULL */
+	double value;		/* Counters and gauges; sum for histograms */
+	long count;		/* Histograms */
+	long buckets[HISTOGRAM_BUCKETS];
+};
+
+static const Family families[] = {
+	{"zeroinstall_kernel_requests_total", METRIC_COUNTER, "result", 0,
+	 "Requests from the kernel, by whether an archive was fetched"},
+	{"zeroinstall_request_seconds", METRIC_HISTOGRAM, NULL, 0.001,
+	 "Time taken to answer requests from the kernel"},
+	{"zeroinstall_index_cache_total", METRIC_COUNTER, "result", 0,
+	 "Index loads, by whether the parsed index was already in memory"},
+	{"zeroinstall_negative_cache_total", METRIC_COUNTER, "result", 0,
+	 "Lookups in the cache of missing sites and paths"},
+	{"zeroinstall_index_parse_seconds", METRIC_HISTOGRAM, NULL, 0.001,
+	 "Time taken to parse and check a site's index"},
+	{"zeroinstall_gpg_seconds", METRIC_HISTOGRAM, NULL, 0.001,
+	 "Time taken to check an index's signature"},
+	{"zeroinstall_download_bytes_total", METRIC_COUNTER, "site", 0,
+	 "Bytes downloaded, by site"},
+	{"zeroinstall_download_bytes_per_second", METRIC_HISTOGRAM, "mirror",
+	 1024, "Download throughput, by mirror"},
+	{"zeroinstall_unpack_seconds", METRIC_HISTOGRAM, NULL, 0.001,
+	 "Time taken to unpack an archive"},
+	{"zeroinstall_ddd_build_seconds", METRIC_HISTOGRAM, NULL, 0.001,
+	 "Time taken to write a site's ... files"},
+	{"zeroinstall_tasks", METRIC_GAUGE, "type", 0,
+	 "Tasks in progress, by type"},
+	{"zeroinstall_cache_bytes", METRIC_GAUGE, NULL, 0,
+	 "Bytes of cached groups"},
+	{NULL, 0, NULL, 0, NULL},
+};
+
+static Series series[SERIES_MAX];
+static Timer *export_timer = NULL;
+
+/* Find the series for metric 'name' with label value 'label' (NULL if the
+ * metric has no label), creating it if needed. NULL if there's no room.
+ */
+static Series *find_series(const char *name, const char *label)
+{
+	const Family *family;
+	Series *free_slot = NULL;
+	int i;
+
+	for (family = families; family->name; family++) {
+		if (strcmp(family->name, name) == 0)
+			break;
+	}
+	assert(family->name);			/* Not in the list? */
+	assert(!label == !family->label);
+
+	for (i = 0; i < SERIES_MAX; i++) {
+		Series *s = &series[i];
+
+		if (!s->family) {
+			if (!free_slot)
+				free_slot = s;
+			continue;
+		}
+		if (s->family == family &&
+		    (!label || strcmp(s->label, label) == 0))
+			return s;
+	}
+
+	if (!free_slot)
+		return NULL;
+
+	if (label) {
+		free_slot->label = my_strdup(label);
+		if (!free_slot->label)
+			return NULL;
+	}
+	free_slot->family = family;
+
+	return free_slot;
+}
+
+/* Add 'n' to counter 'name' */
+void metrics_count(const char *name, const char *label, double n)
+{
+	Series *s;
+
+	s = find_series(name, label);
+	if (s)
+		s->value += n;
+}
+
+/* Set gauge 'name' to 'value' */
+void metrics_set(const char *name, const char *label, double value)
+{
+	Series *s;
+
+	s = find_series(name, label);
+	if (s)
+		s->value = value;
+}
+
+/* Add 'value' to histogram 'name' */
+void metrics_observe(const char *name, const char *label, double value)
+{
+	double bound;
+	Series *s;
+	int i;
+
+	s = find_series(name, label);
+	if (!s)
+		return;
+
+	s->value += value;
+	s->count++;
+
+	bound = s->family->base;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++, bound *= 2) {
+		if (value <= bound) {
+			s->buckets[i]++;
+			break;
+		}
+	}
+}
+
+/* Seconds since 'start' */
+double metrics_seconds_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/* Bring the gauges up to date */
+static void update_gauges(void)
+{
+	static const TaskType types[] = {TASK_KERNEL, TASK_CLIENT, TASK_INDEX,
+					 TASK_ARCHIVE, TASK_SUBTASK};
+	int counts[sizeof(types) / sizeof(*types)];
+	Task *task;
+	int i;
+
+	memset(counts, 0, sizeof(counts));
+	for (task = all_tasks; task; task = task->next) {
+		for (i = 0; i < sizeof(types) / sizeof(*types); i++) {
+			if (task->type == types[i])
+				counts[i]++;
+		}
+	}
+
+	for (i = 0; i < sizeof(types) / sizeof(*types); i++)
+		metrics_set("zeroinstall_tasks", task_type_name(types[i]),
+			    counts[i]);
+
+	metrics_set("zeroinstall_cache_bytes", NULL, catalog_total_bytes());
+}
+
+/* The upper bound (estimated from the buckets) of the 'q' quantile of
+ * histogram 's'.
+ */
+static double quantile(Series *s, double q)
+{
+	double bound = s->family->base;
+	long seen = 0;
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++, bound *= 2) {
+		seen += s->buckets[i];
+		if (seen >= q * s->count)
+			return bound;
+	}
+
+	return bound;
+}
+
+/* Add an entry to the arrays being built by metrics_list() */
+static void list_add(char **names, double *values, int *n,
+		     Series *s, const char *suffix, double value)
+{
+	if (s->label)
+		names[*n] = build_string("%s%s{%s=\"%s\"}", s->family->name,
+					 suffix, s->family->label, s->label);
+	else
+		names[*n] = build_string("%s%s", s->family->name, suffix);
+	if (!names[*n])
+		return;
+	values[*n] = value;
+	(*n)++;
+}
+
+/* Set 'names' and 'values' to new arrays with every series' current value
+ * (for histograms, their count and sum, and estimates of the median, 90th
+ * and 99th percentiles). Free the arrays and the names. 0 on OOM.
+ */
+int metrics_list(char ***names, double **values, int *n)
+{
+	int i;
+
+	update_gauges();
+
+	*n = 0;
+	*names = my_malloc(SERIES_MAX * 5 * sizeof(char *));
+	*values = my_malloc(SERIES_MAX * 5 * sizeof(double));
+	if (!*names || !*values) {
+		if (*names)
+			free(*names);
+		if (*values)
+			free(*values);
+		return 0;
+	}
+
+	for (i = 0; i < SERIES_MAX; i++) {
+		Series *s = &series[i];
+
+		if (!s->family)
+			continue;
+
+		if (s->family->type != METRIC_HISTOGRAM) {
+			list_add(*names, *values, n, s, "", s->value);
+			continue;
+		}
+
+		list_add(*names, *values, n, s, "_count", s->count);
+		list_add(*names, *values, n, s, "_sum", s->value);
+		if (s->count) {
+			list_add(*names, *values, n, s, "_p50",
+				 quantile(s, 0.5));
+			list_add(*names, *values, n, s, "_p90",
+				 quantile(s, 0.9));
+			list_add(*names, *values, n, s, "_p99",
+				 quantile(s, 0.99));
+		}
+	}
+
+	return 1;
+}
+
+/* Write the label part of a series, adding 'extra' (eg, le="1") */
+static void write_labels(FILE *out, Series *s, const char *extra)
+{
+	if (!s->label && !extra)
+		return;
+
+	fputc('{', out);
+	if (s->label) {
+		const char *p;
+
+		fprintf(out, "%s=\"", s->family->label);
+		for (p = s->label; *p; p++) {
+			if (*p == '"' || *p == '\\')
+				fputc('\\', out);
+			fputc(*p, out);
+		}
+		fputc('"', out);
+		if (extra)
+			fputc(',', out);
+	}
+	if (extra)
+		fputs(extra, out);
+	fputc('}', out);
+}
+
+/* Write every metric to 'out' in Prometheus's text format */
+static void write_metrics(FILE *out)
+{
+	const Family *family;
+	int i;
+
+	update_gauges();
+
+	for (family = families; family->name; family++) {
+		fprintf(out, "# HELP %s %s\n", family->name, family->help);
+		fprintf(out, "# TYPE %s %s\n", family->name,
+			family->type == METRIC_COUNTER ? "counter" :
+			family->type == METRIC_GAUGE ? "gauge" : "histogram");
+
+		for (i = 0; i < SERIES_MAX; i++) {
+			Series *s = &series[i];
+			double bound = family->base;
+			long total = 0;
+			int b;
+
+			if (s->family != family)
+				continue;
+
+			if (family->type != METRIC_HISTOGRAM) {
+				fputs(family->name, out);
+				write_labels(out, s, NULL);
+				fprintf(out, " %.17g\n", s->value);
+				continue;
+			}
+
+			for (b = 0; b < HISTOGRAM_BUCKETS; b++, bound *= 2) {
+				char le[64];
+
+				total += s->buckets[b];
+				snprintf(le, sizeof(le), "le=\"%g\"", bound);
+				fprintf(out, "%s_bucket", family->name);
+				write_labels(out, s, le);
+				fprintf(out, " %ld\n", total);
+			}
+			fprintf(out, "%s_bucket", family->name);
+			write_labels(out, s, "le=\"+Inf\"");
+			fprintf(out, " %ld\n", s->count);
+			fprintf(out, "%s_sum", family->name);
+			write_labels(out, s, NULL);
+			fprintf(out, " %.17g\n", s->value);
+			fprintf(out, "%s_count", family->name);
+			write_labels(out, s, NULL);
+			fprintf(out, " %ld\n", s->count);
+		}
+	}
+}
+
+/* Write the metrics file, replacing the old one in one go */
+static void export_metrics(void *data)
+{
+	char *path, *tmp;
+	FILE *out;
+
+	export_timer = timer_add(metrics_interval * 1000, export_metrics, NULL);
+
+	path = build_string("%s/" METRICS_FILE, cache_dir);
+	tmp = build_string("%s/" METRICS_FILE ".new", cache_dir);
+	if (!path || !tmp)
+		goto out;
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		error("fopen(%s): %m", tmp);
+		goto out;
+	}
+	write_metrics(out);
+	if (fclose(out)) {
+		error("Writing %s: %m", tmp);
+		goto out;
+	}
+
+	if (rename(tmp, path))
+		error("rename(%s): %m", tmp);
+out:
+	if (path)
+		free(path);
+	if (tmp)
+		free(tmp);
+}
+
+/* Start writing the metrics file, if asked to */
+void metrics_init(void)
+{
+	if (metrics_interval > 0 && !export_timer)
+		export_timer = timer_add(0, export_metrics, NULL);
+}
@@ -0,0 +1,6 @@
+void metrics_init(void);
+void metrics_count(const char *name, const char *label, double n);
+void metrics_set(const char *name, const char *label, double value);
+void metrics_observe(const char *name, const char *label, double value);
+double metrics_seconds_since(const struct timeval *start);
+int metrics_list(char ***names, double **values, int *n);
@@ -1,3 +1,4 @@
+#include <sys/types.h>
 #include <assert.h>
 #include <string.h>
 #include <malloc.h>
@@ -7,14 +8,31 @@
 #include "mirrors.h"
 #include "zero-install.h"
 #include "xml.h"
+#include "breaker.h"
 
-/* Decide the URI where the archive is to be downloaded from.
- * file is the cache-relative path of a file in the group.
+/* Recent download speed from each site, for estimating fetch times */
+typedef struct _Speed Speed;
+
+struct _Speed {
+	char *site;
+	double bytes_per_sec;
+
+	Speed *next;
+};
+
+static Speed *speeds = NULL;
+
+/* Ignore downloads smaller than this; they only measure latency */
+#define SPEED_MIN_BYTES 16384
+
+/* Decide the URI where the archive is to be downloaded from, using the
+ * list in 'mirrors_file' (relative to site's meta directory).
  * free() the result.
  *
  * If leafname is NULL, get the site index.
  */
-char *mirrors_get_best_url(const char *site, const char *leafname)
+static char *best_url(const char *site, const char *mirrors_file,
+		      const char *leafname)
 {
 	char *uri = NULL;
 	Element *mirror, *mirrors = NULL;
@@ -23,7 +41,13 @@ char *mirrors_get_best_url(const char *site, const char *leafname)
 
 	assert(strchr(site, '/') == NULL);
 
-	path = build_string("%s/%s/" META "/mirrors.xml", cache_dir, site);
+	if (!breaker_allow(site)) {
+		syslog(LOG_INFO, "Not fetching from '%s' now (%s)", site,
+				offline ? "offline" : "site is failing");
+		return NULL;
+	}
+
+	path = build_string("%s/%s/" META "/%s", cache_dir, site, mirrors_file);
 	if (!path)
 		return NULL;
 	mirrors = xml_new(ZERO_NS, path);
@@ -40,19 +64,24 @@ char *mirrors_get_best_url(const char *site, const char *leafname)
 			goto out;
 	}
 
+	/* Use the first mirror whose circuit breaker isn't tripped */
+	base = NULL;
 	for (mirror = mirrors->lastChild; mirror;
 					mirror = mirror->previousSibling) {
-		break;
+		base = xml_get_attr(mirror, "base");
+		if (!base) {
+			error("Missing 'base' attribute in mirrors.xml");
+			goto out;
+		}
+		if (breaker_allow(base))
+			break;
 	}
 
 	if (!mirror) {
-		error("No mirrors found!");
-		goto out;
-	}
-
-	base = xml_get_attr(mirror, "base");
-	if (!base) {
-		error("Missing 'base' attribute in mirrors.xml");
+		if (base)
+			error("All mirrors for '%s' are failing", site);
+		else
+			error("No mirrors found!");
 		goto out;
 	}
 
@@ -68,3 +97,69 @@ out:
 
 	return uri;
 }
+
+/* Decide the URI where the archive is to be downloaded from.
+ * free() the result.
+ *
+ * If leafname is NULL, get the site index.
+ */
+char *mirrors_get_best_url(const char *site, const char *leafname)
+{
+	return best_url(site, "mirrors.xml", leafname);
+}
+
+/* As mirrors_get_best_url(site, NULL), but using the mirror list from the
+ * index archive which has just been unpacked (see fetch.c), since the
+ * index it names hasn't been checked yet.
+ */
+char *mirrors_get_staged_index_url(const char *site)
+{
+	return best_url(site, STAGED "/mirrors.xml", NULL);
+}
+
+/* A download of 'bytes' from 'site' took 'ms' milliseconds */
+void mirrors_note_download(const char *site, long bytes, long ms)
+{
+	Speed *speed;
+	double bps;
+
+	if (bytes < SPEED_MIN_BYTES || ms <= 0)
+		return;
+	bps = bytes * 1000.0 / ms;
+
+	for (speed = speeds; speed; speed = speed->next) {
+		if (strcmp(speed->site, site) == 0) {
+			/* Moving average, weighted towards recent downloads */
+			speed->bytes_per_sec = speed->bytes_per_sec * 0.7 +
+					       bps * 0.3;
+			return;
+		}
+	}
+
+	speed = my_malloc(sizeof(Speed));
+	if (!speed)
+		return;
+	speed->site = my_strdup(site);
+	if (!speed->site) {
+		free(speed);
+		return;
+	}
+	speed->bytes_per_sec = bps;
+	speed->next = speeds;
+	speeds = speed;
+}
+
+/* Recent download speed from 'site' in bytes per second, or 0 if we
+ * don't know.
+ */
+long mirrors_get_throughput(const char *site)
+{
+	Speed *speed;
+
+	for (speed = speeds; speed; speed = speed->next) {
+		if (strcmp(speed->site, site) == 0)
+			return (long) speed->bytes_per_sec;
+	}
+
+	return 0;
+}
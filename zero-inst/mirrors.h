@@ -1 +1,4 @@
 char *mirrors_get_best_url(const char *site, const char *leafname);
+char *mirrors_get_staged_index_url(const char *site);
+void mirrors_note_download(const char *site, long bytes, long ms);
+long mirrors_get_throughput(const char *site);
@@ -0,0 +1,162 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Negative results. Programs often look for things which don't exist
+ * (eg, probing /uri/0install/<name> for each name in a search path). If
+ * a server says it has no index (rather than not answering), we don't try
+ * that site again for SITE_TTL seconds; if a path isn't in its site's
+ * index, requests for it are rejected for PATH_TTL seconds (or until the
+ * index changes).
+ *
+ * Only NEGATIVE_MAX results are kept; the one expiring first makes way
+ * for a new one. An explicit Refresh forgets everything for the site.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "global.h"
+#include "support.h"
+#include "negative.h"
+#include "metrics.h"
+
+#define SITE_TTL (5 * 60)	/* Seconds to remember a missing site */
+#define PATH_TTL (30 * 60)	/* Seconds to remember a missing path */
+#define NEGATIVE_MAX 256
+
+typedef struct _Negative Negative;
+
+struct _Negative {
+	char *path;		/* "/site" or "/site/path"; NULL if unused */
+	time_t expires;
+};
+
+static Negative results[NEGATIVE_MAX];
+static long hits = 0, misses = 0;
+static int site_ttl = SITE_TTL, path_ttl = PATH_TTL;
+
+/* Length of the "/site" part of 'path' */
+static int site_len(const char *path)
+{
+	const char *slash;
+
+	slash = strchr(path + 1, '/');
+	return slash ? slash - path : strlen(path);
+}
+
+static void forget(Negative *n)
+{
+	free(n->path);
+	n->path = NULL;
+}
+
+/* Remember that 'path' doesn't exist. If 'path' is just "/site" then
+ * the whole site is missing.
+ */
+void negative_add(const char *path)
+{
+	Negative *slot = results;
+	time_t now = time(NULL);
+	int i;
+
+	if (path[0] != '/')
+		return;
+
+	for (i = 0; i < NEGATIVE_MAX; i++) {
+		Negative *n = &results[i];
+
+		if (n->path && strcmp(n->path, path) == 0) {
+			slot = n;
+			break;
+		}
+		if (slot->path && (!n->path || n->expires < slot->expires))
+			slot = n;
+	}
+
+	if (slot->path)
+		forget(slot);
+	slot->path = my_strdup(path);
+	slot->expires = now + (path[site_len(path)] ? path_ttl : site_ttl);
+
+	if (verbose)
+		error("Remembering that '%s' is missing", path);
+}
+
+/* 1 if 'path' (or its whole site) is known not to exist */
+int negative_check(const char *path)
+{
+	time_t now = time(NULL);
+	int len = site_len(path);
+	int i;
+
+	for (i = 0; i < NEGATIVE_MAX; i++) {
+		Negative *n = &results[i];
+
+		if (!n->path)
+			continue;
+		if (n->expires <= now) {
+			forget(n);
+			continue;
+		}
+		if (strcmp(n->path, path) == 0 ||
+		    (strncmp(n->path, path, len) == 0 && n->path[len] == '\0')) {
+			hits++;
+			metrics_count("zeroinstall_negative_cache_total",
+				      "hit", 1);
+			return 1;
+		}
+	}
+
+	misses++;
+	metrics_count("zeroinstall_negative_cache_total", "miss", 1);
+	return 0;
+}
+
+/* Forget everything we know is missing from 'site' */
+void negative_clear(const char *site)
+{
+	int len = strlen(site);
+	int i;
+
+	for (i = 0; i < NEGATIVE_MAX; i++) {
+		Negative *n = &results[i];
+
+		if (n->path && strncmp(n->path + 1, site, len) == 0 &&
+		    (n->path[len + 1] == '\0' || n->path[len + 1] == '/'))
+			forget(n);
+	}
+}
+
+/* Remember new results for 'seconds' instead (for testing) */
+void negative_set_ttl(int seconds)
+{
+	site_ttl = path_ttl = seconds;
+}
+
+/* Get the number of lookups answered from the cache (hits) and not
+ * (misses), and the number of results held.
+ */
+void negative_stats(long *n_hits, long *n_misses, int *n_entries)
+{
+	time_t now = time(NULL);
+	int i;
+
+	*n_entries = 0;
+	for (i = 0; i < NEGATIVE_MAX; i++) {
+		if (results[i].path && results[i].expires > now)
+			(*n_entries)++;
+	}
+
+	*n_hits = hits;
+	*n_misses = misses;
+}
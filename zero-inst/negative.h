@@ -0,0 +1,5 @@
+void negative_add(const char *path);
+int negative_check(const char *path);
+void negative_clear(const char *site);
+void negative_stats(long *n_hits, long *n_misses, int *n_entries);
+void negative_set_ttl(int seconds);
@@ -0,0 +1,695 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Sibling prefetching. When several files in one directory are fetched
+ * within a short time, a program is probably starting up and will soon
+ * want the rest of the directory too. The directory's other groups (or
+ * its parent's, if the misses are spread over several subdirectories) are
+ * queued and fetched in the background, a few at a time, while the
+ * network isn't busy with real requests.
+ *
+ * Each burst may only queue so many bytes, and if the user cancels a
+ * download we stop prefetching for a while.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <assert.h>
+
+#include "global.h"
+#include "support.h"
+#include "index.h"
+#include "fetch.h"
+#include "task.h"
+#include "zero-install.h"
+#include "xml.h"
+#include "timer.h"
+#include "control.h"
+#include "catalog.h"
+#include "prefetch.h"
+
+#define BURST_WINDOW 2		/* Seconds */
+#define BURST_MISSES 3		/* Misses in a window to count as a burst */
+#define RECENT_MAX 16		/* Misses remembered */
+
+#define BURST_BUDGET (2 * 1024 * 1024)	/* Bytes queued per burst */
+#define QUEUE_BUDGET (8 * 1024 * 1024)	/* Bytes queued in total */
+
+#define ACTIVE_MAX 2		/* Prefetches running at once */
+#define FOREGROUND_MAX 1	/* Wait while more real downloads than this */
+#define POLL_MS 500		/* Check for free slots this often */
+
+#define BACKOFF_TIME 60		/* Seconds without prefetching after cancel */
+
+#define JOB_ACTIVE_MAX 4	/* Downloads at once for a Prefetch request */
+
+typedef struct _Miss Miss;
+typedef struct _Prefetch Prefetch;
+typedef struct _Job Job;
+
+struct _Miss {
+	char *dir;		/* Cache-relative path of the directory */
+	time_t time;
+};
+
+struct _Prefetch {
+	char *file;		/* Cache-relative path of a file in group */
+	Element *group;
+	Index *index;		/* Holds a ref */
+
+	Prefetch *next;
+};
+
+/* An explicit Prefetch request from a client */
+struct _Job {
+	Task *client;		/* client->data is this */
+	char **files;		/* A file in each group (cache-relative) */
+	Element **groups;
+	int n_groups;
+	int next;		/* Next group to start */
+	int active, done, failed;
+	long bytes, bytes_done;
+};
+
+static Miss recent[RECENT_MAX];
+static int next_recent = 0;
+
+static Prefetch *queue = NULL;
+static long queued_bytes = 0;
+
+static Timer *queue_timer = NULL;
+static time_t backoff_until = 0;
+
+/* 1 if all the files in 'group' are in the cache already.
+ * 'dir' is the cache-relative path of the group's directory.
+ */
+static int group_cached(const char *dir, Element *group)
+{
+	Element *item;
+	int present;
+
+	present = catalog_group_present(dir, group);
+	if (present != -1)
+		return present;
+
+	for (item = group->lastChild; item; item = item->previousSibling) {
+		char path[MAX_PATH_LEN];
+		struct stat info;
+
+		if (item->name[0] == 'a')
+			continue;
+		if (snprintf(path, sizeof(path), "%s%s/%s", cache_dir, dir,
+			     xml_get_attr(item, "name")) >= sizeof(path))
+			return 1;	/* Can't fetch it anyway */
+		if (lstat(path, &info) ||
+		    info.st_size != atol(xml_get_attr(item, "size")) ||
+		    info.st_mtime != atol(xml_get_attr(item, "mtime")))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int queued(Element *group)
+{
+	Prefetch *p;
+
+	for (p = queue; p; p = p->next) {
+		if (p->group == group)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void free_prefetch(Prefetch *p)
+{
+	index_free(p->index);
+	free(p->file);
+	free(p);
+}
+
+/* Count archive downloads in progress */
+static void count_active(int *prefetches, int *foreground)
+{
+	Task *task;
+
+	*prefetches = *foreground = 0;
+
+	for (task = all_tasks; task; task = task->next) {
+		if (task->type != TASK_ARCHIVE || (task->flags & TASK_BUNDLE))
+			continue;
+		if (task->flags & TASK_PREFETCH)
+			(*prefetches)++;
+		else
+			(*foreground)++;
+	}
+}
+
+/* Start queued prefetches while there are free slots */
+static void run_queue(void *data)
+{
+	int prefetches, foreground;
+
+	queue_timer = NULL;
+
+	count_active(&prefetches, &foreground);
+
+	while (queue && prefetches < ACTIVE_MAX &&
+	       foreground <= FOREGROUND_MAX) {
+		Prefetch *p = queue;
+		Task *task;
+
+		queue = p->next;
+		queued_bytes -= atol(xml_get_attr(p->group, "size"));
+
+		if (verbose)
+			syslog(LOG_DEBUG, "Prefetching group for '%s'",
+					p->file);
+
+		task = fetch_archive(p->file, p->group, p->index,
+				     FETCH_WHOLE | FETCH_PREFETCH);
+		if (task && (task->flags & TASK_PREFETCH))
+			prefetches++;
+
+		free_prefetch(p);
+	}
+
+	if (queue)
+		queue_timer = timer_add(POLL_MS, run_queue, NULL);
+}
+
+/* Add 'group' to the end of the queue, unless it's already queued or
+ * cached, or it won't fit in 'budget' or the queue's budget.
+ * 'dir' is the cache-relative path of the group's directory.
+ * Returns the number of bytes queued.
+ */
+static long enqueue(const char *dir, Element *group, Index *index,
+		    long budget)
+{
+	Prefetch *p, **tail;
+	Element *item;
+	long size;
+
+	size = atol(xml_get_attr(group, "size"));
+	if (size > budget || queued_bytes + size > QUEUE_BUDGET)
+		return 0;
+	if (queued(group) || group_cached(dir, group))
+		return 0;
+
+	for (item = group->lastChild; item->name[0] == 'a';
+	     item = item->previousSibling)
+		;
+
+	p = my_malloc(sizeof(Prefetch));
+	if (!p)
+		return 0;
+	p->file = build_string("%s/%s", dir, xml_get_attr(item, "name"));
+	if (!p->file) {
+		free(p);
+		return 0;
+	}
+	p->group = group;
+	p->index = index;
+	index->ref++;
+	p->next = NULL;
+
+	for (tail = &queue; *tail; tail = &(*tail)->next)
+		;
+	*tail = p;
+
+	queued_bytes += size;
+
+	if (!queue_timer)
+		queue_timer = timer_add(0, run_queue, NULL);
+
+	return size;
+}
+
+/* Queue the groups in 'dir_node' which aren't cached yet, up to the
+ * byte budgets. 'dir' is the cache-relative path of the directory.
+ */
+static void queue_dir(const char *dir, Element *dir_node, Index *index)
+{
+	Element *group;
+	long budget = BURST_BUDGET;
+
+	for (group = dir_node->lastChild; group;
+	     group = group->previousSibling) {
+		if (group->name[0] == 'g')
+			budget -= enqueue(dir, group, index, budget);
+	}
+}
+
+/* Queue the group containing 'path' (a cache-relative path of a file in
+ * 'index's site), if it isn't cached yet.
+ */
+void prefetch_path(const char *path, Index *index)
+{
+	Element *item;
+	const char *slash;
+	char *dir;
+
+	if (time(NULL) < backoff_until)
+		return;
+
+	slash = strchr(path + 1, '/');
+	if (!slash)
+		return;
+
+	item = index_lookup(index, slash);
+	if (!item || (item->name[0] != 'f' && item->name[0] != 'e'))
+		return;	/* Index has changed since */
+
+	dir = build_string("%d", path);
+	if (!dir)
+		return;
+
+	enqueue(dir, item->parentNode, index, QUEUE_BUDGET);
+
+	free(dir);
+}
+
+/* Forget the misses in 'dir' (or, if 'under', anywhere below 'dir') */
+static void forget_misses(const char *dir, int under)
+{
+	int i, len = strlen(dir);
+
+	for (i = 0; i < RECENT_MAX; i++) {
+		if (!recent[i].dir)
+			continue;
+		if (under ? (strncmp(recent[i].dir, dir, len) == 0 &&
+			     recent[i].dir[len] == '/')
+			  : strcmp(recent[i].dir, dir) == 0) {
+			free(recent[i].dir);
+			recent[i].dir = NULL;
+		}
+	}
+}
+
+/* We've just started fetching 'group' because the kernel asked for 'path'
+ * (a cache-relative path). If this is part of a burst, queue the rest of
+ * the directory.
+ */
+void prefetch_note_miss(const char *path, Element *group, Index *index)
+{
+	Element *dir_node = group->parentNode;
+	time_t now;
+	char *dir, *parent;
+	int i, in_dir = 0, in_parent = 0, other_dirs = 0;
+
+	assert(dir_node->name[0] == 'd');
+
+	now = time(NULL);
+	if (now < backoff_until)
+		return;
+
+	dir = build_string("%d", path);
+	if (!dir)
+		return;
+
+	if (recent[next_recent].dir)
+		free(recent[next_recent].dir);
+	recent[next_recent].dir = dir;
+	recent[next_recent].time = now;
+	next_recent = (next_recent + 1) % RECENT_MAX;
+
+	parent = strchr(dir + 1, '/') ? build_string("%d", dir) : NULL;
+
+	for (i = 0; i < RECENT_MAX; i++) {
+		const char *d = recent[i].dir;
+
+		if (!d || recent[i].time + BURST_WINDOW < now)
+			continue;
+		if (strcmp(d, dir) == 0)
+			in_dir++;
+		if (parent && strncmp(d, parent, strlen(parent)) == 0 &&
+		    d[strlen(parent)] == '/') {
+			in_parent++;
+			if (strcmp(d, dir) != 0)
+				other_dirs++;
+		}
+	}
+
+	if (in_dir >= BURST_MISSES) {
+		syslog(LOG_INFO, "Burst of requests in '%s'; prefetching", dir);
+		queue_dir(dir, dir_node, index);
+		forget_misses(dir, 0);
+	} else if (parent && other_dirs && in_parent >= BURST_MISSES &&
+		   dir_node->parentNode->name[0] == 'd') {
+		syslog(LOG_INFO, "Burst of requests under '%s'; prefetching",
+				parent);
+		queue_dir(parent, dir_node->parentNode, index);
+		forget_misses(parent, 1);
+	}
+
+	if (parent)
+		free(parent);
+}
+
+/* The user cancelled a download. Drop the queue, stop any prefetches
+ * nobody is waiting for, and don't prefetch again for a while.
+ */
+void prefetch_backoff(void)
+{
+	Task *task, *t;
+	int i;
+
+	backoff_until = time(NULL) + BACKOFF_TIME;
+
+	while (queue) {
+		Prefetch *p = queue;
+		queue = p->next;
+		free_prefetch(p);
+	}
+	queued_bytes = 0;
+
+	for (i = 0; i < RECENT_MAX; i++) {
+		if (recent[i].dir) {
+			free(recent[i].dir);
+			recent[i].dir = NULL;
+		}
+	}
+
+	for (task = all_tasks; task; task = task->next) {
+		if (!(task->flags & TASK_PREFETCH) || task->child_pid == -1)
+			continue;
+		for (t = all_tasks; t; t = t->next) {
+			if (t->child_task == task)
+				break;
+		}
+		if (!t)
+			kill(task->child_pid, SIGTERM);
+	}
+}
+
+/* Explicit prefetching (the Prefetch control method). Every group under a
+ * path which isn't cached yet is fetched, JOB_ACTIVE_MAX at a time, with
+ * progress reported to the client as each one finishes. Unlike the
+ * heuristic prefetches above, these are normal downloads.
+ */
+
+static void job_run(Job *job);
+
+/* Add 'group' (in directory 'dir') to 'job' if it isn't cached.
+ * 0 on OOM.
+ */
+static int job_add(Job *job, const char *dir, Element *group)
+{
+	Element *item;
+	char **files;
+	Element **groups;
+	char *file;
+
+	if (group_cached(dir, group))
+		return 1;
+
+	for (item = group->lastChild; item->name[0] == 'a';
+	     item = item->previousSibling)
+		;
+
+	file = build_string("%s/%s", dir, xml_get_attr(item, "name"));
+	if (!file)
+		return 0;
+
+	files = my_realloc(job->files, (job->n_groups + 1) * sizeof(char *));
+	if (files)
+		job->files = files;
+	groups = my_realloc(job->groups,
+			    (job->n_groups + 1) * sizeof(Element *));
+	if (groups)
+		job->groups = groups;
+	if (!files || !groups) {
+		free(file);
+		return 0;
+	}
+
+	job->files[job->n_groups] = file;
+	job->groups[job->n_groups] = group;
+	job->n_groups++;
+	job->bytes += atol(xml_get_attr(group, "size"));
+
+	return 1;
+}
+
+/* Add the groups in 'dir_node' (path 'dir') to 'job', and those in
+ * subdirectories too if 'recursive'. 0 on OOM.
+ */
+static int job_add_dir(Job *job, const char *dir, Element *dir_node,
+		       int recursive)
+{
+	Element *node;
+
+	for (node = dir_node->lastChild; node; node = node->previousSibling) {
+		if (node->name[0] == 'g') {
+			if (!job_add(job, dir, node))
+				return 0;
+		} else if (node->name[0] == 'd' && recursive) {
+			char *sub;
+			int ok;
+
+			sub = build_string("%s/%s", dir,
+					   xml_get_attr(node, "name"));
+			if (!sub)
+				return 0;
+			ok = job_add_dir(job, sub, node, recursive);
+			free(sub);
+			if (!ok)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void job_free(Job *job)
+{
+	int i;
+
+	for (i = 0; i < job->n_groups; i++)
+		free(job->files[i]);
+	if (job->files)
+		free(job->files);
+	if (job->groups)
+		free(job->groups);
+	free(job);
+}
+
+/* An archive for the job has finished (or failed) */
+static void job_part_done(Task *part, const char *err)
+{
+	Job *job = part->data;
+
+	job->active--;
+	if (err)
+		job->failed++;
+	else
+		job->done++;
+	job->bytes_done += part->size;
+
+	task_destroy(part, NULL);
+
+	job_run(job);
+}
+
+/* Start more of the job's downloads, or finish if they're all done */
+static void job_run(Job *job)
+{
+	Task *client = job->client;
+
+	while (job->active < JOB_ACTIVE_MAX && job->next < job->n_groups) {
+		Element *group = job->groups[job->next];
+		const char *file = job->files[job->next];
+		Task *archive, *part;
+		long size;
+
+		job->next++;
+		size = atol(xml_get_attr(group, "size"));
+
+		archive = fetch_archive(file, group, client->index,
+					FETCH_WHOLE);
+		part = archive ? task_new(TASK_SUBTASK) : NULL;
+		if (!part) {
+			job->failed++;
+			job->bytes_done += size;
+			continue;
+		}
+
+		part->data = job;
+		part->size = size;
+		part->child_task = archive;
+		part->step = job_part_done;
+		job->active++;
+	}
+
+	control_prefetch_progress(client, job->done + job->failed,
+			job->n_groups, job->bytes_done, job->bytes);
+
+	if (job->active || job->next < job->n_groups)
+		return;
+
+	client->data = NULL;
+	control_prefetch_done(client,
+			job->failed ? "Some groups could not be fetched" : NULL);
+	job_free(job);
+}
+
+/* Collect the groups under 'path' (or just its group, for a file) which
+ * aren't in the cache yet. Returns NULL and sets 'err' on failure.
+ */
+static Job *job_new(const char *path, Index *index, int recursive,
+		    const char **err)
+{
+	const char *slash;
+	Element *item;
+	Job *job;
+	int ok;
+
+	slash = strchr(path + 1, '/');
+	if (slash)
+		item = index_lookup(index, slash);
+	else
+		item = index_get_root(index);
+	if (!item) {
+		*err = "Not found in index";
+		return NULL;
+	}
+	if (item->name[0] == 'l') {
+		*err = "Can't prefetch a symlink";
+		return NULL;
+	}
+
+	*err = "Out of memory";
+
+	job = my_malloc(sizeof(Job));
+	if (!job)
+		return NULL;
+	job->client = NULL;
+	job->files = NULL;
+	job->groups = NULL;
+	job->n_groups = job->next = 0;
+	job->active = job->done = job->failed = 0;
+	job->bytes = job->bytes_done = 0;
+
+	if (item->name[0] == 'd')
+		ok = job_add_dir(job, path, item, recursive);
+	else {
+		char *dir;
+
+		dir = build_string("%d", path);
+		ok = dir && job_add(job, dir, item->parentNode);
+		if (dir)
+			free(dir);
+	}
+
+	if (!ok) {
+		job_free(job);
+		return NULL;
+	}
+
+	*err = NULL;
+	return job;
+}
+
+/* 'client' wants everything under client->str (or just its group, for a
+ * file) in the cache. client->index is the site's index, and the
+ * TASK_RECURSIVE flag says whether to include subdirectories.
+ * control_prefetch_done() will be called when finished. Returns an error
+ * message (and does nothing) if we can't start.
+ */
+const char *prefetch_start_job(Task *client)
+{
+	const char *err;
+	Job *job;
+
+	assert(client->index);
+
+	job = job_new(client->str, client->index,
+		      client->flags & TASK_RECURSIVE, &err);
+	if (!job)
+		return err;
+	job->client = client;
+
+	syslog(LOG_INFO, "Prefetching %d groups (%ld bytes) for '%s'",
+			job->n_groups, job->bytes, client->str);
+
+	client->data = job;
+	job_run(job);
+
+	return NULL;
+}
+
+/* Work out what prefetching 'path' would fetch, without fetching anything.
+ * On success, 'files' is set to an array of 'n_groups' paths (one file
+ * from each missing group; free the array and each path) and 'bytes' to
+ * the total archive size. Returns an error message on failure.
+ */
+const char *prefetch_plan(const char *path, Index *index, int recursive,
+			  char ***files, int *n_groups, long *bytes)
+{
+	const char *err;
+	Job *job;
+
+	job = job_new(path, index, recursive, &err);
+	if (!job)
+		return err;
+
+	*files = job->files;
+	*n_groups = job->n_groups;
+	*bytes = job->bytes;
+
+	if (job->groups)
+		free(job->groups);
+	free(job);
+
+	return NULL;
+}
+
+/* Is 'path' (/site/...) in the cache? Only 'index' (the site's, already
+ * loaded) and the catalog or the cache directory are used, so this never
+ * waits for a fetch. Returns 1 if it is (directories and links always
+ * are), 0 if not (and sets 'group' to the group it's in), or -1 if it
+ * isn't in the index.
+ */
+int prefetch_path_cached(const char *path, Index *index, Element **group)
+{
+	const char *slash;
+	Element *item;
+	char *dir;
+	int cached;
+
+	slash = strchr(path + 1, '/');
+	if (slash && slash[1])
+		item = index_lookup(index, slash);
+	else
+		item = index_get_root(index);
+	if (!item)
+		return -1;
+
+	if (!item->parentNode || item->parentNode->name[0] != 'g')
+		return 1;
+
+	dir = build_string("%d", path);
+	if (!dir)
+		return 1;	/* OOM; don't say it needs fetching */
+	cached = group_cached(dir, item->parentNode);
+	free(dir);
+
+	if (!cached)
+		*group = item->parentNode;
+
+	return cached;
+}
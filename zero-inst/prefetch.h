@@ -0,0 +1,7 @@
+void prefetch_note_miss(const char *path, Element *group, Index *index);
+void prefetch_backoff(void);
+void prefetch_path(const char *path, Index *index);
+const char *prefetch_start_job(Task *client);
+const char *prefetch_plan(const char *path, Index *index, int recursive,
+			  char ***files, int *n_groups, long *bytes);
+int prefetch_path_cached(const char *path, Index *index, Element **group);
@@ -0,0 +1,183 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Background refreshing. Sites whose indexes are used often ("hot" sites)
+ * get their indexes refreshed in the background once they are
+ * REFRESH_AGE old, while nothing else is being downloaded. Until the new
+ * index has been fetched and checked, the old one is still used (see
+ * load_index), so nobody has to wait for it.
+ *
+ * Checks happen at random intervals, so that many machines sharing a
+ * mirror don't all refresh at once.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "global.h"
+#include "support.h"
+#include "index.h"
+#include "fetch.h"
+#include "task.h"
+#include "zero-install.h"
+#include "timer.h"
+#include "refresh.h"
+
+#define REFRESH_AGE (6 * 60 * 60)	/* Refresh indexes older than this */
+#define REFRESH_PERIOD 300	/* Average seconds between checks */
+#define HOT_USES 10		/* Uses per period for a site to be hot */
+#define SITES_MAX 32		/* Sites tracked */
+
+typedef struct _Site Site;
+
+struct _Site {
+	char *site;		/* NULL if unused */
+	int uses;		/* Decays by half each period */
+};
+
+static Site sites[SITES_MAX];
+static Timer *refresh_timer = NULL;
+
+static void refresh_check(void *data);
+
+/* Check again in between half and one and a half periods */
+static void schedule_check(void)
+{
+	static int seeded = 0;
+	long ms;
+
+	if (!seeded) {
+		srandom(time(NULL) ^ getpid());
+		seeded = 1;
+	}
+
+	ms = REFRESH_PERIOD * 500L + random() % (REFRESH_PERIOD * 1000L);
+	refresh_timer = timer_add(ms, refresh_check, NULL);
+}
+
+/* 1 if anything is being downloaded */
+static int busy(void)
+{
+	Task *task;
+
+	for (task = all_tasks; task; task = task->next) {
+		if (task->child_pid != -1)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Seconds since we last unpacked an index for 'site', or -1 if unknown.
+ * tar sets the signature's mtime from the archive, but not its ctime.
+ */
+static long index_age(const char *site)
+{
+	struct stat info;
+	char *sig;
+	int ok;
+
+	sig = build_string("%s/%h/" META "/index.xml.sig", cache_dir, site);
+	if (!sig)
+		return -1;
+	ok = stat(sig, &info) == 0;
+	free(sig);
+
+	return ok ? time(NULL) - info.st_ctime : -1;
+}
+
+static void refresh_check(void *data)
+{
+	Site *best = NULL;
+	int i, tracked = 0;
+
+	refresh_timer = NULL;
+
+	if (!busy()) {
+		for (i = 0; i < SITES_MAX; i++) {
+			Site *s = &sites[i];
+
+			if (!s->site || s->uses < HOT_USES)
+				continue;
+			if (best && s->uses <= best->uses)
+				continue;
+			if (index_age(s->site) >= REFRESH_AGE)
+				best = s;
+		}
+	}
+
+	if (best) {
+		Task *task = NULL;
+		char *path;
+
+		syslog(LOG_INFO, "Refreshing index for '%s' in the background",
+				best->site);
+
+		path = build_string("/%s", best->site);
+		if (path) {
+			Index *index = get_index(path, &task, 1);
+			if (index)
+				index_free(index);
+			free(path);
+		}
+		if (!task)
+			error("Failed to start refreshing '%s'", best->site);
+	}
+
+	/* Let old uses fade away */
+	for (i = 0; i < SITES_MAX; i++) {
+		Site *s = &sites[i];
+
+		if (!s->site)
+			continue;
+		s->uses /= 2;
+		if (s->uses) {
+			tracked++;
+		} else {
+			free(s->site);
+			s->site = NULL;
+		}
+	}
+
+	if (tracked)
+		schedule_check();
+}
+
+/* The index for 'site' has just been used */
+void refresh_note_use(const char *site)
+{
+	Site *slot = NULL;
+	int i;
+
+	for (i = 0; i < SITES_MAX; i++) {
+		Site *s = &sites[i];
+
+		if (s->site && strcmp(s->site, site) == 0) {
+			s->uses++;
+			return;
+		}
+		if (!slot || (slot->site && (!s->site || s->uses < slot->uses)))
+			slot = s;
+	}
+
+	if (slot->site)
+		free(slot->site);
+	slot->site = my_strdup(site);
+	slot->uses = 1;
+
+	if (slot->site && !refresh_timer)
+		schedule_check();
+}
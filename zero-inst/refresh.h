@@ -0,0 +1 @@
+void refresh_note_use(const char *site);
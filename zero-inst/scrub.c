@@ -0,0 +1,474 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Scrubbing. Files are checked when they are unpacked, but they may still
+ * be damaged on the disk later. The scrubber goes through the groups in
+ * the catalog in the background, checking each cached file's type, size
+ * and mtime against the index, and its contents too if the index gives
+ * the file's own digest (the archive's digest is no use once it has been
+ * unpacked). Each step hashes at most SCRUB_STEP_BYTES, so a big group
+ * takes several steps; the group and the file being hashed are kept
+ * between them.
+ *
+ * A damaged group's files are moved into a new directory under
+ * .0inst-quarantine (so they'll be fetched again when needed, and can be
+ * examined meanwhile), and the group is queued to be fetched again at low
+ * priority, as for a prefetch. Quarantined files are deleted after
+ * QUARANTINE_DAYS.
+ *
+ * The scrubber reads at most scrub_rate KB per second (--scrub-rate; 0
+ * turns it off), and waits between steps so that it uses at most
+ * scrub_cpu percent of the CPU time (--scrub-cpu). It keeps out of the way
+ * while anything is downloading. A new pass starts every SCRUB_PERIOD
+ * seconds.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+
+#include "global.h"
+#include "support.h"
+#include "index.h"
+#include "fetch.h"
+#include "task.h"
+#include "zero-install.h"
+#include "xml.h"
+#include "timer.h"
+#include "catalog.h"
+#include "prefetch.h"
+#include "gc.h"
+#include "digest.h"
+#include "scrub.h"
+
+#define SCRUB_PERIOD (24 * 60 * 60)	/* Seconds between passes */
+#define SCRUB_START (10 * 60)		/* Seconds before the first pass */
+#define SCRUB_STEP_MS 100		/* Shortest time between steps */
+#define SCRUB_BUSY_MS 5000		/* Wait while downloading */
+#define SCRUB_STEP_BYTES (1024 * 1024)	/* Most bytes hashed per step */
+#define QUARANTINE_DIR ".0inst-quarantine"
+#define QUARANTINE_DAYS 7
+#define FINDINGS_MAX 16			/* Recent problems remembered */
+
+static Timer *scrub_timer = NULL;
+static int scrub_start = SCRUB_START;
+
+/* State of the current pass */
+static int cursor = 0;
+static long groups_checked = 0, bytes_checked = 0;
+
+static long damaged = 0;		/* Groups, since we started */
+static char *findings[FINDINGS_MAX];	/* Most recent first */
+
+/* The group being checked, if any. We hold a ref on its index. */
+static Index *check_index = NULL;
+static Element *check_group = NULL;
+static Element *check_item = NULL;	/* Next item to check */
+static char check_dir[MAX_PATH_LEN];	/* The group's, cache-relative */
+
+/* The file being hashed, if any */
+static Element *hash_item = NULL;
+static int hash_fd = -1;
+static Digest *hash_digest = NULL;
+static const char *hash_expected = NULL;
+
+/* Remember that 'path' is damaged, because of 'problem' */
+static void note_finding(const char *path, const char *problem)
+{
+	char *finding;
+
+	error("Scrub: '%s' is damaged (%s); quarantining its group",
+			path, problem);
+	damaged++;
+
+	finding = build_string("%s: %s", path, problem);
+	if (!finding)
+		return;
+	if (findings[FINDINGS_MAX - 1])
+		free(findings[FINDINGS_MAX - 1]);
+	memmove(findings + 1, findings,
+		(FINDINGS_MAX - 1) * sizeof(char *));
+	findings[0] = finding;
+}
+
+/* Move the cached files of 'group' (in the cache-relative directory 'dir')
+ * into a new quarantine directory, and drop the group from the catalog.
+ */
+static void quarantine(const char *dir, Element *group)
+{
+	static int n = 0;
+	char qdir[MAX_PATH_LEN];
+	Element *item;
+	FILE *origin;
+	int len;
+
+	len = snprintf(qdir, sizeof(qdir), "%s/" QUARANTINE_DIR, cache_dir);
+	if (!ensure_dir(qdir))
+		return;
+	snprintf(qdir + len, sizeof(qdir) - len, "/%ld-%d",
+			(long) time(NULL), n++);
+	if (!ensure_dir(qdir))
+		return;
+
+	/* Say where they came from */
+	len = strlen(qdir);
+	snprintf(qdir + len, sizeof(qdir) - len, "/.origin");
+	origin = fopen(qdir, "w");
+	if (origin) {
+		fprintf(origin, "%s %s\n", dir,
+				xml_get_attr(group, "MD5sum"));
+		fclose(origin);
+	}
+	qdir[len] = '\0';
+
+	for (item = group->lastChild; item; item = item->previousSibling) {
+		char src[MAX_PATH_LEN], dst[MAX_PATH_LEN];
+		const char *leaf;
+
+		if (item->name[0] == 'a')
+			continue;
+		leaf = xml_get_attr(item, "name");
+		if (snprintf(src, sizeof(src), "%s%s/%s", cache_dir, dir,
+			     leaf) >= sizeof(src) ||
+		    snprintf(dst, sizeof(dst), "%s/%s", qdir, leaf) >=
+			     sizeof(dst))
+			continue;
+		if (rename(src, dst) && errno != ENOENT)
+			error("rename '%s': %m", src);
+	}
+
+	catalog_group_removed(dir, group);
+}
+
+/* Stop hashing the current file */
+static void hash_stop(void)
+{
+	if (hash_fd != -1)
+		my_close(hash_fd);
+	if (hash_digest)
+		digest_final(hash_digest, NULL);
+	hash_fd = -1;
+	hash_digest = NULL;
+	hash_item = NULL;
+}
+
+/* Finished with the current group (or giving up on it until next time) */
+static void group_done(void)
+{
+	hash_stop();
+	if (check_index)
+		index_free(check_index);
+	check_index = NULL;
+	check_group = NULL;
+	check_item = NULL;
+}
+
+/* Start checking the cached files of the group with catalog record 'g' */
+static void group_start(CatalogGroup *g)
+{
+	if (snprintf(check_dir, sizeof(check_dir), "/%s",
+		     catalog_site_name(g)) >= sizeof(check_dir))
+		return;
+
+	check_index = get_index(check_dir, NULL, 0);
+	if (!check_index)
+		return;
+
+	/* If it's not in the index any more, GC will deal with it. If
+	 * something is unpacking there, check it next time.
+	 */
+	check_group = catalog_find_group(g, index_get_root(check_index),
+					 check_dir);
+	if (!check_group || gc_dir_busy(check_dir)) {
+		group_done();
+		return;
+	}
+
+	groups_checked++;
+	check_item = check_group->lastChild;
+}
+
+/* The group's file 'item' is damaged. Quarantine the group and fetch it
+ * again.
+ */
+static void group_damaged(Element *item, const char *problem)
+{
+	char path[MAX_PATH_LEN];
+
+	if (snprintf(path, sizeof(path), "%s/%s", check_dir,
+		     xml_get_attr(item, "name")) >= sizeof(path)) {
+		group_done();
+		return;
+	}
+
+	note_finding(path, problem);
+	hash_stop();
+	quarantine(check_dir, check_group);
+	prefetch_path(path, check_index);
+	group_done();
+}
+
+/* Check the type, size and mtime of the group's file 'item', and start
+ * hashing it if the index gives its digest. Returns the problem, if any.
+ */
+static const char *file_start(Element *item)
+{
+	const DigestAlgorithm *algo;
+	char full[MAX_PATH_LEN];
+	struct stat info;
+
+	if (snprintf(full, sizeof(full), "%s%s/%s", cache_dir, check_dir,
+		     xml_get_attr(item, "name")) >= sizeof(full))
+		return NULL;
+
+	if (lstat(full, &info)) {
+		if (errno != ENOENT)
+			return "can't stat";
+		return NULL;	/* Missing files are just fetched when needed */
+	}
+	if (!S_ISREG(info.st_mode))
+		return "not a regular file";
+	if (info.st_size != atol(xml_get_attr(item, "size")))
+		return "wrong size";
+	if (info.st_mtime != atol(xml_get_attr(item, "mtime")))
+		return "wrong mtime";
+
+	for (algo = digest_algorithms; algo->name; algo++) {
+		hash_expected = xml_get_attr(item, algo->name);
+		if (hash_expected)
+			break;
+	}
+	if (!algo->name)
+		return NULL;
+
+	hash_fd = open(full, O_RDONLY);
+	if (hash_fd == -1)
+		return "can't open";
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(hash_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	hash_digest = digest_new(algo);
+	if (!hash_digest)
+		hash_stop();	/* OOM; skip it */
+	else
+		hash_item = item;
+
+	return NULL;
+}
+
+/* The whole of the file being hashed has been read. Returns the problem,
+ * if any.
+ */
+static const char *file_end(void)
+{
+	char hex[DIGEST_MAX_SIZE * 2 + 1];
+	char full[MAX_PATH_LEN];
+	struct stat now, then;
+
+	digest_final(hash_digest, hex);
+	hash_digest = NULL;
+
+	/* If it was replaced while we were reading it, the old copy doesn't
+	 * matter any more.
+	 */
+	if (snprintf(full, sizeof(full), "%s%s/%s", cache_dir, check_dir,
+		     xml_get_attr(hash_item, "name")) >= sizeof(full) ||
+	    fstat(hash_fd, &then) || lstat(full, &now) ||
+	    now.st_ino != then.st_ino || now.st_dev != then.st_dev)
+		return NULL;
+
+	return strcmp(hex, hash_expected) == 0 ? NULL : "wrong checksum";
+}
+
+/* Carry on checking the current group, reading up to 'max' bytes.
+ * Returns the number of bytes read.
+ */
+static long check_some(long max)
+{
+	static unsigned char *buffer = NULL;
+	long bytes = 0;
+
+	if (!check_index)
+		return 0;
+
+	if (!buffer) {
+		buffer = my_malloc(DIGEST_READ_SIZE);
+		if (!buffer) {
+			group_done();
+			return 0;
+		}
+	}
+
+	/* Something may have started unpacking there since the last step */
+	if (gc_dir_busy(check_dir)) {
+		group_done();
+		return 0;
+	}
+
+	while (check_index && bytes < max) {
+		Element *item = hash_item;
+		const char *problem = NULL;
+		int got;
+
+		if (hash_fd == -1) {
+			item = check_item;
+			if (!item) {
+				group_done();
+				break;
+			}
+			check_item = item->previousSibling;
+			if (item->name[0] != 'a')
+				problem = file_start(item);
+		} else {
+			got = read(hash_fd, buffer, DIGEST_READ_SIZE);
+			if (got > 0) {
+				digest_update(hash_digest, buffer, got);
+				bytes += got;
+				continue;
+			}
+			problem = got < 0 ? "can't read" : file_end();
+			hash_stop();
+		}
+
+		if (problem)
+			group_damaged(item, problem);
+	}
+
+	bytes_checked += bytes;
+	return bytes;
+}
+
+/* Delete quarantined files older than QUARANTINE_DAYS */
+static void purge_quarantine(void)
+{
+	char path[MAX_PATH_LEN];
+	struct dirent *ent;
+	struct stat info;
+	time_t old = time(NULL) - QUARANTINE_DAYS * 24 * 60 * 60;
+	DIR *dir;
+	int len;
+
+	len = snprintf(path, sizeof(path), "%s/" QUARANTINE_DIR, cache_dir);
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		if (snprintf(path + len, sizeof(path) - len, "/%s",
+			     ent->d_name) >= sizeof(path) - len)
+			continue;
+		if (lstat(path, &info) == 0 && info.st_mtime < old)
+			remove_tree(path);
+	}
+	closedir(dir);
+}
+
+static void end_pass(void)
+{
+	syslog(LOG_INFO, "Scrub: checked %ld groups (%ld bytes); "
+			"%ld damaged so far", groups_checked, bytes_checked,
+			damaged);
+
+	purge_quarantine();
+
+	cursor = 0;
+	groups_checked = 0;
+	bytes_checked = 0;
+}
+
+static void scrub_step(void *data)
+{
+	struct timeval start, end;
+	CatalogGroup *g;
+	Task *task;
+	long bytes, ms, delay;
+
+	scrub_timer = NULL;
+
+	if (!scrub_rate)
+		return;		/* Turned off */
+
+	/* Keep out of the way of downloads */
+	for (task = all_tasks; task; task = task->next) {
+		if (task->child_pid != -1) {
+			scrub_timer = timer_add(SCRUB_BUSY_MS, scrub_step, NULL);
+			return;
+		}
+	}
+
+	if (!check_index) {
+		g = catalog_next(&cursor);
+		if (!g) {
+			end_pass();
+			scrub_timer = timer_add(SCRUB_PERIOD * 1000,
+						scrub_step, NULL);
+			return;
+		}
+		group_start(g);
+	}
+
+	gettimeofday(&start, NULL);
+	bytes = check_some(SCRUB_STEP_BYTES);
+	gettimeofday(&end, NULL);
+	ms = (end.tv_sec - start.tv_sec) * 1000 +
+	     (end.tv_usec - start.tv_usec) / 1000;
+
+	/* Stay within both budgets */
+	delay = bytes / 1024 * 1000 / scrub_rate;
+	if (scrub_cpu < 100 && ms * (100 - scrub_cpu) / scrub_cpu > delay)
+		delay = ms * (100 - scrub_cpu) / scrub_cpu;
+	if (delay < SCRUB_STEP_MS)
+		delay = SCRUB_STEP_MS;
+
+	scrub_timer = timer_add(delay, scrub_step, NULL);
+}
+
+/* Start scrubbing in the background, unless turned off */
+void scrub_init(void)
+{
+	if (scrub_cpu < 1)
+		scrub_cpu = 1;
+	if (scrub_rate && !scrub_timer)
+		scrub_timer = timer_add(scrub_start * 1000, scrub_step, NULL);
+}
+
+/* Start the first pass after 'seconds' instead (for testing) */
+void scrub_set_start(int seconds)
+{
+	scrub_start = seconds;
+}
+
+/* Get the progress of the current pass (percent), the groups and bytes
+ * checked so far, the number of damaged groups found since we started,
+ * and the most recent problems ('recent', 'n_recent'; don't free them).
+ */
+void scrub_status(int *percent, long *groups, long *bytes, long *n_damaged,
+		  char ***recent, int *n_recent)
+{
+	*percent = (long) cursor * 100 / CATALOG_GROUPS;
+	*groups = groups_checked;
+	*bytes = bytes_checked;
+	*n_damaged = damaged;
+	*recent = findings;
+	for (*n_recent = 0; *n_recent < FINDINGS_MAX && findings[*n_recent];
+	     (*n_recent)++)
+		;
+}
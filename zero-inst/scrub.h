@@ -0,0 +1,4 @@
+void scrub_init(void);
+void scrub_set_start(int seconds);
+void scrub_status(int *percent, long *groups, long *bytes, long *n_damaged,
+		  char ***recent, int *n_recent);
@@ -0,0 +1,254 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Spans. To find out where the time went in a slow request, each step of
+ * handling it (the request as a whole, GPG checks, parsing indexes,
+ * downloads, digest checks, unpacking, moving files into place and
+ * writing ... files) can be recorded as a span: its name, start time,
+ * duration, task number, site and bytes.
+ *
+ * Spans go in a ring buffer of span_capacity entries, so only the most
+ * recent ones are kept. It is off (0) by default; --spans=N or the
+ * SetSpans control method (root only) turns it on. When off, recording a
+ * span costs one test.
+ *
+ * The DumpSpans control method (root only, since spans show every user's
+ * paths) returns the buffer in the Chrome trace event format (load it in
+ * chrome://tracing or Perfetto); SIGUSR2 writes it to .0inst-spans.json
+ * in the cache directory. Each task gets its own
+ * row; steps with no task (index checks) are on row 0.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "support.h"
+#include "zero-install.h"
+#include "task.h"
+#include "index.h"
+#include "spans.h"
+
+#define SPANS_FILE ".0inst-spans.json"
+#define SITE_LEN 64		/* Longer site names are cut short */
+#define SPANS_MAX 100000	/* Larger capacities are cut to this (~11M) */
+
+typedef struct _Span Span;
+
+struct _Span {
+	const char *name;	/* A constant string */
+	struct timeval start;
+	long us;		/* Duration */
+	int task;		/* Task number, or 0 */
+	long bytes;		/* -1 if not relevant */
+	char site[SITE_LEN];
+};
+
+static Span *ring = NULL;	/* NULL if off */
+static int next = 0;		/* Slot for the next span */
+static int used = 0;		/* Slots filled */
+
+/* Keep the 'capacity' most recent spans (0 turns recording off; at most
+ * SPANS_MAX), dropping any recorded so far. 0 on OOM.
+ */
+int spans_set_capacity(int capacity)
+{
+	Span *new = NULL;
+
+	if (capacity > SPANS_MAX)
+		capacity = SPANS_MAX;
+
+	if (capacity > 0) {
+		new = my_malloc(capacity * sizeof(Span));
+		if (!new)
+			return 0;
+	}
+
+	if (ring)
+		free(ring);
+	ring = new;
+	span_capacity = capacity > 0 ? capacity : 0;
+	next = 0;
+	used = 0;
+
+	return 1;
+}
+
+/* Record that step 'name' (a constant string) ran from 'start' until now,
+ * for 'task' (may be NULL), and concerned 'site' (NULL to use the task's
+ * index's site, if any) and 'bytes' (-1 if not relevant).
+ */
+void span_record(const char *name, Task *task, const char *site,
+		 const struct timeval *start, long bytes)
+{
+	struct timeval now;
+	Span *span;
+
+	if (!ring)
+		return;
+
+	if (!site && task && task->index)
+		site = task->index->site;
+
+	gettimeofday(&now, NULL);
+
+	span = &ring[next];
+	span->name = name;
+	span->start = *start;
+	span->us = (now.tv_sec - start->tv_sec) * 1000000L +
+		   (now.tv_usec - start->tv_usec);
+	span->task = task ? task->n : 0;
+	span->bytes = bytes;
+	if (site)
+		snprintf(span->site, sizeof(span->site), "%s", site);
+	else
+		span->site[0] = '\0';
+
+	next = (next + 1) % span_capacity;
+	if (used < span_capacity)
+		used++;
+}
+
+/* A growing string, for spans_export() */
+typedef struct {
+	char *data;
+	int len, size;
+	int failed;
+} Buffer;
+
+static void append(Buffer *buf, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	if (buf->failed)
+		return;
+
+	while (1) {
+		va_start(ap, format);
+		n = vsnprintf(buf->data + buf->len, buf->size - buf->len,
+			      format, ap);
+		va_end(ap);
+
+		if (n < buf->size - buf->len)
+			break;
+
+		buf->size = (buf->size + n) * 2;
+		buf->data = realloc(buf->data, buf->size);
+		if (!buf->data) {
+			error("Out of memory");
+			buf->failed = 1;
+			return;
+		}
+	}
+
+	buf->len += n;
+}
+
+/* Add 'str' as a JSON string */
+static void append_string(Buffer *buf, const char *str)
+{
+	append(buf, "\"");
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			append(buf, "\\%c", *str);
+		else if ((unsigned char) *str < ' ')
+			append(buf, "\\u%04x", *str);
+		else
+			append(buf, "%c", *str);
+	}
+	append(buf, "\"");
+}
+
+/* Returns the recorded spans, oldest first, as Chrome trace event JSON.
+ * free() the result. NULL on OOM.
+ */
+char *spans_export(void)
+{
+	Buffer buf = {NULL, 0, 0, 0};
+	int i;
+
+	append(&buf, "{\"traceEvents\":[");
+
+	for (i = 0; i < used; i++) {
+		Span *span = &ring[(next - used + i + span_capacity) %
+				   span_capacity];
+
+		append(&buf, "%s\n{\"name\":", i ? "," : "");
+		append_string(&buf, span->name);
+		append(&buf, ",\"cat\":\"0install\",\"ph\":\"X\","
+			"\"ts\":%ld%06ld,\"dur\":%ld,\"pid\":%ld,\"tid\":%d,"
+			"\"args\":{\"task\":%d",
+			(long) span->start.tv_sec, (long) span->start.tv_usec,
+			span->us, (long) getpid(), span->task, span->task);
+		if (span->site[0]) {
+			append(&buf, ",\"site\":");
+			append_string(&buf, span->site);
+		}
+		if (span->bytes >= 0)
+			append(&buf, ",\"bytes\":%ld", span->bytes);
+		append(&buf, "}}");
+	}
+
+	append(&buf, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	if (buf.failed)
+		return NULL;
+
+	return buf.data;
+}
+
+/* Write the recorded spans to .0inst-spans.json (on SIGUSR2) */
+void spans_dump(void)
+{
+	char *path = NULL, *tmp = NULL;
+	char *json = NULL;
+	FILE *out;
+
+	if (!ring) {
+		syslog(LOG_INFO, "Span recording is off (see --spans)");
+		return;
+	}
+
+	json = spans_export();
+	path = build_string("%s/" SPANS_FILE, cache_dir);
+	tmp = build_string("%s/" SPANS_FILE ".new", cache_dir);
+	if (!json || !path || !tmp)
+		goto out;
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		error("fopen(%s): %m", tmp);
+		goto out;
+	}
+	fputs(json, out);
+	if (fclose(out)) {
+		error("Writing %s: %m", tmp);
+		goto out;
+	}
+
+	if (rename(tmp, path))
+		error("rename(%s): %m", tmp);
+	else
+		syslog(LOG_INFO, "Wrote %d spans to '%s'", used, path);
+out:
+	if (json)
+		free(json);
+	if (path)
+		free(path);
+	if (tmp)
+		free(tmp);
+}
@@ -0,0 +1,5 @@
+int spans_set_capacity(int capacity);
+void span_record(const char *name, Task *task, const char *site,
+		 const struct timeval *start, long bytes);
+char *spans_export(void);
+void spans_dump(void);
@@ -0,0 +1,221 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* The status table. So that progress bars and 0status can watch what we're
+ * doing without sending us messages (or polling us), we keep a table of our
+ * tasks in .0inst-status in the cache directory, mapped into memory, and
+ * update it in place. The layout is in zero-status.h, and zero-status.c
+ * reads it.
+ *
+ * The table is rewritten every STATUS_MS while any task exists (and once
+ * more when the last one goes), so the cost doesn't depend on how often
+ * things happen. Each entry has its own sequence count, which is odd while
+ * we're changing it; a reader that sees it change just tries again.
+ *
+ * A new table is created (and renamed into place) each time we start, so
+ * readers of an old one never find it shrinking under them. Its pid is set
+ * once we've daemonized, and back to 0 when we stop; readers also check
+ * that the pid still exists, in case we were killed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "global.h"
+#include "support.h"
+#include "zero-install.h"
+#include "task.h"
+#include "timer.h"
+#include "zero-status.h"
+#include "status.h"
+
+#define STATUS_MS 250
+
+static ZeroStatusHeader *header = NULL;	/* NULL if we have no table */
+static ZeroStatusEntry *entries;
+static size_t map_len;
+static int used = 0;		/* Entries which may be in use */
+static Timer *status_timer = NULL;
+
+/* What 'task' is doing, as a ZERO_STATUS_* state */
+static int task_state(Task *task)
+{
+	if (task->flags & TASK_DOWNLOADING)
+		return ZERO_STATUS_DOWNLOADING;
+	if (task->flags & TASK_BATCHED)
+		return ZERO_STATUS_QUEUED;
+	if (task->child_task)
+		return ZERO_STATUS_WAITING;
+	if (task->child_pid != -1)
+		return ZERO_STATUS_UNPACKING;
+	return ZERO_STATUS_BUSY;
+}
+
+/* Replace entry 'i' with 'new' (whose seq is ignored). Readers retry if
+ * they see an odd sequence count, or a different one after reading.
+ */
+static void set_entry(int i, ZeroStatusEntry *new)
+{
+	ZeroStatusEntry *entry = &entries[i];
+	uint32_t seq = entry->seq;
+
+	new->seq = seq;
+	if (memcmp(entry, new, sizeof(ZeroStatusEntry)) == 0)
+		return;		/* Don't make readers retry for nothing */
+
+	entry->seq = seq + 1;
+	__sync_synchronize();
+	memcpy((char *) entry + sizeof(entry->seq),
+	       (char *) new + sizeof(new->seq),
+	       sizeof(ZeroStatusEntry) - sizeof(new->seq));
+	__sync_synchronize();
+	entry->seq = seq + 2;
+}
+
+/* Write every task into the table */
+static void publish(void)
+{
+	ZeroStatusEntry new;
+	Task *task;
+	int i = 0;
+
+	for (task = all_tasks; task && i < ZERO_STATUS_SLOTS; task = task->next) {
+		const char *path = task->str ? task->str : "";
+
+		if (strncmp(path, cache_dir, cache_dir_len) == 0)
+			path += cache_dir_len;
+
+		memset(&new, 0, sizeof(new));
+		new.state = task_state(task);
+		new.task = task->n;
+		new.waiting_for = task->child_task ? task->child_task->n : 0;
+		new.uid = task->type == TASK_KERNEL ||
+			  task->type == TASK_CLIENT ? task->uid : -1;
+		new.received = task->received;
+		new.size = task->size;
+		new.rate = task->rate;
+		if (task->flags & TASK_DOWNLOADING)
+			new.started = task->started.tv_sec;
+		strncpy(new.path, path, sizeof(new.path) - 1);
+
+		set_entry(i++, &new);
+	}
+
+	memset(&new, 0, sizeof(new));
+	for (; i < used; i++)
+		set_entry(i, &new);
+	used = i;
+
+	header->updated = time(NULL);
+}
+
+static void status_tick(void *data)
+{
+	status_timer = NULL;
+
+	publish();
+
+	if (all_tasks)
+		status_timer = timer_add(STATUS_MS, status_tick, NULL);
+}
+
+/* A task has been created or destroyed. Make sure the table gets updated
+ * soon.
+ */
+void status_changed(void)
+{
+	if (header && !status_timer)
+		status_timer = timer_add(STATUS_MS, status_tick, NULL);
+}
+
+/* Create a new, empty table and map it. Without one, we just don't
+ * publish anything.
+ */
+void status_init(void)
+{
+	char *path = NULL, *tmp = NULL;
+	void *map;
+	int fd = -1;
+
+	path = build_string("%s/" ZERO_STATUS_FILE, cache_dir);
+	tmp = build_string("%s/" ZERO_STATUS_FILE ".new", cache_dir);
+	if (!path || !tmp)
+		goto out;
+
+	map_len = sizeof(ZeroStatusHeader) +
+		  ZERO_STATUS_SLOTS * sizeof(ZeroStatusEntry);
+
+	unlink(tmp);
+	fd = open(tmp, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		error("open(%s): %m", tmp);
+		goto out;
+	}
+	if (ftruncate(fd, map_len)) {
+		error("ftruncate(%s): %m", tmp);
+		goto out;
+	}
+
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		error("mmap(%s): %m", tmp);
+		goto out;
+	}
+
+	header = map;
+	entries = (ZeroStatusEntry *) (header + 1);
+	header->version = ZERO_STATUS_VERSION;
+	header->slots = ZERO_STATUS_SLOTS;
+	header->entry_size = sizeof(ZeroStatusEntry);
+	header->pid = 0;	/* Set by status_start() */
+	header->updated = time(NULL);
+	__sync_synchronize();
+	header->magic = ZERO_STATUS_MAGIC;
+
+	if (rename(tmp, path)) {
+		error("rename(%s): %m", tmp);
+		munmap(map, map_len);
+		header = NULL;
+		unlink(tmp);
+	}
+out:
+	if (fd != -1)
+		close(fd);
+	if (path)
+		free(path);
+	if (tmp)
+		free(tmp);
+}
+
+/* We're running (as the final daemon process, if we forked) */
+void status_start(void)
+{
+	if (header)
+		header->pid = getpid();
+}
+
+/* Tell readers we've stopped */
+void status_close(void)
+{
+	if (!header)
+		return;
+
+	header->pid = 0;
+	munmap(header, map_len);
+	header = NULL;
+}
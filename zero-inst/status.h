@@ -0,0 +1,4 @@
+void status_init(void);
+void status_start(void);
+void status_changed(void);
+void status_close(void);
@@ -0,0 +1,314 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Content-addressed store (--dedup). Different sites, and successive
+ * versions of the same site, often contain identical files (libraries,
+ * icons, documentation). With dedup on, each file unpacked into the cache
+ * is also linked into cache_dir/.0inst-store, under a name made from its
+ * MD5 sum, its mtime and whether it's executable. If the same file is
+ * already there, the new copy is replaced by a hard link to the old one.
+ *
+ * When a file with its own MD5sum in the index is wanted and the store
+ * already has it, it is linked into place without downloading anything.
+ *
+ * The link count does the reference counting: an entry with only one link
+ * isn't used anywhere in the cache any longer, and store_scan() deletes it
+ * (GC does this at the end of each pass).
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include "global.h"
+#include "support.h"
+#include "zero-install.h"
+#include "xml.h"
+#include "catalog.h"
+#include "digest.h"
+#include "store.h"
+
+#define STORE_DIR ".0inst-store"
+#define LINK_TMP ".0inst-link"	/* New links are made here, then renamed */
+
+/* 1 if 'md5' is a hex MD5 sum (and so safe to use in a file name) */
+static int valid_md5(const char *md5)
+{
+	return strlen(md5) == 32 &&
+	       strspn(md5, "0123456789abcdef") == 32;
+}
+
+/* Set 'path' (MAX_PATH_LEN) to the name of the store entry for a file
+ * with this MD5 sum and mtime. 0 if too long.
+ */
+static int entry_path(char *path, const char *md5, long mtime, int exec)
+{
+	return snprintf(path, MAX_PATH_LEN, "%s/" STORE_DIR "/%.2s/%s-%ld-%c",
+			cache_dir, md5, md5, mtime, exec ? 'x' : 'f')
+		< MAX_PATH_LEN;
+}
+
+/* 1 if files 'a' and 'b' have the same contents. An MD5 sum shouldn't be
+ * trusted to tell files from different sites apart.
+ */
+static int same_contents(const char *a, const char *b)
+{
+	char buf_a[4096], buf_b[4096];
+	FILE *fa, *fb;
+	int same = 0;
+
+	fa = fopen(a, "r");
+	if (!fa) {
+		error("fopen(%s): %m", a);
+		return 0;
+	}
+	fb = fopen(b, "r");
+	if (!fb) {
+		error("fopen(%s): %m", b);
+		fclose(fa);
+		return 0;
+	}
+
+	while (1) {
+		size_t got_a, got_b;
+
+		got_a = fread(buf_a, 1, sizeof(buf_a), fa);
+		got_b = fread(buf_b, 1, sizeof(buf_b), fb);
+		if (got_a != got_b || memcmp(buf_a, buf_b, got_a) != 0)
+			break;
+		if (got_a < sizeof(buf_a)) {
+			same = !ferror(fa) && !ferror(fb);
+			break;
+		}
+	}
+
+	fclose(fa);
+	fclose(fb);
+
+	return same;
+}
+
+/* Replace 'path' with a hard link to 'entry'. 1 on success. */
+static int link_over(const char *entry, const char *path)
+{
+	char *tmp;
+	int ok = 0;
+
+	tmp = build_string("%d/" LINK_TMP, path);
+	if (!tmp)
+		return 0;
+
+	if (unlink(tmp) && errno != ENOENT)
+		error("unlink(%s): %m", tmp);
+
+	if (link(entry, tmp)) {
+		error("link(%s): %m", entry);
+		goto out;
+	}
+
+	if (rename(tmp, path)) {
+		error("rename: %m");
+		unlink(tmp);
+		goto out;
+	}
+
+	ok = 1;
+out:
+	free(tmp);
+	return ok;
+}
+
+/* 'path' is a newly unpacked file, with details 'info', which has already
+ * been checked against the index. 'md5' is its MD5 sum, if known (NULL
+ * otherwise). If the store has the same file, make 'path' a link to it;
+ * otherwise, add 'path' to the store.
+ */
+void store_add(const char *path, struct stat *info, const char *md5)
+{
+	char entry[MAX_PATH_LEN];
+	struct stat old;
+	char *real = NULL;
+	char *dir = NULL, *slash;
+	int ok;
+
+	if (!dedup)
+		return;
+
+	if (!md5) {
+		real = digest_file(path, digest_find("MD5sum"));
+		if (!real)
+			return;
+		md5 = real;
+	}
+
+	if (!valid_md5(md5) ||
+	    !entry_path(entry, md5, info->st_mtime, info->st_mode & 0111))
+		goto out;
+
+	if (lstat(entry, &old) == 0) {
+		if (old.st_dev == info->st_dev && old.st_ino == info->st_ino)
+			goto out;	/* Already shared */
+
+		if (S_ISREG(old.st_mode) && old.st_size == info->st_size &&
+		    same_contents(entry, path)) {
+			if (link_over(entry, path) && verbose)
+				syslog(LOG_DEBUG, "Sharing '%s'", entry);
+			goto out;
+		}
+
+		/* Damaged, or a different file with the same MD5 sum. Either
+		 * way, the new one takes its place.
+		 */
+		if (unlink(entry)) {
+			error("unlink(%s): %m", entry);
+			goto out;
+		}
+	} else if (errno != ENOENT) {
+		error("lstat(%s): %m", entry);
+		goto out;
+	}
+
+	/* Make the store and the bucket directories, as needed */
+	dir = build_string("%d", entry);
+	if (!dir)
+		goto out;
+	slash = strrchr(dir, '/');
+	*slash = '\0';
+	ok = ensure_dir(dir);
+	*slash = '/';
+	if (!ok || !ensure_dir(dir))
+		goto out;
+
+	if (link(path, entry))
+		error("link(%s): %m", entry);
+out:
+	if (real)
+		free(real);
+	if (dir)
+		free(dir);
+}
+
+/* 'file' is the cache-relative path of 'item'. If the index gives the
+ * item's MD5 sum and the store has it, link it into place. 1 on success.
+ */
+int store_fetch_file(const char *file, Element *item)
+{
+	char entry[MAX_PATH_LEN];
+	struct stat info;
+	const char *md5;
+	char *path, *dir = NULL;
+	int ok = 0;
+
+	if (!dedup)
+		return 0;
+
+	md5 = xml_get_attr(item, "MD5sum");
+	if (!md5 || !valid_md5(md5) ||
+	    !entry_path(entry, md5, atol(xml_get_attr(item, "mtime")),
+			item->name[0] == 'e'))
+		return 0;
+
+	if (lstat(entry, &info) || !S_ISREG(info.st_mode) ||
+	    info.st_size != atol(xml_get_attr(item, "size")))
+		return 0;
+
+	/* Another copy may have been damaged since it was stored */
+	if (!digest_check_file(entry, digest_find("MD5sum"), md5)) {
+		error("Stored copy '%s' is damaged; removing", entry);
+		if (unlink(entry))
+			error("unlink(%s): %m", entry);
+		return 0;
+	}
+
+	path = build_string("%s%s", cache_dir, file);
+	if (!path)
+		return 0;
+
+	if (link_over(entry, path)) {
+		syslog(LOG_INFO, "Using stored copy of '%s'", file);
+		dir = build_string("%d", file);
+		if (dir)
+			catalog_file_cached(dir, item);
+		ok = 1;
+	}
+
+	free(path);
+	if (dir)
+		free(dir);
+
+	return ok;
+}
+
+/* Go through the store, counting the entries, the bytes they use, and the
+ * bytes saved by sharing them. If 'prune' is set, entries which are no
+ * longer used anywhere in the cache are deleted first.
+ */
+void store_scan(int prune, long *entries, long *bytes, long *saved)
+{
+	char path[MAX_PATH_LEN];
+	DIR *top, *bucket;
+	struct dirent *ent, *item;
+	struct stat info;
+	int len;
+
+	*entries = *bytes = *saved = 0;
+
+	len = snprintf(path, sizeof(path), "%s/" STORE_DIR, cache_dir);
+	top = opendir(path);
+	if (!top)
+		return;		/* Nothing stored yet */
+
+	while ((ent = readdir(top))) {
+		int bucket_len;
+
+		if (ent->d_name[0] == '.')
+			continue;
+		bucket_len = snprintf(path + len, sizeof(path) - len,
+				      "/%s", ent->d_name) + len;
+		bucket = opendir(path);
+		if (!bucket)
+			continue;
+
+		while ((item = readdir(bucket))) {
+			if (item->d_name[0] == '.')
+				continue;
+			if (snprintf(path + bucket_len,
+				     sizeof(path) - bucket_len, "/%s",
+				     item->d_name) >= sizeof(path) - bucket_len)
+				continue;
+			if (lstat(path, &info) || !S_ISREG(info.st_mode))
+				continue;
+
+			if (prune && info.st_nlink == 1) {
+				if (unlink(path))
+					error("unlink(%s): %m", path);
+				continue;
+			}
+
+			(*entries)++;
+			*bytes += info.st_size;
+			if (info.st_nlink > 2)
+				*saved += info.st_size * (info.st_nlink - 2);
+		}
+		closedir(bucket);
+
+		path[bucket_len] = '\0';
+		if (prune)
+			rmdir(path);	/* Only works if now empty */
+		path[len] = '\0';
+	}
+	closedir(top);
+}
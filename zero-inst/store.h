@@ -0,0 +1,3 @@
+void store_add(const char *path, struct stat *info, const char *md5);
+int store_fetch_file(const char *file, Element *item);
+void store_scan(int prune, long *entries, long *bytes, long *saved);
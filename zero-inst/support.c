@@ -7,6 +7,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <dirent.h>
 
 #include "global.h"
 #include "support.h"
@@ -91,295 +92,74 @@ int ensure_dir(const char *path)
 	return 1;
 }
 
-/* Set the close-on-exec flag for this FD.
- * TRUE means that an exec()'d process will not get the FD.
+/* Delete 'path' and everything under it (like 'rm -rf'). As a sanity
+ * check, 'path' must be inside cache_dir. Symlinks are removed, not followed.
+ * Returns 1 on success.
  */
-void close_on_exec(int fd, int close)
+int remove_tree(const char *path)
 {
-	if (fcntl(fd, F_SETFD, close)) {
-		error("fcntl() failed: %m");
+	struct stat info;
+	DIR *dir;
+	struct dirent *ent;
+	int ok = 1;
+
+	if (strncmp(path, cache_dir, cache_dir_len) != 0 ||
+	    path[cache_dir_len] != '/') {
+		error("'%s' is not in cache directory!", path);
 		exit(EXIT_FAILURE);
 	}
-}
-
-/*
- * This code implements the MD5 message-digest algorithm.
- * The algorithm is due to Ron Rivest. The original code was
- * written by Colin Plumb in 1993, and put in the public domain.
- * 
- * Modified to use glib datatypes. Put under GPL to simplify
- * licensing for Zero Install. Taken from Debian's dpkg package.
- */
-
-#define md5byte unsigned char
-
-static void MD5Transform(u_int32_t buf[4], u_int32_t const in[16]);
-
-typedef struct _MD5Context MD5Context;
-
-struct _MD5Context {
-	u_int32_t buf[4];
-	u_int32_t bytes[2];
-	u_int32_t in[16];
-};
-
-#if G_BYTE_ORDER == G_BIG_ENDIAN
-static void byteSwap(u_int32_t *buf, unsigned words)
-{
-	md5byte *p = (md5byte *)buf;
-
-	do {
-		*buf++ = (u_int32_t)((unsigned)p[3] << 8 | p[2]) << 16 |
-			((unsigned)p[1] << 8 | p[0]);
-		p += 4;
-	} while (--words);
-}
-#else
-#define byteSwap(buf,words)
-#endif
 
-/*
- * Start MD5 accumulation. Set bit count to 0 and buffer to mysterious
- * initialization constants.
- */
-static void MD5Init(MD5Context *ctx)
-{
-	ctx->buf[0] = 0x67452301;
-	ctx->buf[1] = 0xefcdab89;
-	ctx->buf[2] = 0x98badcfe;
-	ctx->buf[3] = 0x10325476;
-
-	ctx->bytes[0] = 0;
-	ctx->bytes[1] = 0;
-}
-
-/*
- * Update context to reflect the concatenation of another buffer full
- * of bytes.
- */
-static void MD5Update(MD5Context *ctx, md5byte const *buf, unsigned len)
-{
-	u_int32_t t;
-
-	/* Update byte count */
-
-	t = ctx->bytes[0];
-	if ((ctx->bytes[0] = t + len) < t)
-		ctx->bytes[1]++;	/* Carry from low to high */
-
-	t = 64 - (t & 0x3f);	/* Space available in ctx->in (at least 1) */
-	if (t > len) {
-		memcpy((md5byte *)ctx->in + 64 - t, buf, len);
-		return;
-	}
-	/* First chunk is an odd size */
-	memcpy((md5byte *)ctx->in + 64 - t, buf, t);
-	byteSwap(ctx->in, 16);
-	MD5Transform(ctx->buf, ctx->in);
-	buf += t;
-	len -= t;
-
-	/* Process data in 64-byte chunks */
-	while (len >= 64) {
-		memcpy(ctx->in, buf, 64);
-		byteSwap(ctx->in, 16);
-		MD5Transform(ctx->buf, ctx->in);
-		buf += 64;
-		len -= 64;
+	if (lstat(path, &info)) {
+		error("lstat(%s): %m", path);
+		return 0;
 	}
 
-	/* Handle any remaining bytes of data. */
-	memcpy(ctx->in, buf, len);
-}
-
-/*
- * Final wrapup - pad to 64-byte boundary with the bit pattern 
- * 1 0* (64-bit count of bits processed, MSB-first)
- * Returns the newly allocated string of the hash.
- */
-static char *MD5Final(MD5Context *ctx)
-{
-	char *retval;
-	int i;
-	int count = ctx->bytes[0] & 0x3f;	/* Number of bytes in ctx->in */
-	md5byte *p = (md5byte *)ctx->in + count;
-	u_int8_t	*bytes;
-
-	/* Set the first char of padding to 0x80.  There is always room. */
-	*p++ = 0x80;
-
-	/* Bytes of padding needed to make 56 bytes (-8..55) */
-	count = 56 - 1 - count;
-
-	if (count < 0) {	/* Padding forces an extra block */
-		memset(p, 0, count + 8);
-		byteSwap(ctx->in, 16);
-		MD5Transform(ctx->buf, ctx->in);
-		p = (md5byte *)ctx->in;
-		count = 56;
+	if (!S_ISDIR(info.st_mode)) {
+		if (unlink(path)) {
+			error("unlink(%s): %m", path);
+			return 0;
+		}
+		return 1;
 	}
-	memset(p, 0, count);
-	byteSwap(ctx->in, 14);
-
-	/* Append length in bits and transform */
-	ctx->in[14] = ctx->bytes[0] << 3;
-	ctx->in[15] = ctx->bytes[1] << 3 | ctx->bytes[0] >> 29;
-	MD5Transform(ctx->buf, ctx->in);
 
-	byteSwap(ctx->buf, 4);
-
-	retval = my_malloc(33);
-	bytes = (u_int8_t *) ctx->buf;
-	for (i = 0; i < 16; i++)
-		sprintf(retval + (i * 2), "%02x", bytes[i]);
-	retval[32] = '\0';
-	
-	return retval;
-}
+	dir = opendir(path);
+	if (!dir) {
+		error("opendir(%s): %m", path);
+		return 0;
+	}
 
-# ifndef ASM_MD5
+	while ((ent = readdir(dir))) {
+		char *child;
 
-/* The four core functions - F1 is optimized somewhat */
+		if (strcmp(ent->d_name, ".") == 0 ||
+		    strcmp(ent->d_name, "..") == 0)
+			continue;
 
-/* #define F1(x, y, z) (x & y | ~x & z) */
-#define F1(x, y, z) (z ^ (x & (y ^ z)))
-#define F2(x, y, z) F1(z, x, y)
-#define F3(x, y, z) (x ^ y ^ z)
-#define F4(x, y, z) (y ^ (x | ~z))
+		child = build_string("%s/%s", path, ent->d_name);
+		if (!child || !remove_tree(child))
+			ok = 0;
+		if (child)
+			free(child);
+	}
+	closedir(dir);
 
-/* This is the central step in the MD5 algorithm. */
-#define MD5STEP(f,w,x,y,z,in,s) \
-	 (w += f(x,y,z) + in, w = (w<<s | w>>(32-s)) + x)
+	if (ok && rmdir(path)) {
+		error("rmdir(%s): %m", path);
+		ok = 0;
+	}
 
-/*
- * The core of the MD5 algorithm, this alters an existing MD5 hash to
- * reflect the addition of 16 longwords of new data.  MD5Update blocks
- * the data and converts bytes into longwords for this routine.
- */
-static void MD5Transform(u_int32_t buf[4], u_int32_t const in[16])
-{
-	register u_int32_t a, b, c, d;
-
-	a = buf[0];
-	b = buf[1];
-	c = buf[2];
-	d = buf[3];
-
-	MD5STEP(F1, a, b, c, d, in[0] + 0xd76aa478, 7);
-	MD5STEP(F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
-	MD5STEP(F1, c, d, a, b, in[2] + 0x242070db, 17);
-	MD5STEP(F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
-	MD5STEP(F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
-	MD5STEP(F1, d, a, b, c, in[5] + 0x4787c62a, 12);
-	MD5STEP(F1, c, d, a, b, in[6] + 0xa8304613, 17);
-	MD5STEP(F1, b, c, d, a, in[7] + 0xfd469501, 22);
-	MD5STEP(F1, a, b, c, d, in[8] + 0x698098d8, 7);
-	MD5STEP(F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
-	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122, 7);
-	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-	MD5STEP(F2, a, b, c, d, in[1] + 0xf61e2562, 5);
-	MD5STEP(F2, d, a, b, c, in[6] + 0xc040b340, 9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[5] + 0xd62f105d, 5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453, 9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6, 9);
-	MD5STEP(F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
-	MD5STEP(F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
-	MD5STEP(F2, c, d, a, b, in[7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-	MD5STEP(F3, a, b, c, d, in[5] + 0xfffa3942, 4);
-	MD5STEP(F3, d, a, b, c, in[8] + 0x8771f681, 11);
-	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(F3, a, b, c, d, in[1] + 0xa4beea44, 4);
-	MD5STEP(F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
-	MD5STEP(F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
-	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
-	MD5STEP(F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
-	MD5STEP(F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
-	MD5STEP(F3, b, c, d, a, in[6] + 0x04881d05, 23);
-	MD5STEP(F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
-	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
-
-	MD5STEP(F4, a, b, c, d, in[0] + 0xf4292244, 6);
-	MD5STEP(F4, d, a, b, c, in[7] + 0x432aff97, 10);
-	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(F4, b, c, d, a, in[5] + 0xfc93a039, 21);
-	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3, 6);
-	MD5STEP(F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
-	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(F4, b, c, d, a, in[1] + 0x85845dd1, 21);
-	MD5STEP(F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
-	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(F4, c, d, a, b, in[6] + 0xa3014314, 15);
-	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(F4, a, b, c, d, in[4] + 0xf7537e82, 6);
-	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
-	MD5STEP(F4, b, c, d, a, in[9] + 0xeb86d391, 21);
-
-	buf[0] += a;
-	buf[1] += b;
-	buf[2] += c;
-	buf[3] += d;
+	return ok;
 }
 
-# endif /* ASM_MD5 */
-
-/* Calculate the MD5 sum for 'path' and compare it with 'md5'.
- * Returns 1 if they match, 0 if not.
+/* Set the close-on-exec flag for this FD.
+ * TRUE means that an exec()'d process will not get the FD.
  */
-int check_md5(const char *path, const char *md5)
+void close_on_exec(int fd, int close)
 {
-	char *real;
-	MD5Context ctx;
-	int retval;
-	char buffer[512];
-	int fd;
-
-	MD5Init(&ctx);
-
-	fd = open(path, O_RDONLY);
-	if (fd == -1) {
-		error("open: %m");
-		return 0;
-	}
-
-	while (1) {
-		int got;
-
-		got = read(fd, buffer, sizeof(buffer));
-		if (got < 0)
-			error("read: %m");
-		if (got <= 0)
-			break;
-		MD5Update(&ctx, buffer, got);
+	if (fcntl(fd, F_SETFD, close)) {
+		error("fcntl() failed: %m");
+		exit(EXIT_FAILURE);
 	}
-
-	if (close(fd))
-		error("close: %m");
-	
-	real = MD5Final(&ctx);
-
-	retval = strcmp(real, md5) == 0;
-	free(real);
-
-	return retval;
 }
 
 /* Like g_strdup_printf. Special characters are:
@@ -517,6 +297,38 @@ char *build_string(const char *format, ...)
 	return new;
 }
 
+/* Decode the base64 string 'in' into 'out', which must have room for
+ * strlen(in) * 3 / 4 bytes. Returns the number of bytes written, or -1 if
+ * 'in' isn't valid base64.
+ */
+int base64_decode(const char *in, unsigned char *out)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+				       "abcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned long bits = 0;
+	int n_bits = 0;
+	int len = 0;
+
+	for (; *in && *in != '='; in++) {
+		const char *c;
+
+		c = strchr(alphabet, *in);
+		if (!c)
+			return -1;
+		bits = (bits << 6) | (c - alphabet);
+		n_bits += 6;
+		if (n_bits >= 8) {
+			n_bits -= 8;
+			out[len++] = (bits >> n_bits) & 0xff;
+		}
+	}
+
+	while (*in == '=')
+		in++;
+
+	return *in ? -1 : len;
+}
+
 /* Close fd, if not -1. On error, aborts the program. */
 void my_close(int fd)
 {
@@ -20,6 +20,15 @@
 #include "task.h"
 #include "index.h"
 #include "control.h"
+#include "metrics.h"
+#include "spans.h"
+#include "log.h"
+#include "status.h"
+
+/* wget's exit status when the server sent an error response, rather than
+ * the connection failing.
+ */
+#define WGET_SERVER_ERROR 8
 
 Task *all_tasks = NULL;
 static int n = 0;
@@ -47,25 +56,37 @@ Task *task_new(TaskType type)
 	task->step = NULL;
 	task->data = NULL;
 	task->str = NULL;
+	task->mirror = NULL;
 	task->index = NULL;
 	task->size = -1;
+	task->received = 0;
+	task->rate = 0;
 	task->notify_on_end = 0;
+	task->flags = 0;
+	timerclear(&task->started);
 
 	task->next = all_tasks;
 	all_tasks = task;
 
-	if (verbose) {
-		syslog(LOG_DEBUG, "Created task %d (%s)", task->n,
-				type == TASK_KERNEL ? "kernel" :
-				type == TASK_CLIENT ? "client" :
-				type == TASK_INDEX ? "index" :
-				type == TASK_ARCHIVE ? "archive" :
-				"unknown");
-	}
+	status_changed();
+
+	log_task(SUB_TASK, LOG_DEBUG, task, NULL, "Created %s task",
+			task_type_name(type));
 
 	return task;
 }
 
+/* A short name for this type of task, for messages */
+const char *task_type_name(TaskType type)
+{
+	return type == TASK_KERNEL ? "kernel" :
+	       type == TASK_CLIENT ? "client" :
+	       type == TASK_INDEX ? "index" :
+	       type == TASK_ARCHIVE ? "archive" :
+	       type == TASK_SUBTASK ? "subtask" :
+	       "unknown";
+}
+
 /* Removes 'task' from all_tasks and calls the 'next' method on every task
  * that depends on this one. Finally, task is freed.
  */
@@ -73,9 +94,14 @@ void task_destroy(Task *task, const char *error)
 {
 	Task *t;
 
-	if (verbose)
-		syslog(LOG_DEBUG, "Finished task %d (%s)",
-				task->n, error ? error : "OK");
+	log_task(SUB_TASK, LOG_DEBUG, task, NULL, "Finished task (%s)",
+			error ? error : "OK");
+
+	if (task->type == TASK_KERNEL && timerisset(&task->started)) {
+		metrics_observe("zeroinstall_request_seconds", NULL,
+				metrics_seconds_since(&task->started));
+		span_record("request", task, NULL, &task->started, -1);
+	}
 
 	if (all_tasks == task) {
 		all_tasks = task->next;
@@ -91,6 +117,8 @@ void task_destroy(Task *task, const char *error)
 
 	task->next = NULL;
 
+	status_changed();
+
 	t = all_tasks;
 	while (t) {
 		if (t->child_task == task) {
@@ -113,16 +141,25 @@ void task_destroy(Task *task, const char *error)
 	task_set_string(task, NULL);
 	task_set_message(task, NULL, NULL);
 	task_set_index(task, NULL);
+	if (task->mirror)
+		free(task->mirror);
 	free(task);
 }
 
-/* Call 'next' on the task waiting for this pid */
-void task_process_done(pid_t pid, int success)
+/* Call 'next' on the task waiting for this pid, which exited with
+ * 'status' (from waitpid).
+ */
+void task_process_done(pid_t pid, int status)
 {
 	Task *t;
+	int success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
 
 	for (t = all_tasks; t; t = t->next) {
 		if (t->child_pid == pid) {
+			t->flags &= ~(TASK_DOWNLOADING | TASK_SERVER_ERROR);
+			if (WIFEXITED(status) &&
+			    WEXITSTATUS(status) == WGET_SERVER_ERROR)
+				t->flags |= TASK_SERVER_ERROR;
 #if 0
 			if (verbose)
 				syslog(LOG_DEBUG,
@@ -1,3 +1,5 @@
+#include <sys/time.h>
+
 extern Task *all_tasks;
 
 typedef enum {
@@ -5,11 +7,25 @@ typedef enum {
 	TASK_CLIENT,	/* Handles a request from 0refresh or similar */
 	TASK_INDEX,	/* Fetches a site index */
 	TASK_ARCHIVE,	/* Fetches an archive */
+	TASK_SUBTASK,	/* Waits for an archive for a TASK_CLIENT's job */
 } TaskType;
 
+/* Task flags */
+#define TASK_STREAMING 1	/* Archive is unpacked as it downloads */
+#define TASK_MEMBER 2		/* Fetches a single member of a seekable archive */
+#define TASK_BATCHED 4		/* Waiting to be fetched with other groups */
+#define TASK_BUNDLE 8		/* Fetches part of a pack for a batch */
+#define TASK_PREFETCH 16	/* Nothing asked for this yet (prefetch.c) */
+#define TASK_RECURSIVE 32	/* Client wants everything under task->str */
+#define TASK_DOWNLOADING 64	/* wget is running (cleared when it exits) */
+#define TASK_UPDATE_PENDING 128	/* Monitors haven't been told of child_task */
+#define TASK_SERVER_ERROR 256	/* wget got an error response (eg, 404) */
+#define TASK_OWN_LOG 512	/* wget logs to <task->str>.log (see fetch.c) */
+
 Task *task_new(TaskType type);
+const char *task_type_name(TaskType type);
 void task_destroy(Task *task, const char *error);
-void task_process_done(pid_t pid, int success);
+void task_process_done(pid_t pid, int status);
 void task_set_string(Task *task, const char *str);
 void task_set_index(Task *task, Index *index);
 void task_steal_index(Task *task, Index *index);
@@ -36,10 +52,16 @@ struct _Task {
 	uid_t uid;
 	int fd;
 	char *str;		/* Will be free()d */
+	char *mirror;		/* Base URI of the download, or NULL; free()d */
 	Index *index;		/* Will be unref'd */
 	long size;
+	long received;		/* Bytes downloaded so far */
+	long rate;		/* Recent download rate (bytes per second) */
+	struct timeval started;	/* When the request came (kernel) or the
+				 * download began (archives) */
 
 	int notify_on_end;
+	unsigned flags;		/* TASK_* bits above */
 
 	Task	*next;		/* In all_tasks */
 };
@@ -6,13 +6,14 @@ from os.path import realpath, basename, dirname, join
 import signal
 from server import Webserver
 from support import build
-from config import log, fs, cache, site
-import codecs
+from config import log, fs, cache, site, expiry
+import codecs, struct, random, binascii
 
 def to_utf8(s):
 	return codecs.utf_8_encode(s)[0]
 
 zero_install = join(dirname(dirname(realpath(sys.argv[0]))), 'zero-install')
+refresh = join(dirname(zero_install), '0refresh')
 
 print "Logging to logfile '%s'" % log.name
 assert os.path.exists(zero_install)
@@ -33,30 +34,105 @@ Please enter %u's password:"'''):
 
 sys.stdout = ThreadOut(log)
 
+def catalog_totals():
+	"""Returns (groups, bytes) from the header of the helper's catalog."""
+	data = file(join(cache, '.0inst-catalog')).read(32)
+	magic, dirty, groups, bytes = struct.unpack('=16siiq', data)
+	assert magic.startswith('0inst-catalog-1')
+	return groups, bytes
+
+def cached_bytes(dir):
+	"""Total size of the files (not ours) cached under 'dir'."""
+	total = 0
+	for path, dirs, files in os.walk(dir):
+		dirs[:] = [d for d in dirs if not d.startswith('.0inst-')]
+		for leaf in files:
+			if leaf == '...' or leaf.startswith('.0inst-'):
+				continue
+			total += os.lstat(join(path, leaf)).st_size
+	return total
+
+def status_pid():
+	"""The PID in the helper's status table (0 if it has stopped)."""
+	data = file(join(cache, '.0inst-status')).read(20)
+	return struct.unpack('=IIIIi', data)[4]
+
+def noise(seed, size):
+	"""'size' bytes that won't compress (the same each time for 'seed')."""
+	bits = random.Random(seed).getrandbits(size * 8)
+	return binascii.unhexlify('%0*x' % (size * 2, bits))
+
+def write_site_file(leaf, data):
+	if not os.path.isdir(dirname(join(site, leaf))):
+		os.makedirs(dirname(join(site, leaf)))
+	a = file(join(site, leaf), 'w')
+	a.write(data)
+	a.close()
+
+def cache_status(*paths):
+	"""Ask the helper (with 0refresh --status) whether each path is cached.
+	Returns a dictionary mapping each path to 'cached', 'missing',
+	'not found' or 'unknown site'."""
+	out = os.popen("%s --status %s" % (refresh,
+			' '.join(["'%s'" % p for p in paths])))
+	states = {}
+	for line in out:
+		path, state = line.strip().split(': ', 1)
+		states[path] = state.split(' (')[0]
+	out.close()
+	return states
+
 class TestSimple(lazyfs.LazyFSTest):
 	actors = (user, webserver)
 
 	def setUp(self):
 		lazyfs.LazyFSTest.setUp(self)
+		self.start_helper()
+		while not os.path.exists(join(cache, '.control2')):
+			print "Waiting..."
+			time.sleep(0.1)
+	
+	def tearDown(self):
+		self.stop_helper()
+		lazyfs.LazyFSTest.tearDown(self)
+
+	def start_helper(self, *args):
 		self.zero_pid = os.fork()
 		if self.zero_pid == 0:
 			os.dup2(log.fileno(), 1)
 			os.dup2(log.fileno(), 2)
 			try:
-				os.execl(zero_install, zero_install, '--debug')
+				os.execl(zero_install, zero_install, '--debug',
+					 *args)
 			finally:
 				os._exit(1)
-		while not os.path.exists(join(cache, '.control2')):
-			print "Waiting..."
-			time.sleep(0.1)
-	
-	def tearDown(self):
+
+	def stop_helper(self):
 		os.kill(self.zero_pid, signal.SIGTERM)
 		os.waitpid(self.zero_pid, 0)
-		lazyfs.LazyFSTest.tearDown(self)
+
+	def restart_helper(self, *args):
+		"""Replace the helper with a new one, run with extra 'args'."""
+		self.stop_helper()
+		self.start_helper(*args)
+		while status_pid() != self.zero_pid:
+			print "Waiting..."
+			time.sleep(0.1)
+
+	def assertFails(self, path):
+		self.assertNotEquals(0,
+			os.system("ls '%s' >/dev/null 2>&1" % path))
+
+	def assertFailsAtOnce(self, path):
+		"""Listing 'path' fails without waiting for a download."""
+		start = time.time()
+		self.assertFails(path)
+		taken = time.time() - start
+		self.assert_(taken < 1, "'%s' took %.1f seconds" % (path, taken))
 
 	def test01Nothing(self):
-		self.assertLs(['...', '.control2', '.0inst-pid'], cache)
+		self.assertLs(['...', '.control2', '.0inst-pid',
+			       '.0inst-catalog', '.0inst-status'], cache)
 	
 	def test02Fail(self):
 		"""Server refuses the connection. Client gets an IO error."""
@@ -80,12 +156,13 @@ class TestSimple(lazyfs.LazyFSTest):
 			webserver.handle_any('foo.com')	# The index.bz
 
 	def test04ReadFile(self):
+		data = 'World' * 400	# Too big to be inlined in the index
 		if user():
 			print join(fs, 'foo.com')
 			self.assertLs(['hello'], join(fs, 'foo.com'))
 		if webserver():
 			a = file(join(site, 'hello'), 'w')
-			a.write('World')
+			a.write(data)
 			a.close()
 			build('foo.com')
 			webserver.handle_index('foo.com')
@@ -94,7 +171,7 @@ class TestSimple(lazyfs.LazyFSTest):
 		self.sync()
 
 		if user():
-			self.assertEquals('World', file(join(fs, 'foo.com/hello')).read())
+			self.assertEquals(data, file(join(fs, 'foo.com/hello')).read())
 		if webserver():
 			webserver.handle_any('foo.com')	# The file
 	
@@ -159,6 +236,377 @@ class TestSimple(lazyfs.LazyFSTest):
 		   "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa")
 
 
+	def test07Catalog(self):
+		"""The catalog agrees with what is on the disk."""
+		data = 'World' * 400	# Too big to be inlined in the index
+		if user():
+			self.assertEquals((0, 0), catalog_totals())
+			self.assertLs(['hello'], join(fs, 'foo.com'))
+		if webserver():
+			a = file(join(site, 'hello'), 'w')
+			a.write(data)
+			a.close()
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+		self.sync()
+
+		if user():
+			self.assertEquals(data, file(join(fs, 'foo.com/hello')).read())
+			self.assertEquals((1, len(data)), catalog_totals())
+			self.assertEquals(len(data), cached_bytes(join(cache, 'foo.com')))
+		if webserver():
+			webserver.handle_any('foo.com')	# The file
+
+	def test08StatusTable(self):
+		"""The status table names the running helper."""
+		data = file(join(cache, '.0inst-status')).read(24)
+		magic, version, slots, entry_size, pid = \
+			struct.unpack('=IIIIi', data[:20])
+		self.assertEquals(0x3069734c, magic)
+		self.assertEquals(1, version)
+		self.assertEquals(self.zero_pid, pid)
+
+	def test09StatusMissingPath(self):
+		"""A path known to be missing is "not found", not "unknown site"."""
+		hello = join(fs, 'foo.com/hello')
+		missing = join(fs, 'foo.com/missing')
+		if user():
+			self.assertLs(['hello'], join(fs, 'foo.com'))
+			# The helper now remembers that 'missing' is missing
+			assert not os.path.exists(missing)
+			self.assertEquals({hello: 'missing', missing: 'not found'},
+					  cache_status(hello, missing))
+		if webserver():
+			a = file(join(site, 'hello'), 'w')
+			a.write('World' * 400)
+			a.close()
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+	def test10Offline(self):
+		"""Offline, nothing is fetched and requests fail at once."""
+		if user():
+			self.restart_helper('--offline')
+			self.assertFailsAtOnce(join(fs, 'foo.com'))
+
+	def test11Breaker(self):
+		"""After three failures in a row, a site isn't tried again until
+		the cool-down is over. Then a probe gets through."""
+		for i in range(3):
+			if user():
+				self.assertFails(join(fs, 'foo.com'))
+			if webserver():
+				webserver.reject('foo.com')
+			self.sync()
+
+		if user():
+			self.assertFailsAtOnce(join(fs, 'foo.com'))
+			time.sleep(expiry + 1)
+			self.assertLs(['hello'], join(fs, 'foo.com'))
+		if webserver():
+			write_site_file('hello', 'World')
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+	def test12NegativeExpiry(self):
+		"""If the server says a site has no index, it isn't asked again
+		until the negative result expires."""
+		if user():
+			self.assertFails(join(fs, 'foo.com'))
+		if webserver():
+			webserver.not_found('foo.com')
+
+		self.sync()
+
+		if user():
+			self.assertFailsAtOnce(join(fs, 'foo.com'))
+			time.sleep(expiry + 1)
+			self.assertLs(['hello'], join(fs, 'foo.com'))
+		if webserver():
+			write_site_file('hello', 'World')
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+	def test13CacheStatus(self):
+		"""CacheStatus answers from the cache, without fetching."""
+		data = 'World' * 400	# Too big to be inlined in the index
+		hello = join(fs, 'foo.com/hello')
+		missing = join(fs, 'foo.com/missing')
+		other = join(fs, 'bar.com/hello')
+		if user():
+			self.assertEquals({hello: 'unknown site'},
+					  cache_status(hello))
+			self.assertLs(['hello'], join(fs, 'foo.com'))
+			self.assertEquals({hello: 'missing', missing: 'not found',
+					   other: 'unknown site'},
+					  cache_status(hello, missing, other))
+		if webserver():
+			write_site_file('hello', data)
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+		self.sync()
+
+		if user():
+			self.assertEquals(data, file(hello).read())
+			self.assertEquals({hello: 'cached'}, cache_status(hello))
+		if webserver():
+			webserver.handle_any('foo.com')	# The file
+
+	def test14RefreshAll(self):
+		"""0refresh --all fetches a new index for every cached site."""
+		if user():
+			self.assertLs(['hello'], join(fs, 'foo.com'))
+		if webserver():
+			write_site_file('hello', 'World')
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+		self.sync()
+
+		if user():
+			out = os.popen('%s --all' % refresh)
+			self.assertEquals(['foo.com: OK\n'], out.readlines())
+			self.assertEquals(None, out.close())
+			self.assertLs(['hello', 'world'], join(fs, 'foo.com'))
+		if webserver():
+			write_site_file('world', 'Hello')
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+	def test15InlineFile(self):
+		"""Small files come with the index; there's nothing to fetch."""
+		if user():
+			self.assertLs(['hello'], join(fs, 'foo.com'))
+			self.assertEquals('World', file(join(fs, 'foo.com/hello')).read())
+		if webserver():
+			write_site_file('hello', 'World')
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+	def test16GroupsInOneDir(self):
+		"""Two groups in the same directory, fetched and unpacked at
+		the same time."""
+		hello = 'World' * 400
+		debug = 'Debug' * 400	# In a group of its own
+		if user():
+			self.assertLs(['hello', 'hello.debug'], join(fs, 'foo.com'))
+			a = os.popen("cat '%s'" % join(fs, 'foo.com/hello'))
+			b = os.popen("cat '%s'" % join(fs, 'foo.com/hello.debug'))
+			self.assertEquals(hello, a.read())
+			self.assertEquals(debug, b.read())
+			self.assertEquals(None, a.close())
+			self.assertEquals(None, b.close())
+		if webserver():
+			write_site_file('hello', hello)
+			write_site_file('hello.debug', debug)
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+			webserver.handle_many('foo.com', 2)	# Both archives
+
+	def test17SingleMember(self):
+		"""With a seekable archive, one file from a big group is fetched
+		by itself with a Range request."""
+		names = ['a', 'b', 'c', 'd']
+		if user():
+			self.assertLs(names, join(fs, 'foo.com'))
+			self.assertEquals(noise('a', 32 * 1024),
+				file(join(fs, 'foo.com/a')).read())
+			b = join(fs, 'foo.com/b')
+			self.assertEquals({b: 'missing'}, cache_status(b))
+		if webserver():
+			for name in names:
+				write_site_file(name, noise(name, 32 * 1024))
+			build('foo.com', '--seekable')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+			webserver.handle_range('foo.com')	# Just 'a'
+
+	def test18Pack(self):
+		"""Groups fetched together come out of the site's pack with a
+		single Range request."""
+		if user():
+			self.assertLs(['a', 'b'], join(fs, 'foo.com'))
+		if webserver():
+			write_site_file('a/data', 'World' * 400)
+			write_site_file('b/data', 'Hello' * 400)
+			build('foo.com', '--pack')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+		self.sync()
+
+		if user():
+			out = os.popen('%s --prefetch foo.com' % refresh)
+			self.assertEquals('OK\n', out.readlines()[-1])
+			self.assertEquals(None, out.close())
+			self.assertEquals('World' * 400,
+				file(join(fs, 'foo.com/a/data')).read())
+			self.assertEquals('Hello' * 400,
+				file(join(fs, 'foo.com/b/data')).read())
+		if webserver():
+			path = webserver.handle_range('foo.com')	# Both groups
+			self.assert_(path.endswith('.pack'), path)
+
+	def test19Evict(self):
+		"""Over --max-cache, the least recently used groups are evicted,
+		but not while a download is in progress."""
+		size = 600 * 1024
+		paths = [join(fs, 'foo.com/%s/data' % d) for d in 'abc']
+		if user():
+			self.assertEquals(noise('a', size), file(paths[0]).read())
+		if webserver():
+			for d in 'abc':
+				write_site_file(d + '/data', noise(d, size))
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+			webserver.handle_any('foo.com')	# a
+
+		self.sync()
+
+		if user():
+			self.assertEquals(noise('b', size), file(paths[1]).read())
+			self.restart_helper('--max-cache=1')
+			c = os.popen("cat '%s'" % paths[2])
+		if webserver():
+			conn, path, byte_range = webserver.accept_any('foo.com')
+
+		self.sync()
+
+		if user():
+			time.sleep(6)	# GC is waiting for c's download
+			self.assertEquals({paths[0]: 'cached', paths[1]: 'cached'},
+					  cache_status(*paths[:2]))
+
+		self.sync()
+
+		if user():
+			self.assertEquals(noise('c', size), c.read())
+			self.assertEquals(None, c.close())
+			for i in range(60):
+				if catalog_totals()[1] <= 1024 * 1024:
+					break
+				print "Waiting..."
+				time.sleep(1)
+			self.assertEquals({paths[0]: 'missing', paths[1]: 'missing',
+					   paths[2]: 'cached'}, cache_status(*paths))
+		if webserver():
+			webserver.reply(conn, path)	# c
+
+	def test20Orphans(self):
+		"""Files which are no longer in the site's index are removed."""
+		hello = join(cache, 'foo.com/hello')
+		old = join(cache, 'foo.com/old')
+		junk = join(cache, 'foo.com/junk')
+		if user():
+			self.assertEquals('Hello' * 400,
+				file(join(fs, 'foo.com/old')).read())
+			self.assert_(os.path.exists(hello))
+		if webserver():
+			write_site_file('hello', 'World' * 400)
+			write_site_file('old', 'Hello' * 400)
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+			webserver.handle_any('foo.com')	# hello and old
+
+		self.sync()
+
+		if user():
+			out = os.popen('%s foo.com' % refresh)
+			self.assertEquals('OK\n', out.readlines()[-1])
+			self.assertEquals(None, out.close())
+			os.mkdir(junk)
+			file(join(junk, 'file'), 'w').close()
+			self.restart_helper()	# Start a new GC pass
+			for i in range(30):
+				if not os.path.exists(old) and \
+				   not os.path.exists(junk):
+					break
+				print "Waiting..."
+				time.sleep(1)
+			self.assert_(not os.path.exists(old))
+			self.assert_(not os.path.exists(junk))
+			self.assertEquals('World' * 400,
+				file(join(fs, 'foo.com/hello')).read())
+		if webserver():
+			os.unlink(join(site, 'old'))
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+
+	def test21Dedup(self):
+		"""With --dedup, identical files share one copy, and a file
+		which is already in the store isn't fetched again."""
+		data = 'World' * 400
+		if user():
+			self.restart_helper('--dedup')
+			self.assertEquals(data, file(join(fs, 'foo.com/a/data')).read())
+			self.assertEquals(data, file(join(fs, 'foo.com/b/data')).read())
+			a = os.stat(join(cache, 'foo.com/a/data'))
+			b = os.stat(join(cache, 'foo.com/b/data'))
+			self.assertEquals(a.st_ino, b.st_ino)
+			self.assertEquals(3, a.st_nlink)	# And the store's link
+		if webserver():
+			for d in 'ab':
+				write_site_file(d + '/data', data)
+				os.utime(join(site, d, 'data'), (1000000000, 1000000000))
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+			webserver.handle_any('foo.com')	# a only
+
+	def test22Scrub(self):
+		"""A damaged file is moved into quarantine and fetched again."""
+		data = 'World' * 400
+		hello = join(cache, 'foo.com/hello')
+		quarantine = join(cache, '.0inst-quarantine')
+		if user():
+			self.assertEquals(data, file(join(fs, 'foo.com/hello')).read())
+			info = os.stat(hello)
+			f = file(hello, 'r+')
+			f.write('Earth')	# Same size; only the MD5sum can tell
+			f.close()
+			os.utime(hello, (info.st_atime, info.st_mtime))
+			os.environ['DEBUG_SCRUB_START'] = '0'
+			try:
+				self.restart_helper()
+			finally:
+				del os.environ['DEBUG_SCRUB_START']
+		if webserver():
+			write_site_file('hello', data)
+			build('foo.com')
+			webserver.handle_index('foo.com')
+			webserver.handle_any('foo.com')	# The index.bz
+			webserver.handle_any('foo.com')	# hello
+
+		self.sync()
+
+		if user():
+			for i in range(30):
+				if os.path.exists(hello) and \
+				   file(hello).read() == data:
+					break
+				print "Waiting..."
+				time.sleep(1)
+			self.assertEquals(data, file(hello).read())
+			damaged, = os.listdir(quarantine)
+			self.assertEquals('Earth' + data[5:],
+				file(join(quarantine, damaged, 'hello')).read())
+		if webserver():
+			webserver.handle_any('foo.com')	# hello again
+
 # Run the tests
 sys.argv.append('-v')
 unittest.main()
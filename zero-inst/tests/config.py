@@ -30,3 +30,9 @@ if ismount(fs):
 	assert not ismount(fs)
 
 os.environ['DEBUG_URI_0INSTALL_DIR'] = fs
+
+# Don't make the tests wait minutes for missing sites and tripped circuit
+# breakers to be tried again
+expiry = 2
+os.environ['DEBUG_NEGATIVE_TTL'] = str(expiry)
+os.environ['DEBUG_BREAKER_COOLDOWN'] = str(expiry)
@@ -44,6 +44,14 @@ class Webserver(Actor):
 		c.close()
 		print "Closed"
 	
+	def not_found(self, site):
+		site = site.replace('#', '/', 1)
+		c = self.accept('http://' + site + '/.0inst-index.tar.bz2')
+		c.write('HTTP/1.1 404 Not Found\r\n')
+		c.write('\r\n')
+		c.close()
+		print "Not found"
+	
 	def accept_path(self):
 		print "Waiting for request"
 		s, addr = self.socket.accept()
@@ -79,7 +87,9 @@ class Webserver(Actor):
 		c.close()
 		print "Done"
 	
-	def handle_any(self, site):
+	def accept_any(self, site):
+		"""Wait for a request for any file on 'site'. Returns the
+		connection, the path and the Range header (None if none)."""
 		print "Waiting for request"
 		s, addr = self.socket.accept()
 		
@@ -95,10 +105,46 @@ class Webserver(Actor):
 		assert unescape(rq_site) == site
 
 		print "Got request for", path
+		byte_range = None
 		for line in c:
 			line = line.strip()
 			if not line: break
+			if line.lower().startswith('range:'):
+				byte_range = line.split(':', 1)[1].strip()
 
-		c.write('HTTP/1.1 200 OK\r\n\r\n')
-		c.write(file(join(www, path)).read())
+		return c, path, byte_range
+	
+	def reply(self, c, path, byte_range = None):
+		"""Send the file 'path', or just 'byte_range' of it (eg
+		'bytes=10-19')."""
+		data = file(join(www, path)).read()
+		if byte_range:
+			assert byte_range.startswith('bytes=')
+			first, last = map(int, byte_range[6:].split('-'))
+			c.write('HTTP/1.1 206 Partial Content\r\n')
+			c.write('Content-Range: bytes %d-%d/%d\r\n\r\n' %
+				(first, last, len(data)))
+			c.write(data[first:last + 1])
+		else:
+			c.write('HTTP/1.1 200 OK\r\n\r\n')
+			c.write(data)
 		c.close()
+
+	def handle_any(self, site):
+		c, path, byte_range = self.accept_any(site)
+		self.reply(c, path)
+	
+	def handle_range(self, site):
+		"""Serve a request for part of any file on 'site', failing
+		if it asks for the whole thing. Returns the path."""
+		c, path, byte_range = self.accept_any(site)
+		assert byte_range, "No Range header in request for " + path
+		self.reply(c, path, byte_range)
+		return path
+
+	def handle_many(self, site, n):
+		"""Accept 'n' requests before answering any of them, so that
+		they are all in progress at once."""
+		requests = [self.accept_any(site) for i in range(n)]
+		for c, path, byte_range in requests:
+			self.reply(c, path)
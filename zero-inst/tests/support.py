@@ -4,8 +4,9 @@ from config import site, www
 
 zero_build = join(realpath(dirname(sys.argv[0])), '0build')
 
-def build(site_name):
+def build(site_name, *options):
 	os.chdir(site)
-	if os.spawnl(os.P_WAIT, zero_build, zero_build, '--quiet', www, site_name):
+	if os.spawnv(os.P_WAIT, zero_build, [zero_build, '--quiet'] +
+			list(options) + [www, site_name]):
 		raise Exception('Error from 0build')
 	os.chdir('..')
@@ -0,0 +1,135 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* One-shot timers for the main loop. The main loop passes the result of
+ * timer_get_timeout() to select() and calls timer_run_due() when it wakes.
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "global.h"
+#include "support.h"
+#include "timer.h"
+
+struct _Timer {
+	struct timeval when;
+	void (*callback)(void *data);
+	void *data;
+
+	Timer *next;		/* Sorted by 'when' */
+};
+
+static Timer *timers = NULL;
+
+static int before(const struct timeval *a, const struct timeval *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_usec < b->tv_usec;
+}
+
+/* Call 'callback(data)' from the main loop in 'ms' milliseconds.
+ * Returns NULL on OOM. The timer is freed after it fires.
+ */
+Timer *timer_add(int ms, void (*callback)(void *data), void *data)
+{
+	Timer *timer, **prev;
+
+	assert(ms >= 0);
+
+	timer = my_malloc(sizeof(Timer));
+	if (!timer)
+		return NULL;
+
+	gettimeofday(&timer->when, NULL);
+	timer->when.tv_sec += ms / 1000;
+	timer->when.tv_usec += (ms % 1000) * 1000;
+	if (timer->when.tv_usec >= 1000000) {
+		timer->when.tv_sec++;
+		timer->when.tv_usec -= 1000000;
+	}
+	timer->callback = callback;
+	timer->data = data;
+
+	for (prev = &timers; *prev; prev = &(*prev)->next) {
+		if (before(&timer->when, &(*prev)->when))
+			break;
+	}
+	timer->next = *prev;
+	*prev = timer;
+
+	return timer;
+}
+
+/* Remove a timer which hasn't fired yet */
+void timer_cancel(Timer *timer)
+{
+	Timer **prev;
+
+	for (prev = &timers; *prev; prev = &(*prev)->next) {
+		if (*prev == timer) {
+			*prev = timer->next;
+			free(timer);
+			return;
+		}
+	}
+
+	assert(0);
+}
+
+/* Set 'tv' to the time until the next timer is due and return it, or
+ * return NULL if there are no timers (wait forever).
+ */
+struct timeval *timer_get_timeout(struct timeval *tv)
+{
+	struct timeval now;
+
+	if (!timers)
+		return NULL;
+
+	gettimeofday(&now, NULL);
+
+	if (!before(&now, &timers->when)) {
+		tv->tv_sec = 0;
+		tv->tv_usec = 0;
+		return tv;
+	}
+
+	tv->tv_sec = timers->when.tv_sec - now.tv_sec;
+	tv->tv_usec = timers->when.tv_usec - now.tv_usec;
+	if (tv->tv_usec < 0) {
+		tv->tv_sec--;
+		tv->tv_usec += 1000000;
+	}
+
+	return tv;
+}
+
+/* Call the callback for each timer which is now due. Callbacks may add
+ * or cancel other timers.
+ */
+void timer_run_due(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	while (timers && !before(&now, &timers->when)) {
+		Timer *timer = timers;
+
+		timers = timer->next;
+		timer->callback(timer->data);
+		free(timer);
+	}
+}
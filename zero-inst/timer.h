@@ -0,0 +1,6 @@
+typedef struct _Timer Timer;
+
+Timer *timer_add(int ms, void (*callback)(void *data), void *data);
+void timer_cancel(Timer *timer);
+struct timeval *timer_get_timeout(struct timeval *tv);
+void timer_run_due(void);
@@ -0,0 +1,598 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Access traces. An entry point is an application directory (one with an
+ * AppRun). When we first have to fetch something inside one, we record
+ * which files of that site get fetched over the next few seconds. The
+ * next time (after a refresh, or on another machine which has imported
+ * the trace), the recorded files are queued for prefetching straight away,
+ * so they download in parallel instead of one miss at a time.
+ *
+ * Entry points are named by the path of their AppRun, since AppRun itself
+ * is often small enough to be inline in the index and never missed.
+ *
+ * Traces are kept in the site's .0inst-meta/traces file, newest first:
+ *
+ *	entry /site/App/AppRun
+ *	/site/App/lib/file
+ *	...
+ *	(blank line)
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "global.h"
+#include "support.h"
+#include "index.h"
+#include "zero-install.h"
+#include "xml.h"
+#include "timer.h"
+#include "prefetch.h"
+#include "trace.h"
+
+#define TRACE_WINDOW 10		/* Seconds to record after an entry point */
+#define TRACE_MAX 64		/* Files per trace */
+#define TRACES_MAX 32		/* Traces kept per site */
+#define TRACES_SIZE_MAX 65536	/* Biggest traces file we'll read or write */
+
+typedef struct _Trace Trace;
+
+struct _Trace {
+	char *entry;
+	char *paths[TRACE_MAX];
+	int n;
+
+	Trace *next;
+};
+
+static Trace *recording = NULL;
+static char *recording_site = NULL;
+static Timer *recording_timer = NULL;
+
+static void free_traces(Trace *trace)
+{
+	while (trace) {
+		Trace *next = trace->next;
+		int i;
+
+		for (i = 0; i < trace->n; i++) {
+			if (trace->paths[i])
+				free(trace->paths[i]);
+		}
+		if (trace->entry)
+			free(trace->entry);
+		free(trace);
+
+		trace = next;
+	}
+}
+
+static Trace *new_trace(const char *entry)
+{
+	Trace *trace;
+
+	trace = my_malloc(sizeof(Trace));
+	if (!trace)
+		return NULL;
+	trace->n = 0;
+	trace->next = NULL;
+	trace->entry = my_strdup(entry);
+	if (!trace->entry) {
+		free(trace);
+		return NULL;
+	}
+
+	return trace;
+}
+
+/* 1 if 'path' is a path in 'site' which can go in a traces file */
+static int path_in_site(const char *path, const char *site)
+{
+	int len = strlen(site);
+
+	return path[0] == '/' && strncmp(path + 1, site, len) == 0 &&
+	       path[len + 1] == '/' && !strchr(path, '\n');
+}
+
+/* Parse the traces in 'data' (in the format above). All paths must be in
+ * 'site'. Returns NULL (with *err set) on error. The list may be empty.
+ */
+static Trace *parse_traces(const char *data, const char *site,
+			   const char **err)
+{
+	Trace *traces = NULL, **tail = &traces, *trace = NULL;
+	char line[MAX_PATH_LEN];
+	int n_traces = 0;
+
+	*err = NULL;
+
+	while (*data) {
+		const char *nl;
+		int len;
+
+		nl = strchr(data, '\n');
+		len = nl ? nl - data : strlen(data);
+		if (len >= sizeof(line)) {
+			*err = "Line too long in trace";
+			goto err;
+		}
+		memcpy(line, data, len);
+		line[len] = '\0';
+		data += nl ? len + 1 : len;
+
+		if (!*line) {
+			trace = NULL;
+		} else if (strncmp(line, "entry ", 6) == 0) {
+			if (!path_in_site(line + 6, site)) {
+				*err = "Bad entry point in trace";
+				goto err;
+			}
+			if (n_traces++ >= TRACES_MAX) {
+				trace = NULL;
+				break;
+			}
+			trace = new_trace(line + 6);
+			if (!trace)
+				goto oom;
+			*tail = trace;
+			tail = &trace->next;
+		} else if (!trace || !path_in_site(line, site)) {
+			*err = "Bad path in trace";
+			goto err;
+		} else if (trace->n < TRACE_MAX) {
+			trace->paths[trace->n] = my_strdup(line);
+			if (!trace->paths[trace->n])
+				goto oom;
+			trace->n++;
+		}
+	}
+
+	return traces;
+oom:
+	*err = "Out of memory";
+err:
+	free_traces(traces);
+	return NULL;
+}
+
+/* Load the site's traces. NULL (with *err set) on error. A missing file is
+ * the same as an empty one.
+ */
+static Trace *load_traces(const char *site, const char **err)
+{
+	char *path, *data = NULL;
+	Trace *traces = NULL;
+	FILE *file = NULL;
+	int len;
+
+	*err = "Out of memory";
+
+	path = build_string("%s/%s/" META "/traces", cache_dir, site);
+	if (!path)
+		return NULL;
+
+	file = fopen(path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			*err = NULL;
+		else {
+			error("fopen '%s': %m", path);
+			*err = "Can't read traces";
+		}
+		goto out;
+	}
+
+	/* Read one byte more than we allow, to notice a file too big */
+	data = my_malloc(TRACES_SIZE_MAX + 2);
+	if (!data)
+		goto out;
+	len = fread(data, 1, TRACES_SIZE_MAX + 1, file);
+	if (ferror(file)) {
+		error("fread '%s': %m", path);
+		*err = "Can't read traces";
+		goto out;
+	}
+	if (len > TRACES_SIZE_MAX) {
+		*err = "Traces file too big";
+		goto out;
+	}
+	data[len] = '\0';
+
+	traces = parse_traces(data, site, err);
+out:
+	if (file)
+		fclose(file);
+	if (data)
+		free(data);
+	free(path);
+	return traces;
+}
+
+/* Bytes 'trace' takes up in a traces file */
+static long trace_size(Trace *trace)
+{
+	long size;
+	int i;
+
+	size = sizeof("entry \n") - 1 + strlen(trace->entry) + 1;
+	for (i = 0; i < trace->n; i++)
+		size += strlen(trace->paths[i]) + 1;
+
+	return size;
+}
+
+/* Replace the site's traces file. The oldest traces are left out if
+ * they won't all fit in TRACES_SIZE_MAX. 1 on success.
+ */
+static int save_traces(const char *site, Trace *traces)
+{
+	char *path, *tmp = NULL;
+	FILE *file;
+	long size = 0;
+	int ok = 0;
+
+	path = build_string("%s/%s/" META "/traces", cache_dir, site);
+	if (!path)
+		return 0;
+	tmp = build_string("%s.new", path);
+	if (!tmp)
+		goto out;
+
+	file = fopen(tmp, "w");
+	if (!file) {
+		error("fopen '%s': %m", tmp);
+		goto out;
+	}
+
+	for (; traces; traces = traces->next) {
+		int i;
+
+		size += trace_size(traces);
+		if (size > TRACES_SIZE_MAX)
+			break;
+
+		fprintf(file, "entry %s\n", traces->entry);
+		for (i = 0; i < traces->n; i++)
+			fprintf(file, "%s\n", traces->paths[i]);
+		fprintf(file, "\n");
+	}
+
+	if (fclose(file)) {
+		error("fclose: %m");
+		goto out;
+	}
+
+	if (rename(tmp, path)) {
+		error("rename: %m");
+		goto out;
+	}
+
+	ok = 1;
+out:
+	if (tmp)
+		free(tmp);
+	free(path);
+	return ok;
+}
+
+/* Put 'new' at the start of 'traces', replacing any traces for the same
+ * entry points, and drop the oldest if there are too many.
+ * Returns the new list.
+ */
+static Trace *merge_traces(Trace *traces, Trace *new)
+{
+	Trace **prev, *t, *n;
+	int count = 0;
+
+	for (prev = &traces; *prev;) {
+		t = *prev;
+		for (n = new; n; n = n->next) {
+			if (strcmp(n->entry, t->entry) == 0)
+				break;
+		}
+		if (n) {
+			*prev = t->next;
+			t->next = NULL;
+			free_traces(t);
+		} else
+			prev = &t->next;
+	}
+
+	for (n = new; n->next; n = n->next)
+		;
+	n->next = traces;
+
+	for (t = new; t; t = t->next) {
+		if (++count == TRACES_MAX) {
+			free_traces(t->next);
+			t->next = NULL;
+			break;
+		}
+	}
+
+	return new;
+}
+
+/* Add to 'trace' the files in the old trace for the same entry (if any)
+ * which weren't needed this time, so that a later, partial recording
+ * doesn't lose them.
+ */
+static void add_old_paths(Trace *trace, Trace *traces)
+{
+	int i, j;
+
+	for (; traces; traces = traces->next) {
+		if (strcmp(traces->entry, trace->entry) == 0)
+			break;
+	}
+	if (!traces)
+		return;
+
+	for (i = 0; i < traces->n && trace->n < TRACE_MAX; i++) {
+		for (j = 0; j < trace->n; j++) {
+			if (strcmp(trace->paths[j], traces->paths[i]) == 0)
+				break;
+		}
+		if (j < trace->n)
+			continue;
+		trace->paths[trace->n] = traces->paths[i];
+		traces->paths[i] = NULL;
+		trace->n++;
+	}
+}
+
+/* Save the trace being recorded, if any */
+static void finish_recording(void)
+{
+	Trace *traces;
+	const char *err;
+
+	if (recording_timer) {
+		timer_cancel(recording_timer);
+		recording_timer = NULL;
+	}
+
+	if (recording && recording_site && recording->n) {
+		traces = load_traces(recording_site, &err);
+		if (err)
+			error("Not saving trace (%s)", err);
+		else {
+			add_old_paths(recording, traces);
+			traces = merge_traces(traces, recording);
+			recording = NULL;
+			if (!save_traces(recording_site, traces))
+				error("Failed to save trace");
+			free_traces(traces);
+		}
+	}
+
+	free_traces(recording);
+	recording = NULL;
+	if (recording_site)
+		free(recording_site);
+	recording_site = NULL;
+}
+
+static void recording_timeout(void *data)
+{
+	recording_timer = NULL;
+	finish_recording();
+}
+
+static void check_apprun(Element *item, void *data)
+{
+	int *found = data;
+
+	if ((item->name[0] == 'f' || item->name[0] == 'e') &&
+	    strcmp(xml_get_attr(item, "name"), "AppRun") == 0)
+		*found = 1;
+}
+
+/* If 'path' (in 'group') is inside an application directory, set 'entry'
+ * (MAX_PATH_LEN) to the path of its AppRun and return 1.
+ */
+static int find_entry(const char *path, Element *group, char *entry)
+{
+	Element *dir;
+
+	if (strlen(path) + sizeof("/AppRun") > MAX_PATH_LEN)
+		return 0;
+	strcpy(entry, path);
+
+	for (dir = group->parentNode; dir->name[0] == 'd';
+	     dir = dir->parentNode) {
+		int found = 0;
+
+		*strrchr(entry, '/') = '\0';	/* Path of 'dir' */
+
+		index_foreach(dir, check_apprun, &found);
+		if (found) {
+			strcat(entry, "/AppRun");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* 1 if 'path' is inside the application directory for 'entry' */
+static int in_app(const char *path, const char *entry)
+{
+	int len = strrchr(entry, '/') - entry;
+
+	return strncmp(path, entry, len) == 0 && path[len] == '/';
+}
+
+/* Queue everything in the trace for 'entry' for prefetching */
+static void replay(const char *entry, Index *index)
+{
+	Trace *traces, *trace;
+	const char *err;
+	int i;
+
+	traces = load_traces(index->site, &err);
+	if (err)
+		error("Can't replay trace (%s)", err);
+
+	for (trace = traces; trace; trace = trace->next) {
+		if (strcmp(trace->entry, entry) != 0)
+			continue;
+
+		syslog(LOG_INFO, "Replaying trace for '%s' (%d files)",
+				entry, trace->n);
+		for (i = 0; i < trace->n; i++)
+			prefetch_path(trace->paths[i], index);
+		break;
+	}
+
+	free_traces(traces);
+}
+
+/* We've just started fetching 'path' (in 'group') for the kernel. If
+ * we're not already recording for its application, replay any trace for
+ * it and start recording a new one. Add 'path' to the current trace.
+ */
+void trace_note_fetch(const char *path, Element *group, Index *index)
+{
+	char entry[MAX_PATH_LEN];
+	int i;
+
+	if (!path_in_site(path, index->site))
+		return;
+
+	if (!(recording && strcmp(recording_site, index->site) == 0 &&
+	      in_app(path, recording->entry)) &&
+	    find_entry(path, group, entry)) {
+		finish_recording();
+
+		replay(entry, index);
+
+		recording_site = my_strdup(index->site);
+		recording = new_trace(entry);
+		if (recording && recording_site)
+			recording_timer = timer_add(TRACE_WINDOW * 1000,
+						recording_timeout, NULL);
+		if (!recording_timer) {
+			finish_recording();
+			return;
+		}
+	}
+
+	if (!recording || strcmp(recording_site, index->site) != 0 ||
+	    recording->n >= TRACE_MAX)
+		return;
+
+	for (i = 0; i < recording->n; i++) {
+		if (strcmp(recording->paths[i], path) == 0)
+			return;
+	}
+
+	recording->paths[recording->n] = my_strdup(path);
+	if (recording->paths[recording->n])
+		recording->n++;
+}
+
+/* Return the contents of the site's traces file, for copying to another
+ * machine. free() the result. NULL on error.
+ */
+char *trace_export(const char *site)
+{
+	Trace *traces;
+	const char *err;
+	char *path, *data;
+	FILE *file;
+	int len;
+
+	/* Check it parses, so we don't export rubbish */
+	traces = load_traces(site, &err);
+	if (err)
+		return NULL;
+	free_traces(traces);
+
+	data = my_malloc(TRACES_SIZE_MAX + 1);
+	if (!data)
+		return NULL;
+	*data = '\0';
+
+	path = build_string("%s/%s/" META "/traces", cache_dir, site);
+	if (!path) {
+		free(data);
+		return NULL;
+	}
+
+	file = fopen(path, "r");
+	if (file) {
+		len = fread(data, 1, TRACES_SIZE_MAX, file);
+		data[len] = '\0';
+		if (ferror(file)) {
+			error("fread '%s': %m", path);
+			free(data);
+			data = NULL;
+		}
+		fclose(file);
+	}
+
+	free(path);
+
+	return data;
+}
+
+/* Add the traces in 'data' (as from trace_export()) to the site's traces,
+ * replacing any for the same entry points. Returns an error message, or
+ * NULL on success.
+ */
+const char *trace_import(const char *site, const char *data)
+{
+	Trace *new, *traces;
+	const char *err;
+	char *meta;
+	int ok;
+
+	if (strlen(data) > TRACES_SIZE_MAX)
+		return "Trace too big";
+
+	new = parse_traces(data, site, &err);
+	if (err)
+		return err;
+	if (!new)
+		return NULL;	/* Nothing to add */
+
+	meta = build_string("%s/%s/" META, cache_dir, site);
+	if (!meta) {
+		free_traces(new);
+		return "Out of memory";
+	}
+	ok = access(meta, F_OK) == 0;
+	free(meta);
+	if (!ok) {
+		free_traces(new);
+		return "Site not cached yet; refresh it first";
+	}
+
+	traces = load_traces(site, &err);
+	if (err) {
+		free_traces(new);
+		return err;
+	}
+
+	traces = merge_traces(traces, new);
+	ok = save_traces(site, traces);
+	free_traces(traces);
+
+	return ok ? NULL : "Failed to save traces";
+}
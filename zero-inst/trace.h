@@ -0,0 +1,3 @@
+void trace_note_fetch(const char *path, Element *group, Index *index);
+char *trace_export(const char *site);
+const char *trace_import(const char *site, const char *data);
@@ -57,6 +57,20 @@
 #include "zero-install.h"
 #include "task.h"
 #include "xml.h"
+#include "timer.h"
+#include "prefetch.h"
+#include "trace.h"
+#include "refresh.h"
+#include "negative.h"
+#include "breaker.h"
+#include "gc.h"
+#include "catalog.h"
+#include "store.h"
+#include "scrub.h"
+#include "metrics.h"
+#include "spans.h"
+#include "log.h"
+#include "status.h"
 
 int copy_stderr = 1;	/* False once closed... */
 
@@ -66,6 +80,44 @@ int mnt_dir_len = sizeof("/uri/0install") - 1;
 
 int verbose = 0; /* (debug) */
 
+/* If set, archives whose files have their own MD5 sums in the index are
+ * unpacked as they download, and each request is woken up as soon as its
+ * own file is ready (--early-wakeup).
+ */
+int early_wakeup = 0;
+
+/* If set, nothing is downloaded; only cached files can be used
+ * (--offline, or the SetOffline control method).
+ */
+int offline = 0;
+
+/* If non-zero, least recently used groups are removed from the cache
+ * when it gets bigger than this many bytes (--max-cache=MB). See gc.c.
+ */
+long max_cache_size = 0;
+
+/* If set, identical files in the cache share a single copy (--dedup).
+ * See store.c.
+ */
+int dedup = 0;
+
+/* The background scrubber reads at most this many KB per second (0 to
+ * turn it off; --scrub-rate=KB), and uses at most this percentage of the
+ * CPU time (--scrub-cpu=PERCENT). See scrub.c.
+ */
+long scrub_rate = 1024;
+int scrub_cpu = 5;
+
+/* If non-zero, the metrics are written to a file in the cache directory
+ * this often (--metrics=SECONDS). See metrics.c.
+ */
+int metrics_interval = 0;
+
+/* The most recent spans kept for SIGUSR2 or DumpSpans (0 to record none;
+ * --spans=N, or the SetSpans control method). See spans.c.
+ */
+int span_capacity = 0;
+
 /* When we need to use an index file, if it was created in the last hour
  * then don't bother to fetch it again. Otherwise, the overhead
  * of fetching the index again is pretty small compared to fetching the
@@ -79,6 +131,7 @@ int cache_dir_len;	/* strlen(cache_dir) */
 static const char *prog; /* argv[0] */
 
 static int finished = 0;
+static int dump_spans = 0;	/* Set by SIGUSR2 */
 
 static int to_wakeup_pipe = -1;	/* Write here to get noticed */
 
@@ -163,6 +216,8 @@ static void kernel_got_index(Task *task)
 
 	assert(task->index != NULL);
 
+	refresh_note_use(task->index->site);
+
 	slash = strchr(task->str + 1, '/');
 
 	if (slash)
@@ -172,6 +227,8 @@ static void kernel_got_index(Task *task)
 	if (!item) {
 		/* TODO: rebuild index files? */
 		error("%s not found in index!", task->str);
+		metrics_count("zeroinstall_kernel_requests_total", "error", 1);
+		negative_add(task->str);
 		my_close(task->fd);
 		task_destroy(task, "Item not found in index!");
 		return;
@@ -187,15 +244,28 @@ static void kernel_got_index(Task *task)
 		group = item->parentNode;
 		assert(group->name[0] == 'g');
 
+		if (fetch_inline_file(task->str, item) ||
+		    store_fetch_file(task->str, item))
+			goto hit;
+
 		task->child_task = fetch_archive(task->str,
-						 group, task->index);
+						 group, task->index, 0);
 		if (task->child_task) {
 			task->step = kernel_got_archive;
 			control_notify_update(task);
+			prefetch_note_miss(task->str, group, task->index);
+			trace_note_fetch(task->str, group, task->index);
+			metrics_count("zeroinstall_kernel_requests_total",
+				      "miss", 1);
 			return;
 		}
+		metrics_count("zeroinstall_kernel_requests_total", "error", 1);
+		goto out;
 	}
 
+hit:
+	metrics_count("zeroinstall_kernel_requests_total", "hit", 1);
+out:
 	my_close(task->fd);
 	task_destroy(task, NULL);
 }
@@ -206,6 +276,33 @@ void kernel_cancel_task(Task *task)
 	task_destroy(task, NULL);
 }
 
+/* 'archive' has put the file 'cache_path' in place, although the rest of
+ * the group isn't ready yet. Wake up any kernel requests waiting for just
+ * that file.
+ */
+void kernel_file_ready(Task *archive, const char *cache_path)
+{
+	Task *task;
+
+	if (strncmp(cache_path, cache_dir, cache_dir_len) != 0)
+		return;
+	cache_path += cache_dir_len;
+
+	task = all_tasks;
+	while (task) {
+		if (task->type == TASK_KERNEL && task->child_task == archive &&
+		    strcmp(task->str, cache_path) == 0) {
+			if (verbose)
+				error("Early wakeup for '%s'", task->str);
+			task->child_task = NULL;
+			my_close(task->fd);
+			task_destroy(task, NULL);
+			task = all_tasks;
+		} else
+			task = task->next;
+	}
+}
+
 static void kernel_task_step(Task *task, const char *err)
 {
 	if (!err)
@@ -252,8 +349,10 @@ static void handle_request(int request_fd, uid_t uid, char *path)
 
 	task->uid = uid;
 	task->fd = request_fd;
+	gettimeofday(&task->started, NULL);
 
 	task_steal_index(task, get_index(path, &task->child_task, 0));
+	span_record("get_index", task, NULL, &task->started, -1);
 	if (task->child_task) {
 		if (verbose)
 			error("Download now in progress...");
@@ -291,6 +390,12 @@ static void sigint(int signum)
 	write(to_wakeup_pipe, "\0", 1);	/* Wake up! */
 }
 
+static void sigusr2(int signum)
+{
+	dump_spans = 1;
+	write(to_wakeup_pipe, "\0", 1);	/* Wake up! */
+}
+
 static void read_from_helper(int helper)
 {
 	char buffer[MAXPATHLEN + 1];
@@ -360,6 +465,11 @@ static void read_from_wakeup(int wakeup)
 		exit(EXIT_FAILURE);
 	}
 
+	if (dump_spans) {
+		dump_spans = 0;
+		spans_dump();
+	}
+
 	while (1)
 	{
 		pid_t child;
@@ -369,8 +479,10 @@ static void read_from_wakeup(int wakeup)
 		if (child == 0 || child == -1)
 			return;
 
-		task_process_done(child,
-			WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		if (log_child_done(child))
+			continue;
+		breaker_child_done(child, status);
+		task_process_done(child, status);
 	}
 }
 
@@ -413,16 +525,29 @@ int main(int argc, char **argv)
 	int max_fd;
 	char *pid_file;
 	int background = 1;
+	int rebuild_catalog = 0;
 	char *cache_link;
+	int i;
 
 	{
-		char *uri_0install;
+		char *uri_0install, *seconds;
 
 		uri_0install = getenv("DEBUG_URI_0INSTALL_DIR");
 		if (uri_0install) {
 			mnt_dir = uri_0install;
 			mnt_dir_len = strlen(mnt_dir);
 		}
+
+		/* The unit-tests can't wait minutes for these */
+		seconds = getenv("DEBUG_NEGATIVE_TTL");
+		if (seconds)
+			negative_set_ttl(atoi(seconds));
+		seconds = getenv("DEBUG_BREAKER_COOLDOWN");
+		if (seconds)
+			breaker_set_cooldown(atoi(seconds));
+		seconds = getenv("DEBUG_SCRUB_START");
+		if (seconds)
+			scrub_set_start(atoi(seconds));
 	}
 
 	if (1)
@@ -440,14 +565,39 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
-	if (argv[1]) {
-		if (strcmp(argv[1], "--debug") == 0) {
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--debug") == 0) {
 			verbose = 1;
 			background = 0;
-		} else if (strcmp(argv[1], "--nodaemon") == 0)
+		} else if (strcmp(argv[i], "--nodaemon") == 0)
 			background = 0;
+		else if (strcmp(argv[i], "--early-wakeup") == 0)
+			early_wakeup = 1;
+		else if (strcmp(argv[i], "--offline") == 0)
+			offline = 1;
+		else if (strcmp(argv[i], "--rebuild-catalog") == 0)
+			rebuild_catalog = 1;
+		else if (strcmp(argv[i], "--dedup") == 0)
+			dedup = 1;
+		else if (strncmp(argv[i], "--max-cache=", 12) == 0)
+			max_cache_size = atol(argv[i] + 12) * 1024 * 1024;
+		else if (strncmp(argv[i], "--scrub-rate=", 13) == 0)
+			scrub_rate = atol(argv[i] + 13);
+		else if (strncmp(argv[i], "--scrub-cpu=", 12) == 0)
+			scrub_cpu = atoi(argv[i] + 12);
+		else if (strncmp(argv[i], "--metrics=", 10) == 0)
+			metrics_interval = atoi(argv[i] + 10);
+		else if (strncmp(argv[i], "--spans=", 8) == 0)
+			span_capacity = atoi(argv[i] + 8);
+		else {
+			error("Unknown option '%s'", argv[i]);
+			return EXIT_FAILURE;
+		}
 	}
 
+	if (verbose)
+		log_set_level("all", LOG_DEBUG);
+
 	REQUIRE("bzip2", "--help");
 	REQUIRE("tar", "--version");
 	REQUIRE("gzip", "--version");
@@ -479,6 +629,14 @@ int main(int argc, char **argv)
 	cache_dir[cache_dir_len] = '\0';
 
 	fetch_init();
+	if (catalog_open(rebuild_catalog) && rebuild_catalog)
+		gc_rebuild();
+	gc_init();
+	scrub_init();
+	metrics_init();
+	status_init();
+	if (span_capacity > 0 && !spans_set_capacity(span_capacity))
+		return EXIT_FAILURE;
 
 #if 0
 	printf("Literal: %s\n", build_string("Hello world"));
@@ -533,6 +691,13 @@ int main(int argc, char **argv)
 	if (sigaction(SIGINT, &act, NULL))
 		abort();
 
+	/* SIGUSR2 writes out the recorded spans */
+	act.sa_handler = sigusr2;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	if (sigaction(SIGUSR2, &act, NULL))
+		abort();
+
 	create_control_socket();
 
 	if (wakeup_pipe[0] > helper)
@@ -578,11 +743,15 @@ int main(int argc, char **argv)
 	} else
 		create_pid_file(getpid());
 
+	log_start();
+	status_start();
+
 	if (verbose)
 		error("Zero Install now accepting requests...");
 
 	while (!finished) {
 		fd_set rfds, wfds;
+		struct timeval tv;
 		int n = max_fd + 1;
 
 		FD_ZERO(&rfds);
@@ -592,8 +761,10 @@ int main(int argc, char **argv)
 		FD_SET(wakeup_pipe[0], &rfds);
 
 		n = control_add_select(n, &rfds, &wfds);
+		n = log_add_select(n, &wfds);
 
-		if (select(n, &rfds, &wfds, NULL, NULL) == -1) {
+		if (select(n, &rfds, &wfds, NULL,
+			   timer_get_timeout(&tv)) == -1) {
 			if (errno == EINTR)
 				continue;
 			error("select: %m");
@@ -607,6 +778,10 @@ int main(int argc, char **argv)
 			read_from_wakeup(wakeup_pipe[0]);
 		
 		control_check_select(&rfds, &wfds);
+
+		log_check_select(&wfds);
+
+		timer_run_due();
 	}
 
 	/* Doing a clean shutdown is mainly for valgrind's benefit */
@@ -614,6 +789,12 @@ int main(int argc, char **argv)
 
 	control_drop_clients();
 
+	catalog_close();
+
+	status_close();
+
+	log_stop();
+
 	pid_file = build_string("%s/.0inst-pid", cache_dir);
 	if (unlink(pid_file))
 		error("unlink pid file: %m");
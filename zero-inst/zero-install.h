@@ -1,4 +1,6 @@
 #define META ".0inst-meta"
+#define STAGED "staged"	/* New index archive, in META, until checked */
+#define INSTALLING "installing"	/* Checked STAGED, being put in place */
 
 #define MAX_PATH_LEN 4096
 #define MAX_URI_LEN 4096
@@ -9,4 +11,14 @@ extern int mnt_dir_len;
 extern char cache_dir[];
 extern int cache_dir_len;	/* strlen(cache_dir) */
 
+extern int early_wakeup;
+extern int offline;
+extern long max_cache_size;
+extern int dedup;
+extern long scrub_rate;
+extern int scrub_cpu;
+extern int metrics_interval;
+extern int span_capacity;
+
 void kernel_cancel_task(Task *task);
+void kernel_file_ready(Task *archive, const char *cache_path);
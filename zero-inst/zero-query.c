@@ -0,0 +1,168 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Asking the helper whether paths are cached (libzero-status). This uses
+ * the CacheStatus control method, which only looks at cached indexes and
+ * the cache itself, so unlike stat()ing the path it never starts a fetch
+ * or waits for one.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DBUS_API_SUBJECT_TO_CHANGE
+#include <dbus/dbus.h>
+
+#include "interface.h"
+#include "zero-status.h"
+
+#define SOCKET_PRE "unix:path="
+#define SOCKET_POST "/.lazyfs-cache/.control2"
+
+/* The path to send for 'path', which may be site/path, /site/path or
+ * a path under the mount point. free() the result.
+ */
+static char *helper_path(const char *path, const char *mnt_dir)
+{
+	int mnt_len = strlen(mnt_dir);
+	char *full;
+
+	if (strncmp(path, mnt_dir, mnt_len) == 0 && path[mnt_len] == '/')
+		path += mnt_len;
+	while (*path == '/')
+		path++;
+
+	full = malloc(strlen(path) + 2);
+	if (full)
+		sprintf(full, "/%s", path);
+	return full;
+}
+
+/* Find out whether each of the 'n' 'paths' is cached, filling in
+ * 'answers[0..n-1]'. Returns 0 on success, or -1 with a message in 'err'
+ * (of size 'err_len').
+ */
+int zero_status_query(const char **paths, int n, ZeroCacheStatus *answers,
+		      char *err, size_t err_len)
+{
+	DBusConnection *connection = NULL;
+	DBusMessage *message = NULL, *reply = NULL;
+	DBusError error;
+	const char *mnt_dir;
+	char *address = NULL;
+	char **sent = NULL, **states = NULL, **groups = NULL;
+	dbus_int64_t *sizes = NULL;
+	int n_states, n_groups, n_sizes;
+	int i, ret = -1;
+
+	dbus_error_init(&error);
+
+	/* For debugging, allow overriding /uri/0install */
+	mnt_dir = getenv("DEBUG_URI_0INSTALL_DIR");
+	if (!mnt_dir)
+		mnt_dir = ZERO_MNT;
+
+	sent = calloc(n + 1, sizeof(char *));
+	address = malloc(sizeof(SOCKET_PRE) + strlen(mnt_dir) +
+			 sizeof(SOCKET_POST));
+	if (!sent || !address)
+		goto oom;
+	sprintf(address, SOCKET_PRE "%s" SOCKET_POST, mnt_dir);
+
+	for (i = 0; i < n; i++) {
+		sent[i] = helper_path(paths[i], mnt_dir);
+		if (!sent[i])
+			goto oom;
+	}
+
+	message = dbus_message_new_method_call(NULL, "/Main",
+			DBUS_Z_NS, "CacheStatus");
+	if (!message || !dbus_message_append_args(message,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, sent, n,
+				DBUS_TYPE_INVALID))
+		goto oom;
+
+	connection = dbus_connection_open(address, &error);
+	if (dbus_error_is_set(&error))
+		goto dbus_err;
+
+	reply = dbus_connection_send_with_reply_and_block(connection, message,
+				60 * 1000, &error);
+	if (reply && dbus_set_error_from_message(&error, reply))
+		goto dbus_err;
+	if (!reply)
+		goto dbus_err;
+
+	if (!dbus_message_get_args(reply, &error,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&states, &n_states,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&groups, &n_groups,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_INT64,
+					&sizes, &n_sizes,
+				DBUS_TYPE_INVALID))
+		goto dbus_err;
+
+	if (n_states != n || n_groups != n || n_sizes != n) {
+		snprintf(err, err_len, "Wrong number of answers from helper");
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		const char *state = states[i];
+
+		answers[i].state =
+			strcmp(state, "cached") == 0 ? ZERO_CACHED :
+			strcmp(state, "missing") == 0 ? ZERO_MISSING :
+			strcmp(state, "not-found") == 0 ? ZERO_NOT_FOUND :
+			ZERO_UNKNOWN_SITE;
+		snprintf(answers[i].group, sizeof(answers[i].group), "%s",
+			 groups[i]);
+		answers[i].size = sizes[i];
+	}
+
+	ret = 0;
+	goto out;
+dbus_err:
+	snprintf(err, err_len, "%s", error.message);
+	dbus_error_free(&error);
+	goto out;
+oom:
+	snprintf(err, err_len, "Out of memory");
+out:
+	if (states)
+		dbus_free_string_array(states);
+	if (groups)
+		dbus_free_string_array(groups);
+	if (sizes)
+		dbus_free(sizes);
+	if (reply)
+		dbus_message_unref(reply);
+	if (message)
+		dbus_message_unref(message);
+	if (connection) {
+		dbus_connection_disconnect(connection);
+		dbus_connection_unref(connection);
+	}
+	if (sent) {
+		for (i = 0; i < n; i++) {
+			if (sent[i])
+				free(sent[i]);
+		}
+		free(sent);
+	}
+	if (address)
+		free(address);
+
+	return ret;
+}
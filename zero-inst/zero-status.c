@@ -0,0 +1,160 @@
+/*
+ * Zero Install -- user space helper
+ *
+ * Copyright (C) 2003  Thomas Leonard
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+/* Reader for the status table (libzero-status). A reader maps the table
+ * read-only and copies out the entries it wants; once opened, reading
+ * makes no system calls and never wakes the helper.
+ *
+ * The helper writes each entry as: seq++ (now odd), the new contents,
+ * seq++ (even again). A reader copies the entry between two reads of seq
+ * and tries again if seq was odd or changed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "zero-status.h"
+
+#define DEFAULT_PATH "/uri/0install/.lazyfs-cache/" ZERO_STATUS_FILE
+#define MAX_TRIES 100		/* Before giving up on a busy entry */
+
+struct _ZeroStatus {
+	void *map;
+	size_t len;
+	ZeroStatusHeader *header;
+	ZeroStatusEntry *entries;
+};
+
+/* Map the status table at 'path' (NULL for the usual place).
+ * NULL on error (errno is set).
+ */
+ZeroStatus *zero_status_open(const char *path)
+{
+	ZeroStatus *status;
+	struct stat info;
+	int fd;
+
+	fd = open(path ? path : DEFAULT_PATH, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	status = malloc(sizeof(ZeroStatus));
+	if (!status)
+		goto err;
+
+	if (fstat(fd, &info))
+		goto err;
+	if (info.st_size < sizeof(ZeroStatusHeader))
+		goto bad;
+
+	status->len = info.st_size;
+	status->map = mmap(NULL, status->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (status->map == MAP_FAILED)
+		goto err;
+	close(fd);
+	fd = -1;
+
+	status->header = status->map;
+	status->entries = (ZeroStatusEntry *) (status->header + 1);
+
+	if (status->header->magic != ZERO_STATUS_MAGIC ||
+	    status->header->version != ZERO_STATUS_VERSION ||
+	    status->header->entry_size != sizeof(ZeroStatusEntry) ||
+	    sizeof(ZeroStatusHeader) + status->header->slots *
+	    		sizeof(ZeroStatusEntry) > status->len) {
+		munmap(status->map, status->len);
+		goto bad;
+	}
+
+	return status;
+bad:
+	errno = EINVAL;
+err:
+	if (fd != -1) {
+		int old = errno;
+		close(fd);
+		errno = old;
+	}
+	if (status)
+		free(status);
+	return NULL;
+}
+
+/* 1 if the helper which wrote this table is still running. A new helper
+ * writes a new table, so reopen if not. The pid is 0 before the helper
+ * has started and after a clean shutdown; if it was killed, the process
+ * is gone.
+ */
+int zero_status_running(ZeroStatus *status)
+{
+	pid_t pid = status->header->pid;
+
+	if (pid == 0)
+		return 0;
+
+	return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* Copy up to 'max' entries in use into 'entries'. Returns the number
+ * copied.
+ */
+int zero_status_read(ZeroStatus *status, ZeroStatusEntry *entries, int max)
+{
+	int i, n = 0;
+
+	for (i = 0; i < status->header->slots && n < max; i++) {
+		ZeroStatusEntry *entry = &status->entries[i];
+		uint32_t seq;
+		int tries;
+
+		for (tries = 0; tries < MAX_TRIES; tries++) {
+			seq = entry->seq;
+			__sync_synchronize();
+			if (seq & 1)
+				continue;
+			memcpy(&entries[n], entry, sizeof(ZeroStatusEntry));
+			__sync_synchronize();
+			if (entry->seq == seq)
+				break;
+		}
+
+		if (tries == MAX_TRIES || entries[n].state == ZERO_STATUS_FREE)
+			continue;
+
+		entries[n].path[ZERO_STATUS_PATH_LEN - 1] = '\0';
+		n++;
+	}
+
+	return n;
+}
+
+const char *zero_status_state_name(int state)
+{
+	return state == ZERO_STATUS_WAITING ? "waiting" :
+	       state == ZERO_STATUS_QUEUED ? "queued" :
+	       state == ZERO_STATUS_DOWNLOADING ? "downloading" :
+	       state == ZERO_STATUS_UNPACKING ? "unpacking" :
+	       state == ZERO_STATUS_BUSY ? "busy" :
+	       "unused";
+}
+
+void zero_status_close(ZeroStatus *status)
+{
+	munmap(status->map, status->len);
+	free(status);
+}
@@ -0,0 +1,76 @@
+/* Reading the helper's status table (see zero-status.c).
+ *
+ * The table is a file in the cache directory which the helper keeps
+ * mapped and updates in place. Each entry is protected by its own
+ * sequence count (odd while being written), so readers never block the
+ * helper and never need to talk to it.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define ZERO_STATUS_FILE ".0inst-status"
+#define ZERO_STATUS_MAGIC 0x3069734c	/* "Lsi0" */
+#define ZERO_STATUS_VERSION 1
+#define ZERO_STATUS_SLOTS 256
+#define ZERO_STATUS_PATH_LEN 256
+
+/* Entry states */
+#define ZERO_STATUS_FREE 0		/* Unused entry */
+#define ZERO_STATUS_WAITING 1		/* For task 'waiting_for' */
+#define ZERO_STATUS_QUEUED 2		/* Waiting to start */
+#define ZERO_STATUS_DOWNLOADING 3
+#define ZERO_STATUS_UNPACKING 4
+#define ZERO_STATUS_BUSY 5		/* Something else */
+
+typedef struct _ZeroStatus ZeroStatus;
+typedef struct _ZeroStatusHeader ZeroStatusHeader;
+typedef struct _ZeroStatusEntry ZeroStatusEntry;
+
+struct _ZeroStatusHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t entry_size;	/* sizeof(ZeroStatusEntry) */
+	int32_t pid;		/* Helper's PID, or 0 if not running */
+	uint32_t pad;
+	int64_t updated;	/* time() of the last change */
+	char reserved[32];
+};
+
+struct _ZeroStatusEntry {
+	volatile uint32_t seq;	/* Odd while the entry is being changed */
+	uint32_t state;		/* ZERO_STATUS_* */
+	int32_t task;		/* Task number */
+	int32_t waiting_for;	/* Task number, or 0 */
+	int32_t uid;		/* User who asked for it, or -1 */
+	uint32_t pad;
+	int64_t received;	/* Bytes downloaded so far */
+	int64_t size;		/* Bytes expected, or -1 if unknown */
+	int64_t rate;		/* Bytes per second, recently */
+	int64_t started;	/* time() the download began, or 0 */
+	char path[ZERO_STATUS_PATH_LEN];
+};
+
+/* Answers from zero_status_query() */
+#define ZERO_CACHED 0
+#define ZERO_MISSING 1		/* 'group' and 'size' say what would be fetched */
+#define ZERO_NOT_FOUND 2	/* Not in the site's index */
+#define ZERO_UNKNOWN_SITE 3	/* The site's index isn't cached */
+
+typedef struct _ZeroCacheStatus ZeroCacheStatus;
+
+struct _ZeroCacheStatus {
+	int state;		/* ZERO_CACHED, etc */
+	char group[33];		/* The group's MD5sum, or "" */
+	int64_t size;		/* The group's size, or 0 */
+};
+
+ZeroStatus *zero_status_open(const char *path);
+int zero_status_running(ZeroStatus *status);
+int zero_status_read(ZeroStatus *status, ZeroStatusEntry *entries, int max);
+const char *zero_status_state_name(int state);
+void zero_status_close(ZeroStatus *status);
+
+int zero_status_query(const char **paths, int n, ZeroCacheStatus *answers,
+		      char *err, size_t err_len);